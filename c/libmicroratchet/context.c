@@ -3,7 +3,7 @@
 #include "internal.h"
 
 // forward
-static mr_result construct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amount, uint32_t spaceavail, bool includeecdh, _mr_ratchet_state* step);
+static mr_result construct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amount, uint32_t spaceavail, bool includeecdh, _mr_ratchet_state* step, const mr_iovec* fragments, uint32_t fragmentcount);
 static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amount, uint8_t** payload, uint32_t* payloadsize, const uint8_t* headerkey, uint32_t headerkeysize, _mr_ratchet_state* step, bool usedNextKey);
 
 static inline void be_packu32(uint32_t value, uint8_t* target)
@@ -104,7 +104,10 @@ static mr_result sign(_mr_ctx* ctx, uint8_t* data, uint32_t datasize, mr_ecdsa_c
 	return MR_E_SUCCESS;
 }
 
-static mr_result verifysig(_mr_ctx* ctx, const uint8_t* data, uint32_t datasize, const uint8_t* pubkey, uint32_t pubkeysize, bool* result)
+// checks the signature at the end of data. If it is the one in checked,
+// if given, it was found valid already.
+static mr_result verifysig(_mr_ctx* ctx, const uint8_t* data, uint32_t datasize, const uint8_t* pubkey, uint32_t pubkeysize,
+	const _mr_checked_signature* checked, bool* result)
 {
 	FAILIF(!ctx || !data || !pubkey || !result, MR_E_INVALIDARG, "Some of the required arguments were null");
 	FAILIF(datasize < SIGNATURE_SIZE + 1, MR_E_INVALIDSIZE, "The data size was too small. Must be at least the size of a signature and one byte extra");
@@ -113,20 +116,44 @@ static mr_result verifysig(_mr_ctx* ctx, const uint8_t* data, uint32_t datasize,
 	uint8_t sha[DIGEST_SIZE];
 	uint32_t sigresult = 0;
 	_C(digest(ctx, data, datasize - SIGNATURE_SIZE, sha, sizeof(sha)));
-	_C(mr_ecdsa_verify_other(data + datasize - SIGNATURE_SIZE, SIGNATURE_SIZE,
-		sha, DIGEST_SIZE,
-		pubkey, pubkeysize,
-		&sigresult));
+	if (checked &&
+		pubkeysize == ECNUM_SIZE &&
+		memcmp(checked->signature, data + datasize - SIGNATURE_SIZE, SIGNATURE_SIZE) == 0 &&
+		memcmp(checked->digest, sha, DIGEST_SIZE) == 0 &&
+		memcmp(checked->publickey, pubkey, ECNUM_SIZE) == 0)
+	{
+		// checked ahead of time along with others
+		sigresult = 1;
+	}
+	else if (ctx->config.verifier_cache)
+	{
+		_C(verifier_cache_verify(ctx->config.verifier_cache,
+			data + datasize - SIGNATURE_SIZE, SIGNATURE_SIZE,
+			sha, DIGEST_SIZE,
+			pubkey, pubkeysize,
+			&sigresult));
+	}
+	else
+	{
+		_C(mr_ecdsa_verify_other(data + datasize - SIGNATURE_SIZE, SIGNATURE_SIZE,
+			sha, DIGEST_SIZE,
+			pubkey, pubkeysize,
+			&sigresult));
+	}
 	TRACEDATA("verify signature hash ", sha, DIGEST_SIZE);
 	TRACEDATA(sigresult ? "verify signature GOOD " : "verify signature BAD  ", data + datasize - SIGNATURE_SIZE, SIGNATURE_SIZE);
 	*result = !!sigresult;
 	return MR_E_SUCCESS;
 }
 
-static mr_result crypt(_mr_ctx* ctx, uint8_t* data, uint32_t datasize, const uint8_t* key, uint32_t keysize, const uint8_t* iv, uint32_t ivsize)
+// encrypts the fragments one after the other into output. Whatever
+// space in output is left after the fragments is zeroed and encrypted.
+static mr_result crypt_gather(_mr_ctx* ctx, const mr_iovec* fragments, uint32_t fragmentcount, uint8_t* output, uint32_t outputsize,
+	const uint8_t* key, uint32_t keysize, const uint8_t* iv, uint32_t ivsize)
 {
-	FAILIF(!ctx || !data || !key || !iv, MR_E_INVALIDARG, "Some of the required arguments were null");
-	FAILIF(datasize < 1, MR_E_INVALIDSIZE, "At least one byte of data must be specified");
+	FAILIF(!ctx || !output || !key || !iv, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(fragmentcount && !fragments, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(outputsize < 1, MR_E_INVALIDSIZE, "At least one byte of data must be specified");
 	FAILIF(keysize != KEY_SIZE && keysize != MSG_KEY_SIZE, MR_E_INVALIDSIZE, "The key size was invalid");
 	FAILIF(ivsize < NONCE_SIZE, MR_E_INVALIDSIZE, "The IV size was to small");
 
@@ -139,12 +166,34 @@ static mr_result crypt(_mr_ctx* ctx, uint8_t* data, uint32_t datasize, const uin
 	mr_result result = MR_E_SUCCESS;
 	_R(result, mr_aes_init(aes, key, keysize));
 	_R(result, aesctr_init(&cipher, aes, iv, ivsize));
-	_R(result, aesctr_process(&cipher, data, datasize, data, datasize));
+
+	uint32_t offset = 0;
+	for (uint32_t i = 0; i < fragmentcount && result == MR_E_SUCCESS; i++)
+	{
+		if (fragments[i].size)
+		{
+			_R(result, aesctr_process(&cipher, fragments[i].data, fragments[i].size, output + offset, outputsize - offset));
+			offset += fragments[i].size;
+		}
+	}
+
+	if (result == MR_E_SUCCESS && offset < outputsize)
+	{
+		mr_memzero(output + offset, outputsize - offset);
+		_R(result, aesctr_process(&cipher, output + offset, outputsize - offset, output + offset, outputsize - offset));
+	}
+
 	mr_aes_destroy(aes);
 	_C(result);
 	return MR_E_SUCCESS;
 }
 
+static mr_result crypt(_mr_ctx* ctx, uint8_t* data, uint32_t datasize, const uint8_t* key, uint32_t keysize, const uint8_t* iv, uint32_t ivsize)
+{
+	mr_iovec fragment = { data, datasize };
+	return crypt_gather(ctx, &fragment, 1, data, datasize, key, keysize, iv, ivsize);
+}
+
 mr_ctx mr_ctx_create(const mr_config* config)
 {
 	if (!config) return 0;
@@ -176,6 +225,152 @@ mr_result mr_ctx_set_identity(mr_ctx _ctx, mr_ecdsa_ctx identity, bool destroy_w
 	return MR_E_SUCCESS;
 }
 
+STATIC_ASSERT(COOKIE_SIZE == MR_COOKIE_SIZE, "The cookie size does not match the public definition");
+
+void ctx_free_server_initialization(_mr_ctx* ctx)
+{
+	if (ctx->init.server)
+	{
+		if (ctx->init.server->localratchetstep0)
+		{
+			mr_ecdh_destroy(ctx->init.server->localratchetstep0);
+		}
+		if (ctx->init.server->localratchetstep1)
+		{
+			mr_ecdh_destroy(ctx->init.server->localratchetstep1);
+		}
+		mr_memzero(ctx->init.server, sizeof(_mr_initialization_state_server));
+		mr_free(ctx, ctx->init.server);
+		ctx->init.server = 0;
+	}
+}
+
+static bool has_cookie(const uint8_t* message, uint32_t amount)
+{
+	return amount >= MIN_MESSAGE_SIZE_WITH_ECDH + COOKIE_SIZE &&
+		be_unpacku32((uint8_t*)message + amount - COOKIE_SIZE) == COOKIE_MARKER;
+}
+
+static uint32_t cookie_now(_mr_ctx* ctx)
+{
+	return ctx->config.cookie_clock ? ctx->config.cookie_clock(ctx->config.cookie_clock_user) : 0;
+}
+
+// computes the MAC of a cookie. It covers the peer so a cookie
+// is only accepted from the peer it was sent to.
+static mr_result cookie_mac(_mr_ctx* ctx, const uint8_t* cookie, const uint8_t* key, uint8_t* mac)
+{
+	const uint8_t* iv = cookie + 4;
+	mr_poly_ctx poly = mr_poly_create(ctx);
+	FAILIF(!poly, MR_E_NOMEM, "Could not allocate a POLY1305 instance");
+	mr_result result = MR_E_SUCCESS;
+	_R(result, mr_poly_init(poly, key, KEY_SIZE, iv, COOKIE_IV_SIZE));
+	_R(result, mr_poly_process(poly, iv, COOKIE_SIZE - 4 - MAC_SIZE));
+	if (ctx->config.cookie_peer && ctx->config.cookie_peer_size)
+	{
+		_R(result, mr_poly_process(poly, ctx->config.cookie_peer, ctx->config.cookie_peer_size));
+	}
+	_R(result, mr_poly_compute(poly, mac, MAC_SIZE));
+	mr_poly_destroy(poly);
+	return result;
+}
+
+// writes the server initialization state into a cookie. The first KEY_SIZE
+// bytes derived from the cookie key encrypt it and the rest authenticate it.
+static mr_result seal_cookie(_mr_ctx* ctx, uint8_t* cookie)
+{
+	_mr_initialization_state_server* s = ctx->init.server;
+	FAILIF(!s || !s->localratchetstep0 || !s->localratchetstep1, MR_E_INVALIDOP, "The server initialization state is incomplete");
+	FAILIF(mr_ecdh_store_size_needed(s->localratchetstep0) != ECNUM_SIZE ||
+		mr_ecdh_store_size_needed(s->localratchetstep1) != ECNUM_SIZE, MR_E_NOTIMPL, "ECDH keys of this size cannot be put in a cookie");
+
+	uint8_t* iv = cookie + 4;
+	uint8_t* state = iv + COOKIE_IV_SIZE + COOKIE_TIME_SIZE;
+	be_packu32(COOKIE_MARKER, cookie);
+	_C(mr_rng_generate(ctx->rng_ctx, iv, COOKIE_IV_SIZE));
+	be_packu32(cookie_now(ctx), iv + COOKIE_IV_SIZE);
+
+	// the root key and both header keys are next to each other
+	mr_memcpy(state, s->nextinitializationnonce, INITIALIZATION_NONCE_SIZE);
+	mr_memcpy(state + INITIALIZATION_NONCE_SIZE, s->rootkey, KEY_SIZE * 3);
+	mr_memcpy(state + INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3, s->clientpublickey, ECNUM_SIZE);
+	_C(mr_ecdh_store(s->localratchetstep0, state + INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3 + ECNUM_SIZE, ECNUM_SIZE));
+	_C(mr_ecdh_store(s->localratchetstep1, state + INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3 + ECNUM_SIZE * 2, ECNUM_SIZE));
+
+	uint8_t keys[KEY_SIZE * 2];
+	mr_result result = kdf_compute(ctx, ctx->config.cookie_key, KEY_SIZE, iv, COOKIE_IV_SIZE, keys, sizeof(keys));
+	_R(result, crypt(ctx, state, COOKIE_STATE_SIZE, keys, KEY_SIZE, iv, COOKIE_IV_SIZE));
+	_R(result, cookie_mac(ctx, cookie, keys + KEY_SIZE, cookie + COOKIE_SIZE - MAC_SIZE));
+	mr_memzero(keys, sizeof(keys));
+	return result;
+}
+
+// restores the server initialization state from the cookie at the end of
+// a message if it was made with the cookie key or the previous one, for
+// this peer and not too long ago. The marker and size are checked with
+// has_cookie and the age here before any key is derived, so made up
+// cookies are cheap to turn away.
+static mr_result open_cookie(_mr_ctx* ctx, const uint8_t* message, uint32_t amount)
+{
+	const uint8_t* cookie = message + amount - COOKIE_SIZE;
+	const uint8_t* iv = cookie + 4;
+	if (ctx->config.cookie_clock)
+	{
+		uint32_t lifetime = ctx->config.cookie_lifetime ? ctx->config.cookie_lifetime : COOKIE_LIFETIME;
+		FAILIF(cookie_now(ctx) - be_unpacku32((uint8_t*)iv + COOKIE_IV_SIZE) > lifetime, MR_E_NOTFOUND, "The cookie has expired");
+	}
+
+	const uint8_t* cookiekeys[2] = { ctx->config.cookie_key, ctx->config.previous_cookie_key };
+	uint8_t keys[KEY_SIZE * 2];
+	uint8_t mac[MAC_SIZE];
+	uint8_t state[COOKIE_STATE_SIZE];
+	bool valid = false;
+	mr_result result = MR_E_SUCCESS;
+	for (int i = 0; i < 2 && !valid && result == MR_E_SUCCESS; i++)
+	{
+		if (cookiekeys[i])
+		{
+			_R(result, kdf_compute(ctx, cookiekeys[i], KEY_SIZE, iv, COOKIE_IV_SIZE, keys, sizeof(keys)));
+			_R(result, cookie_mac(ctx, cookie, keys + KEY_SIZE, mac));
+			valid = result == MR_E_SUCCESS && memcmp(mac, cookie + COOKIE_SIZE - MAC_SIZE, MAC_SIZE) == 0;
+		}
+	}
+	if (valid)
+	{
+		mr_memcpy(state, iv + COOKIE_IV_SIZE + COOKIE_TIME_SIZE, COOKIE_STATE_SIZE);
+		_R(result, crypt(ctx, state, COOKIE_STATE_SIZE, keys, KEY_SIZE, iv, COOKIE_IV_SIZE));
+	}
+	mr_memzero(keys, sizeof(keys));
+	_C(result);
+	FAILIF(!valid, MR_E_NOTFOUND, "The cookie was not made with a current cookie key");
+
+	_mr_initialization_state_server* s;
+	_C(mr_allocate(ctx, sizeof(_mr_initialization_state_server), (void**)&s));
+	mr_memzero(s, sizeof(_mr_initialization_state_server));
+	ctx->init.server = s;
+
+	mr_memcpy(s->nextinitializationnonce, state, INITIALIZATION_NONCE_SIZE);
+	mr_memcpy(s->rootkey, state + INITIALIZATION_NONCE_SIZE, KEY_SIZE * 3);
+	mr_memcpy(s->clientpublickey, state + INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3, ECNUM_SIZE);
+	s->localratchetstep0 = mr_ecdh_create(ctx);
+	s->localratchetstep1 = mr_ecdh_create(ctx);
+	if (!s->localratchetstep0 || !s->localratchetstep1 ||
+		!mr_ecdh_load(s->localratchetstep0, state + INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3 + ECNUM_SIZE, ECNUM_SIZE) ||
+		!mr_ecdh_load(s->localratchetstep1, state + INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3 + ECNUM_SIZE * 2, ECNUM_SIZE))
+	{
+		result = MR_E_INVALIDOP;
+	}
+	mr_memzero(state, sizeof(state));
+
+	if (result != MR_E_SUCCESS)
+	{
+		ctx_free_server_initialization(ctx);
+		FAILMSG(result, "Could not restore the ECDH keys in the cookie");
+	}
+
+	return MR_E_SUCCESS;
+}
+
 static mr_result send_initialization_request(_mr_ctx* ctx, uint8_t* output, uint32_t spaceavail)
 {
 	FAILIF(!ctx || !output, MR_E_INVALIDARG, "Some of the required parameters were null");
@@ -230,6 +425,7 @@ static mr_result send_initialization_request(_mr_ctx* ctx, uint8_t* output, uint
 }
 
 static mr_result receive_initialization_request(_mr_ctx* ctx, uint8_t* data, uint32_t amount,
+	const _mr_checked_signature* checked,
 	uint8_t** initializationnonce, uint32_t* initializationnoncesize,
 	uint8_t** remoteecdhforinit, uint32_t* remoteecdhforinitsize)
 {
@@ -286,7 +482,12 @@ static mr_result receive_initialization_request(_mr_ctx* ctx, uint8_t* data, uin
 	_C(verifysig(ctx,
 		data, macOffset,
 		data + clientPublicKeyOffset, ECNUM_SIZE,
+		checked,
 		&sigvalid));
+	if (!sigvalid)
+	{
+		FAILMSG(MR_E_INVALIDOP, "The signature sent by the client was invalid.");
+	}
 
 	// store the client public key
 	mr_memcpy(ctx->init.server->clientpublickey, data + clientPublicKeyOffset, ECNUM_SIZE);
@@ -310,6 +511,7 @@ static mr_result send_initialization_response(_mr_ctx* ctx,
 	FAILIF(initializationnoncesize != INITIALIZATION_NONCE_SIZE, MR_E_INVALIDSIZE, "The initialization nonce size was invalid");
 	FAILIF(remoteecdhforinitsize != ECNUM_SIZE, MR_E_INVALIDSIZE, "The ECDH public key was of an incorrect size");
 	FAILIF(spaceavail < INIT_RES_MSG_SIZE, MR_E_INVALIDSIZE, "The amount of space available is less than the minimum space required for an initialization response");
+	FAILIF(ctx->config.cookie_key && spaceavail < INIT_RES_MSG_SIZE + COOKIE_SIZE, MR_E_INVALIDSIZE, "The amount of space available is too small for an initialization response with a cookie");
 	FAILIF(!ctx->init.server, MR_E_INVALIDOP, "Server initialization state is null");
 
 	TRACEMSGCTX(ctx, "--send_initialization_response");
@@ -390,6 +592,14 @@ static mr_result send_initialization_response(_mr_ctx* ctx,
 	// server ratchet 1
 	mr_memcpy(encryptedPayload + INITIALIZATION_NONCE_SIZE + ECNUM_SIZE * 2,
 		rre1, ECNUM_SIZE);
+	// the cookie if there is one, otherwise zeroes
+	uint32_t paddingOffset = INITIALIZATION_NONCE_SIZE + ECNUM_SIZE * 3;
+	uint32_t paddingSize = encryptedPayloadSize - paddingOffset - SIGNATURE_SIZE;
+	mr_memzero(encryptedPayload + paddingOffset, paddingSize);
+	if (ctx->config.cookie_key)
+	{
+		_C(seal_cookie(ctx, encryptedPayload + paddingOffset));
+	}
 
 	// sign the message
 	_C(sign(ctx, output, macOffset, ctx->identity));
@@ -468,12 +678,22 @@ static mr_result receive_initialization_response(_mr_ctx* ctx,
 	_C(verifysig(ctx,
 		data, headerSize + payloadSize,
 		payload + INITIALIZATION_NONCE_SIZE, ECNUM_SIZE,
+		0,
 		&sigvalid));
 	if (!sigvalid)
 	{
 		FAILMSG(MR_E_INVALIDOP, "The signature sent by the server was invalid.");
 	}
 
+	// keep the cookie if the server sent one
+	uint32_t cookieOffset = INITIALIZATION_NONCE_SIZE + ECNUM_SIZE * 3;
+	if (payloadSize >= cookieOffset + COOKIE_SIZE + SIGNATURE_SIZE &&
+		be_unpacku32(payload + cookieOffset) == COOKIE_MARKER)
+	{
+		TRACEMSGCTX(ctx, "  server sent a cookie");
+		mr_memcpy(ctx->init.client->cookie, payload + cookieOffset, COOKIE_SIZE);
+	}
+
 	// store the nonce we got from the server
 	mr_memcpy(ctx->init.client->initializationnonce, data, INITIALIZATION_NONCE_SIZE);
 	TRACEDATA("server init nonce     ", data, INITIALIZATION_NONCE_SIZE);
@@ -548,9 +768,23 @@ static mr_result send_first_client_message(_mr_ctx* ctx, uint8_t* output, uint32
 	ratchet_getsecondtolast(ctx, &secondToLast);
 	FAILIF(!secondToLast, MR_E_INVALIDOP, "Could not get second-to-last ratchet step");
 
+	// the cookie goes back to the server at the end of the message
+	uint32_t messagesize = spaceavail;
+	if (!allzeroes(ctx->init.client->cookie, COOKIE_SIZE))
+	{
+		FAILIF(spaceavail < MIN_MESSAGE_SIZE_WITH_ECDH + COOKIE_SIZE, MR_E_INVALIDSIZE, "There is not enough space for the first message and the cookie");
+		messagesize -= COOKIE_SIZE;
+	}
+
 	mr_memcpy(output, ctx->init.client->initializationnonce, INITIALIZATION_NONCE_SIZE);
 
-	return construct_message(ctx, output, INITIALIZATION_NONCE_SIZE, spaceavail, true, secondToLast);
+	_C(construct_message(ctx, output, INITIALIZATION_NONCE_SIZE, messagesize, true, secondToLast, 0, 0));
+	if (messagesize != spaceavail)
+	{
+		mr_memcpy(output + messagesize, ctx->init.client->cookie, COOKIE_SIZE);
+	}
+
+	return MR_E_SUCCESS;
 }
 
 static mr_result receive_first_client_message(_mr_ctx* ctx, uint8_t* data, uint32_t amount)
@@ -583,7 +817,7 @@ static mr_result send_first_server_response(_mr_ctx* ctx, uint8_t* output, uint3
 	_mr_ratchet_state* laststep;
 	ratchet_getlast(ctx, &laststep);
 	FAILIF(!laststep, MR_E_INVALIDOP, "the last step is not populated");
-	_C(construct_message(ctx, output, INITIALIZATION_NONCE_SIZE, spaceavail, false, laststep));
+	_C(construct_message(ctx, output, INITIALIZATION_NONCE_SIZE, spaceavail, false, laststep, 0, 0));
 
 	return MR_E_SUCCESS;
 }
@@ -612,9 +846,12 @@ static mr_result receive_first_server_response(_mr_ctx* ctx, uint8_t* data, uint
 	return MR_E_SUCCESS;
 }
 
+// if fragments are given the payload is read from them. Otherwise
+// the payload sits at the start of message and is moved into place.
 static mr_result construct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amount, uint32_t spaceavail,
 	bool includeecdh,
-	_mr_ratchet_state* step)
+	_mr_ratchet_state* step,
+	const mr_iovec* fragments, uint32_t fragmentcount)
 {
 	FAILIF(!ctx || !message, MR_E_INVALIDARG, "Some of the required arguments were null");
 	FAILIF(includeecdh && spaceavail < MIN_MESSAGE_SIZE_WITH_ECDH, MR_E_INVALIDSIZE, "When ECDH is included in the total message will be at least 64 bytes");
@@ -629,6 +866,9 @@ static mr_result construct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amou
 	// -OR-
 	// <nonce (4), ecdh (32)>, <payload, padding>, mac(12)
 
+	// the sending chain of a new step is only derived once it's needed
+	_C(ratchet_derivesending(ctx, step));
+
 	// get the payload key and nonce
 	uint8_t payloadKey[MSG_KEY_SIZE];
 	uint32_t generation;
@@ -647,17 +887,25 @@ static mr_result construct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amou
 	uint32_t amountAfterPayload = spaceavail - amount - headersize - MAC_SIZE;
 	uint32_t headerIvOffset = spaceavail - MAC_SIZE - HEADERIV_SIZE;
 
-	// build the payload <payload, padding>
-	memmove(message + headersize, message, amount);
-	mr_memzero(message + headersize + amount, amountAfterPayload);
-	TRACEDATA("[payload]             ", message + headersize, amount);
-
 	// copy in the nonce
-	be_packu32(generation, message);
-	TRACEDATA("[nonce]               ", message, NONCE_SIZE);
+	uint8_t nonce[NONCE_SIZE];
+	be_packu32(generation, nonce);
+	TRACEDATA("[nonce]               ", nonce, NONCE_SIZE);
 
-	// encrypt the payload
-	_C(crypt(ctx, message + headersize, payloadSize, payloadKey, MSG_KEY_SIZE, message, NONCE_SIZE));
+	// build and encrypt the payload <payload, padding>
+	if (fragments)
+	{
+		// straight from the source into the message
+		_C(crypt_gather(ctx, fragments, fragmentcount, message + headersize, payloadSize, payloadKey, MSG_KEY_SIZE, nonce, NONCE_SIZE));
+	}
+	else
+	{
+		memmove(message + headersize, message, amount);
+		mr_memzero(message + headersize + amount, amountAfterPayload);
+		TRACEDATA("[payload]             ", message + headersize, amount);
+		_C(crypt(ctx, message + headersize, payloadSize, payloadKey, MSG_KEY_SIZE, nonce, NONCE_SIZE));
+	}
+	mr_memcpy(message, nonce, NONCE_SIZE);
 
 	// copy in ecdh parms if needed
 	if (includeecdh)
@@ -753,6 +1001,39 @@ static mr_result interpret_mac(_mr_ctx* ctx, const uint8_t* message, uint32_t am
 	FAILMSG(MR_E_NOTFOUND, "The message received had an unrecognized message authentication code.");
 }
 
+// finds the ratchet a header key belongs to in the same order interpret_mac
+// checks them. Used for messages whose MAC has already been verified.
+static void find_header_key(_mr_ctx* ctx, const uint8_t* headerkey,
+	uint8_t** headerKeyUsed, _mr_ratchet_state** stepUsed, bool* usedNextHeaderKey)
+{
+	*headerKeyUsed = 0;
+	*stepUsed = 0;
+	*usedNextHeaderKey = false;
+
+	_mr_ratchet_state* ratchet = ctx->ratchet;
+	while (ratchet)
+	{
+		if (!allzeroes(ratchet->receiveheaderkey, KEY_SIZE))
+		{
+			if (memcmp(ratchet->receiveheaderkey, headerkey, KEY_SIZE) == 0)
+			{
+				*headerKeyUsed = ratchet->receiveheaderkey;
+				*stepUsed = ratchet;
+				return;
+			}
+			else if (memcmp(ratchet->nextreceiveheaderkey, headerkey, KEY_SIZE) == 0)
+			{
+				*headerKeyUsed = ratchet->nextreceiveheaderkey;
+				*stepUsed = ratchet;
+				*usedNextHeaderKey = true;
+				return;
+			}
+		}
+
+		ratchet = ratchet->next;
+	}
+}
+
 static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t amount,
 	uint8_t** payload, uint32_t* payloadsize,
 	const uint8_t* headerkey, uint32_t headerkeysize,
@@ -765,33 +1046,35 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 
 	TRACEMSGCTX(ctx, "--deconstruct_message");
 
-	// decrypt the header
+	// decrypt the header into a copy. The message is left as is
+	// until it is received so it can be tried again if it is pending.
+	uint8_t header[NONCE_SIZE + ECNUM_SIZE];
 	mr_aes_ctx aes = mr_aes_create(ctx);
 	_mr_aesctr_ctx cipher;
 	FAILIF(!aes, MR_E_NOMEM, "Could not allocate AES");
 	mr_result result = MR_E_SUCCESS;
 	_R(result, mr_aes_init(aes, headerkey, headerkeysize));
 	_R(result, aesctr_init(&cipher, aes, message + headerIvOffset, HEADERIV_SIZE));
-	_R(result, aesctr_process(&cipher, message, NONCE_SIZE, message, NONCE_SIZE));
+	_R(result, aesctr_process(&cipher, message, NONCE_SIZE, header, NONCE_SIZE));
 	TRACEDATA("headerkey             ", headerkey, headerkeysize);
 	TRACEDATA("headeriv              ", message + headerIvOffset, HEADERIV_SIZE);
 
 	// decrypt ecdh if needed
-	bool hasEcdh = message[0] & 0b10000000;
+	bool hasEcdh = header[0] & 0b10000000;
 
 	// clear the ecdh bit
-	message[0] = message[0] & 0b01111111;
+	header[0] = header[0] & 0b01111111;
 
 	uint32_t ecdhOffset = NONCE_SIZE;
 	uint32_t payloadOffset = NONCE_SIZE + (hasEcdh ? ECNUM_SIZE : 0);
 	uint32_t payloadSize = amount - payloadOffset - MAC_SIZE;
-	TRACEDATA("[nonce]               ", message, NONCE_SIZE);
+	TRACEDATA("[nonce]               ", header, NONCE_SIZE);
 
 	if (hasEcdh)
 	{
 		TRACEDATA("[ecdh]                ", message + NONCE_SIZE, ECNUM_SIZE);
-		_R(result, aesctr_process(&cipher, message + NONCE_SIZE, ECNUM_SIZE, message + NONCE_SIZE, ECNUM_SIZE));
-		TRACEDATA("[ecdh]                ", message + NONCE_SIZE, ECNUM_SIZE);
+		_R(result, aesctr_process(&cipher, message + NONCE_SIZE, ECNUM_SIZE, header + NONCE_SIZE, ECNUM_SIZE));
+		TRACEDATA("[ecdh]                ", header + NONCE_SIZE, ECNUM_SIZE);
 	}
 	mr_aes_destroy(aes);
 	aes = 0;
@@ -799,7 +1082,12 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 
 
 	// get the nonce
-	uint32_t nonce = be_unpacku32(message);
+	uint32_t nonce = be_unpacku32(header);
+
+	// reject duplicates before doing any more work. A message that performs
+	// an ECDH ratchet step starts a new chain so it can't be a duplicate.
+	FAILIF(step && !(hasEcdh && usedNextKey) && chain_replayed(&step->receivingchain, nonce),
+		MR_E_REPLAY, "The message has been received before or is too old");
 
 	// process ecdh if needed
 	if (hasEcdh)
@@ -821,7 +1109,7 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 			_R(result, ratchet_initialize_server(ctx, _step,
 				ctx->init.server->localratchetstep0,
 				ctx->init.server->rootkey, KEY_SIZE,
-				message + ecdhOffset, ECNUM_SIZE,
+				header + ecdhOffset, ECNUM_SIZE,
 				ctx->init.server->localratchetstep1,
 				ctx->init.server->firstreceiveheaderkey, KEY_SIZE,
 				ctx->init.server->firstsendheaderkey, KEY_SIZE));
@@ -843,6 +1131,9 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 			if (usedNextKey)
 			{
 				TRACEMSGCTX(ctx, "  next header key was used, performing ratchet");
+				_C(txn_touch_step(ctx, step));
+				_C(txn_reserve(ctx));
+
 				// perform ecdh ratchet
 				mr_ecdh_ctx newEcdh = mr_ecdh_create(ctx);
 				if (!newEcdh) result = MR_E_NOMEM;
@@ -851,10 +1142,13 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 				_mr_ratchet_state* _step = 0;
 				_C(mr_allocate(ctx, sizeof(_mr_ratchet_state), (void**)&_step));
 				mr_memzero(_step, sizeof(_mr_ratchet_state));
+				txn_added(ctx, _step);
 
-				_R(result, ratchet_ratchet(ctx, step,
+				// the sending half is left for the first send or
+				// mr_ctx_precompute so receiving stays cheap.
+				_R(result, ratchet_ratchet_receiving(ctx, step,
 					_step,
-					message + ecdhOffset, ECNUM_SIZE,
+					header + ecdhOffset, ECNUM_SIZE,
 					newEcdh));
 
 				ratchet_add(ctx, _step);
@@ -871,9 +1165,12 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 		FAILMSG(MR_E_INVALIDOP, "An override header key was used but the message did not contain ECDH parameters");
 	}
 
-	// get the inner payload key from the receive chain
+	// get the inner payload key from the receive chain. If the chain is too
+	// far behind this returns MR_E_PENDING after moving it closer.
 	uint8_t payloadKey[MSG_KEY_SIZE];
+	_C(txn_touch_chain(ctx, step));
 	_C(chain_ratchetforreceiving(ctx, &step->receivingchain, nonce, payloadKey, sizeof(payloadKey)));
+	mr_memcpy(message, header, payloadOffset);
 
 	// decrypt the payload
 	_C(crypt(ctx, message + payloadOffset, payloadSize, payloadKey, MSG_KEY_SIZE, message, NONCE_SIZE));
@@ -887,7 +1184,7 @@ static mr_result deconstruct_message(_mr_ctx* ctx, uint8_t* message, uint32_t am
 
 static mr_result process_initialization(_mr_ctx* ctx, uint8_t* message, uint32_t amount, uint32_t spaceavail,
 	const uint8_t* headerkey, uint32_t headerkeysize,
-	_mr_ratchet_state* step)
+	_mr_ratchet_state* step, const _mr_checked_signature* checked)
 {
 
 	TRACEMSGCTX(ctx, "--process_initialization");
@@ -974,7 +1271,7 @@ static mr_result process_initialization(_mr_ctx* ctx, uint8_t* message, uint32_t
 			uint32_t initialization_nonce_size;
 			uint8_t* remote_ecdh_for_init;
 			uint32_t remote_ecdh_for_init_size;
-			_C(receive_initialization_request(ctx, message, amount,
+			_C(receive_initialization_request(ctx, message, amount, checked,
 				&initialization_nonce, &initialization_nonce_size,
 				&remote_ecdh_for_init, &remote_ecdh_for_init_size));
 			_C(send_initialization_response(ctx,
@@ -987,6 +1284,12 @@ static mr_result process_initialization(_mr_ctx* ctx, uint8_t* message, uint32_t
 			// reset ratchets if this is a reinitialization
 			ratchet_destroy_all(ctx);
 
+			// the client holds on to the state now
+			if (ctx->config.cookie_key)
+			{
+				ctx_free_server_initialization(ctx);
+			}
+
 			return MR_E_SENDBACK;
 		}
 		else if (ctx->init.server && headerkey == ctx->init.server->firstreceiveheaderkey)
@@ -1005,6 +1308,37 @@ static mr_result process_initialization(_mr_ctx* ctx, uint8_t* message, uint32_t
 	}
 }
 
+mr_result ctx_initialization_signature(_mr_ctx* ctx, const uint8_t* message, uint32_t messagesize,
+	_mr_checked_signature* signature)
+{
+	FAILIF(!ctx || !message || !signature, MR_E_INVALIDARG, "Some of the required arguments were null");
+
+	// only initialization requests, which are under the application key
+	bool macmatches = false;
+	if (ctx->config.is_client ||
+		messagesize < INIT_REQ_MSG_SIZE || messagesize > MR_MAX_INITIALIZATION_MESSAGE_SIZE ||
+		verifymac(ctx, message, messagesize, ctx->config.applicationKey, KEY_SIZE, message, MACIV_SIZE, &macmatches) != MR_E_SUCCESS ||
+		!macmatches)
+	{
+		return MR_E_NOTFOUND;
+	}
+
+	// decrypt a copy the same way receive_initialization_request does
+	uint8_t data[MR_MAX_INITIALIZATION_MESSAGE_SIZE];
+	mr_memcpy(data, message, messagesize);
+	_C(crypt(ctx,
+		data + INITIALIZATION_NONCE_SIZE, messagesize - INITIALIZATION_NONCE_SIZE - MAC_SIZE,
+		ctx->config.applicationKey, KEY_SIZE,
+		data, INITIALIZATION_NONCE_SIZE));
+
+	uint32_t macOffset = messagesize - MAC_SIZE;
+	_C(digest(ctx, data, macOffset - SIGNATURE_SIZE, signature->digest, DIGEST_SIZE));
+	mr_memcpy(signature->signature, data + macOffset - SIGNATURE_SIZE, SIGNATURE_SIZE);
+	mr_memcpy(signature->publickey, data + INITIALIZATION_NONCE_SIZE, ECNUM_SIZE);
+	mr_memzero(data, sizeof(data));
+	return MR_E_SUCCESS;
+}
+
 mr_result mr_ctx_initiate_initialization(mr_ctx _ctx, uint8_t* message, uint32_t spaceavailable, bool force)
 {
 	_mr_ctx* ctx = _ctx;
@@ -1019,22 +1353,58 @@ mr_result mr_ctx_initiate_initialization(mr_ctx _ctx, uint8_t* message, uint32_t
 	}
 
 	TRACEMSGCTX(ctx, "\n\n====INITIATE INITIALIZATION");
-	return process_initialization(ctx, message, 0, spaceavailable, 0, 0, 0);
+	return process_initialization(ctx, message, 0, spaceavailable, 0, 0, 0, 0);
 }
 
-mr_result mr_ctx_receive(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable, uint8_t** payload, uint32_t* payloadsize)
+mr_result mr_ctx_receive_verify(mr_ctx _ctx, const uint8_t* message, uint32_t messagesize, uint8_t* headerkey, uint32_t headerkeysize)
 {
 	_mr_ctx* ctx = _ctx;
 	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
 	FAILIF(!message, MR_E_INVALIDARG, "Message must be provided");
+	FAILIF(!headerkey, MR_E_INVALIDARG, "Header key must be provided");
+	FAILIF(headerkeysize < KEY_SIZE, MR_E_INVALIDSIZE, "The header key size must be at least 32 bytes");
 	FAILIF(messagesize < MIN_MESSAGE_SIZE, MR_E_INVALIDARG, "The message size must be at least 32 bytes");
-	FAILIF(spaceavailable < MIN_MESSAGE_SIZE, MR_E_INVALIDARG, "The space available must be at least 32 bytes");
-	FAILIF(spaceavailable < messagesize, MR_E_INVALIDARG, "The space available must be at least as much as the message size");
 
-	if (ctx->config.is_client) TRACEMSGCTX(ctx, "\n\n====CLIENT RECEIVE");
-	else TRACEMSGCTX(ctx, "\n\n====SERVER RECEIVE");
+	// only ever reads the context
+	uint8_t* headerkeyused = 0;
+	_mr_ratchet_state* stepused = 0;
+	bool usednextheaderkey = false;
+	_C(interpret_mac(ctx, message, messagesize,
+		&headerkeyused,
+		&stepused,
+		&usednextheaderkey));
+
+	mr_memcpy(headerkey, headerkeyused, KEY_SIZE);
+	return MR_E_SUCCESS;
+}
+
+// whether a message received by a server is part of initialization, for
+// sorting messages before they are received. Until the server is initialized
+// every message is. After that only a new initialization request is, and
+// that is told by its MAC under the application key alone.
+mr_result ctx_is_initialization(_mr_ctx* ctx, const uint8_t* message, uint32_t messagesize, bool* initialization)
+{
+	FAILIF(!ctx || !message || !initialization, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(messagesize < MIN_MESSAGE_SIZE, MR_E_INVALIDARG, "The message size must be at least 32 bytes");
+
+	*initialization = true;
+	if (ctx->init.initialized)
+	{
+		_C(verifymac(ctx, message, messagesize, ctx->config.applicationKey, KEY_SIZE, message, MACIV_SIZE, initialization));
+	}
+
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_peek(mr_ctx _ctx, const uint8_t* message, uint32_t messagesize, mr_peek_info* info)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx || !message || !info, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(messagesize < MIN_MESSAGE_SIZE, MR_E_INVALIDARG, "The message size must be at least 32 bytes");
 
-	// check the MAC and get info regarding the message header
+	mr_memzero(info, sizeof(mr_peek_info));
+
+	// only ever reads the context
 	uint8_t* headerkeyused = 0;
 	_mr_ratchet_state* stepused = 0;
 	bool usednextheaderkey = false;
@@ -1043,12 +1413,159 @@ mr_result mr_ctx_receive(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, ui
 		&stepused,
 		&usednextheaderkey));
 
+	if (headerkeyused == ctx->config.applicationKey || !ctx->init.initialized || !stepused)
+	{
+		info->initialization = true;
+		return MR_E_SUCCESS;
+	}
+
+	// decrypt a copy of the nonce
+	uint8_t nonce[NONCE_SIZE];
+	mr_aes_ctx aes = mr_aes_create(ctx);
+	_mr_aesctr_ctx cipher;
+	FAILIF(!aes, MR_E_NOMEM, "Could not allocate AES");
+	mr_result result = MR_E_SUCCESS;
+	_R(result, mr_aes_init(aes, headerkeyused, KEY_SIZE));
+	_R(result, aesctr_init(&cipher, aes, message + messagesize - MAC_SIZE - HEADERIV_SIZE, HEADERIV_SIZE));
+	_R(result, aesctr_process(&cipher, message, NONCE_SIZE, nonce, NONCE_SIZE));
+	mr_aes_destroy(aes);
+	_C(result);
+
+	info->has_ecdh = (nonce[0] & 0b10000000) != 0;
+	nonce[0] &= 0b01111111;
+	info->generation = be_unpacku32(nonce);
+	for (_mr_ratchet_state* r = ctx->ratchet; r && r != stepused; r = r->next)
+	{
+		info->step++;
+	}
+
+	// the same decisions deconstruct_message and chain_ratchetforreceiving make
+	const _mr_receiving_chain_state* chain = &stepused->receivingchain;
+	if (usednextheaderkey && info->has_ecdh)
+	{
+		info->ecdh_ratchet = true;
+		info->gap = (int64_t)info->generation;
+	}
+	else
+	{
+		info->gap = (int64_t)info->generation - chain->generation;
+		info->lost = !chain_haskey(chain, info->generation);
+		info->replay = chain_replayed(chain, info->generation);
+	}
+
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_catchup(mr_ctx _ctx, uint32_t budget, uint32_t* outstanding)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
+
+	uint32_t left = 0;
+	for (_mr_ratchet_state* r = ctx->ratchet; r; r = r->next)
+	{
+		uint32_t taken = 0;
+		if (budget && chain_catchup_outstanding(&r->receivingchain))
+		{
+			_C(txn_touch_chain(ctx, r));
+			_C(chain_catchup(ctx, &r->receivingchain, budget, &taken));
+			budget -= taken;
+		}
+		left += chain_catchup_outstanding(&r->receivingchain);
+	}
+
+	if (outstanding)
+	{
+		*outstanding = left;
+	}
+
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_precompute(mr_ctx _ctx)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
+
+	for (_mr_ratchet_state* r = ctx->ratchet; r; r = r->next)
+	{
+		if (r->sendingpending)
+		{
+			_C(txn_touch_step(ctx, r));
+			_C(ratchet_derivesending(ctx, r));
+		}
+	}
+
+	return MR_E_SUCCESS;
+}
+
+static mr_result receive(_mr_ctx* ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable,
+	const uint8_t* verifiedheaderkey, const _mr_checked_signature* checked, uint8_t** payload, uint32_t* payloadsize)
+{
+	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
+	FAILIF(!message, MR_E_INVALIDARG, "Message must be provided");
+	FAILIF(messagesize < MIN_MESSAGE_SIZE, MR_E_INVALIDARG, "The message size must be at least 32 bytes");
+	FAILIF(spaceavailable < MIN_MESSAGE_SIZE, MR_E_INVALIDARG, "The space available must be at least 32 bytes");
+	FAILIF(spaceavailable < messagesize, MR_E_INVALIDARG, "The space available must be at least as much as the message size");
+
+	if (ctx->config.is_client) TRACEMSGCTX(ctx, "\n\n====CLIENT RECEIVE");
+	else TRACEMSGCTX(ctx, "\n\n====SERVER RECEIVE");
+
+	// a server that keeps no state while initializing gets it back from
+	// the cookie at the end of the first message from the client.
+	if (!ctx->config.is_client && ctx->config.cookie_key &&
+		!ctx->init.initialized && !ctx->init.server &&
+		has_cookie(message, messagesize) &&
+		open_cookie(ctx, message, messagesize) == MR_E_SUCCESS)
+	{
+		TRACEMSGCTX(ctx, "=initialization state restored from cookie");
+		messagesize -= COOKIE_SIZE;
+	}
+
+	// check the MAC and get info regarding the message header. If the
+	// MAC was verified already, the header key says which ratchet to check
+	// it under so the other ones need not be tried. The key is not trusted
+	// on its own because it could have been verified for another message.
+	// If earlier messages changed the ratchets since, check them all.
+	uint8_t* headerkeyused = 0;
+	_mr_ratchet_state* stepused = 0;
+	bool usednextheaderkey = false;
+	if (verifiedheaderkey)
+	{
+		find_header_key(ctx, verifiedheaderkey,
+			&headerkeyused,
+			&stepused,
+			&usednextheaderkey);
+
+		bool macmatches = false;
+		if (headerkeyused)
+		{
+			_C(verifymac(ctx, message, messagesize, headerkeyused, KEY_SIZE, message, MACIV_SIZE, &macmatches));
+		}
+
+		if (!macmatches)
+		{
+			headerkeyused = 0;
+			stepused = 0;
+			usednextheaderkey = false;
+		}
+	}
+
+	if (!headerkeyused)
+	{
+		_C(interpret_mac(ctx, message, messagesize,
+			&headerkeyused,
+			&stepused,
+			&usednextheaderkey));
+	}
+
 	if (!headerkeyused)
 	{
 		FAILMSG(MR_E_INVALIDOP, "Could not identify the header key used to send a message");
 	}
 	else if (headerkeyused == ctx->config.applicationKey || !ctx->init.initialized)
 	{
+		FAILIF(ctx->txn, MR_E_INVALIDOP, "Initialization messages cannot be received during a transaction");
 		TRACEMSGCTX(ctx, "=initialization process");
 		if (!ctx->config.is_client && !ctx->init.server)
 		{
@@ -1061,7 +1578,7 @@ mr_result mr_ctx_receive(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, ui
 		mr_result result = process_initialization(ctx,
 			message, messagesize, spaceavailable,
 			headerkeyused, KEY_SIZE,
-			stepused);
+			stepused, checked);
 
 		// assign payload and payloadsize variables if needed
 		if (result == MR_E_SENDBACK)
@@ -1096,20 +1613,19 @@ mr_result mr_ctx_receive(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, ui
 		TRACEMSGCTX(ctx, "=non-initialization process");
 		_C(deconstruct_message(ctx, message, messagesize, payload, payloadsize, headerkeyused, KEY_SIZE, stepused, usednextheaderkey));
 
-		// received first normal message, free init state
+		// received first normal message, free init state. During a
+		// transaction this waits for the commit so a rollback keeps it.
 		if (!ctx->config.is_client && ctx->init.server)
 		{
-			TRACEMSGCTX(ctx, "=releasing server structures");
-			if (ctx->init.server->localratchetstep0)
+			if (ctx->txn)
 			{
-				mr_ecdh_destroy(ctx->init.server->localratchetstep0);
+				ctx->txn->releaseserver = true;
 			}
-			if (ctx->init.server->localratchetstep1)
+			else
 			{
-				mr_ecdh_destroy(ctx->init.server->localratchetstep1);
+				TRACEMSGCTX(ctx, "=releasing server structures");
+				ctx_free_server_initialization(ctx);
 			}
-			mr_free(ctx, ctx->init.server);
-			ctx->init.server = 0;
 		}
 
 		return MR_E_SUCCESS;
@@ -1120,13 +1636,32 @@ mr_result mr_ctx_receive(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, ui
 	}
 }
 
-mr_result mr_ctx_send(mr_ctx _ctx, uint8_t* payload, uint32_t payloadsize, uint32_t spaceavailable)
+mr_result mr_ctx_receive(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable, uint8_t** payload, uint32_t* payloadsize)
+{
+	return receive(_ctx, message, messagesize, spaceavailable, 0, 0, payload, payloadsize);
+}
+
+mr_result ctx_receive_checked(_mr_ctx* ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable,
+	const _mr_checked_signature* checked, uint8_t** payload, uint32_t* payloadsize)
+{
+	return receive(ctx, message, messagesize, spaceavailable, 0, checked, payload, payloadsize);
+}
+
+mr_result mr_ctx_receive_verified(mr_ctx _ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable,
+	const uint8_t* headerkey, uint32_t headerkeysize, uint8_t** payload, uint32_t* payloadsize)
+{
+	FAILIF(!headerkey, MR_E_INVALIDARG, "Header key must be provided");
+	FAILIF(headerkeysize < KEY_SIZE, MR_E_INVALIDSIZE, "The header key size must be at least 32 bytes");
+	return receive(_ctx, message, messagesize, spaceavailable, headerkey, 0, payload, payloadsize);
+}
+
+static mr_result send(_mr_ctx* ctx, uint8_t* payload, uint32_t payloadsize, uint32_t spaceavailable, const mr_iovec* fragments, uint32_t fragmentcount)
 {
-	_mr_ctx* ctx = _ctx;
 	FAILIF(!ctx, MR_E_INVALIDARG, "The context must be provided");
 	FAILIF(!payload, MR_E_INVALIDARG, "The payload must be provided");
 	FAILIF(!ctx->init.initialized, MR_E_INVALIDOP, "The session has not been initialized and cannot send yet");
-	FAILIF(spaceavailable - payloadsize < OVERHEAD_WITHOUT_ECDH, MR_E_INVALIDSIZE, "The amount of space available must be at least 16 bytes.");
+	FAILIF(ctx->txn, MR_E_INVALIDOP, "Messages cannot be sent during a transaction because rolling back would reuse keys");
+	FAILIF(spaceavailable < payloadsize || spaceavailable - payloadsize < OVERHEAD_WITHOUT_ECDH, MR_E_INVALIDSIZE, "The amount of space available must be at least 16 bytes.");
 
 	if (ctx->config.is_client) TRACEMSGCTX(ctx, "\n\n====CLIENT SEND");
 	else TRACEMSGCTX(ctx, "\n\n====SERVER SEND");
@@ -1144,11 +1679,248 @@ mr_result mr_ctx_send(mr_ctx _ctx, uint8_t* payload, uint32_t payloadsize, uint3
 	}
 
 	FAILIF(!step, MR_E_INVALIDOP, "Could not find the required ratchet step");
-	_C(construct_message(ctx, payload, payloadsize, spaceavailable, canIncludeEcdh, step));
+	_C(construct_message(ctx, payload, payloadsize, spaceavailable, canIncludeEcdh, step, fragments, fragmentcount));
 
 	return MR_E_SUCCESS;
 }
 
+mr_result mr_ctx_send(mr_ctx _ctx, uint8_t* payload, uint32_t payloadsize, uint32_t spaceavailable)
+{
+	return send(_ctx, payload, payloadsize, spaceavailable, 0, 0);
+}
+
+mr_result mr_ctx_send_to(mr_ctx _ctx, const uint8_t* payload, uint32_t payloadsize, uint8_t* message, uint32_t messagesize)
+{
+	FAILIF(!payload && payloadsize, MR_E_INVALIDARG, "The payload must be provided");
+	mr_iovec fragment = { (uint8_t*)payload, payloadsize };
+	return send(_ctx, message, payloadsize, messagesize, &fragment, 1);
+}
+
+mr_result mr_ctx_send_gather(mr_ctx _ctx, const mr_iovec* fragments, uint32_t fragmentcount, uint8_t* message, uint32_t messagesize)
+{
+	FAILIF(!fragments && fragmentcount, MR_E_INVALIDARG, "The fragments must be provided");
+
+	uint32_t payloadsize = 0;
+	for (uint32_t i = 0; i < fragmentcount; i++)
+	{
+		FAILIF(!fragments[i].data && fragments[i].size, MR_E_INVALIDARG, "The fragments must be provided");
+		FAILIF(payloadsize + fragments[i].size < payloadsize, MR_E_INVALIDSIZE, "The fragments are too large");
+		payloadsize += fragments[i].size;
+	}
+
+	mr_iovec none = { 0, 0 };
+	return send(_ctx, message, payloadsize, messagesize, fragmentcount ? fragments : &none, fragmentcount);
+}
+
+// mr_ctx_send_multi fans out to mr_ctx_send_to, one session per call to work.
+typedef struct t_send_multi_work {
+	mr_ctx* ctxs;
+	const uint8_t* payload;
+	uint32_t payloadsize;
+	uint8_t** messages;
+	uint32_t messagesize;
+	mr_result* results;
+} send_multi_work;
+
+static void send_multi_one(void* arg, uint32_t index)
+{
+	send_multi_work* work = (send_multi_work*)arg;
+	work->results[index] = mr_ctx_send_to(work->ctxs[index], work->payload, work->payloadsize, work->messages[index], work->messagesize);
+}
+
+mr_result mr_ctx_send_multi(mr_ctx* ctxs, uint32_t count, const uint8_t* payload, uint32_t payloadsize,
+	uint8_t** messages, uint32_t messagesize, mr_result* results, parallel_fn parallel, void* user)
+{
+	FAILIF(!ctxs || !messages || !results, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(!payload && payloadsize, MR_E_INVALIDARG, "The payload must be provided");
+
+	send_multi_work work = { ctxs, payload, payloadsize, messages, messagesize, results };
+	if (parallel && count > 1)
+	{
+		parallel(user, send_multi_one, &work, count);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			send_multi_one(&work, i);
+		}
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		_C(results[i]);
+	}
+
+	return MR_E_SUCCESS;
+}
+
+static mr_result stream_create(_mr_ctx* ctx, const uint8_t* keys, bool receiving, _mr_stream_ctx** pstream)
+{
+	_mr_stream_ctx* stream;
+	_C(mr_allocate(ctx, sizeof(_mr_stream_ctx), (void**)&stream));
+	mr_memzero(stream, sizeof(_mr_stream_ctx));
+	stream->ctx = ctx;
+	stream->receiving = receiving;
+	stream->aes = mr_aes_create(ctx);
+	stream->mac = mr_poly_create(ctx);
+
+	// the keys are used for one stream only so the IVs can be fixed
+	uint8_t iv[16] = { 0 };
+	mr_result result = stream->aes && stream->mac ? MR_E_SUCCESS : MR_E_NOMEM;
+	_R(result, mr_aes_init(stream->aes, keys, KEY_SIZE));
+	_R(result, aesctr_init(&stream->cipher, stream->aes, iv, sizeof(iv)));
+	_R(result, mr_poly_init(stream->mac, keys + KEY_SIZE, KEY_SIZE, iv, sizeof(iv)));
+	if (result != MR_E_SUCCESS)
+	{
+		mr_stream_destroy(stream);
+		FAILMSG(result, "Could not set up the stream");
+	}
+
+	*pstream = stream;
+	return MR_E_SUCCESS;
+}
+
+// the MAC covers the ciphertext followed by its length
+static mr_result stream_mac(_mr_stream_ctx* stream, uint8_t* mac)
+{
+	uint8_t length[8];
+	be_packu32((uint32_t)(stream->length >> 32), length);
+	be_packu32((uint32_t)stream->length, length + 4);
+	_C(mr_poly_process(stream->mac, length, sizeof(length)));
+	_C(mr_poly_compute(stream->mac, mac, MR_STREAM_MAC_SIZE));
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_send_begin(mr_ctx _ctx, mr_stream_ctx* stream, uint8_t* header, uint32_t headersize)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx || !stream || !header, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(headersize < MR_STREAM_HEADER_SIZE, MR_E_INVALIDSIZE, "The stream header must be at least 80 bytes");
+	*stream = 0;
+
+	uint8_t keys[STREAM_KEYS_SIZE];
+	_C(mr_rng_generate(ctx->rng_ctx, keys, sizeof(keys)));
+
+	_mr_stream_ctx* newstream = 0;
+	mr_iovec fragment = { keys, sizeof(keys) };
+	mr_result result = send(ctx, header, sizeof(keys), headersize, &fragment, 1);
+	_R(result, stream_create(ctx, keys, false, &newstream));
+	mr_memzero(keys, sizeof(keys));
+	_C(result);
+
+	*stream = newstream;
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_send_update(mr_stream_ctx _stream, const uint8_t* payload, uint32_t payloadsize, uint8_t* output, uint32_t spaceavailable)
+{
+	_mr_stream_ctx* stream = _stream;
+	FAILIF(!stream, MR_E_INVALIDARG, "The stream must be provided");
+	FAILIF(stream->receiving, MR_E_INVALIDOP, "The stream is for receiving");
+	if (!payloadsize)
+	{
+		return MR_E_SUCCESS;
+	}
+
+	FAILIF(!payload || !output, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(spaceavailable < payloadsize, MR_E_INVALIDSIZE, "The output must be at least as large as the payload");
+
+	_C(aesctr_process(&stream->cipher, payload, payloadsize, output, spaceavailable));
+	_C(mr_poly_process(stream->mac, output, payloadsize));
+	stream->length += payloadsize;
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_send_final(mr_stream_ctx _stream, uint8_t* mac, uint32_t macsize)
+{
+	_mr_stream_ctx* stream = _stream;
+	FAILIF(!stream || !mac, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(stream->receiving, MR_E_INVALIDOP, "The stream is for receiving");
+	FAILIF(macsize < MR_STREAM_MAC_SIZE, MR_E_INVALIDSIZE, "The MAC must be at least 16 bytes");
+
+	mr_result result = stream_mac(stream, mac);
+	mr_stream_destroy(stream);
+	return result;
+}
+
+mr_result mr_ctx_receive_begin(mr_ctx _ctx, mr_stream_ctx* stream, uint8_t* header, uint32_t headersize)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx || !stream || !header, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(!ctx->init.initialized, MR_E_INVALIDOP, "The session has not been initialized and cannot receive streams yet");
+	*stream = 0;
+
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	mr_result result = receive(ctx, header, headersize, headersize, 0, 0, &payload, &payloadsize);
+	FAILIF(result == MR_E_SENDBACK, MR_E_INVALIDOP, "The header was an initialization message");
+	_C(result);
+	FAILIF(payloadsize < STREAM_KEYS_SIZE, MR_E_INVALIDSIZE, "The header was too small to be a stream header");
+
+	_mr_stream_ctx* newstream = 0;
+	result = stream_create(ctx, payload, true, &newstream);
+	mr_memzero(payload, STREAM_KEYS_SIZE);
+	_C(result);
+
+	*stream = newstream;
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_receive_update(mr_stream_ctx _stream, const uint8_t* message, uint32_t messagesize, uint8_t* output, uint32_t spaceavailable)
+{
+	_mr_stream_ctx* stream = _stream;
+	FAILIF(!stream, MR_E_INVALIDARG, "The stream must be provided");
+	FAILIF(!stream->receiving, MR_E_INVALIDOP, "The stream is for sending");
+	if (!messagesize)
+	{
+		return MR_E_SUCCESS;
+	}
+
+	FAILIF(!message || !output, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(spaceavailable < messagesize, MR_E_INVALIDSIZE, "The output must be at least as large as the message");
+
+	// the ciphertext is MACed before it is decrypted as output may be the same buffer
+	_C(mr_poly_process(stream->mac, message, messagesize));
+	_C(aesctr_process(&stream->cipher, message, messagesize, output, spaceavailable));
+	stream->length += messagesize;
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_receive_final(mr_stream_ctx _stream, const uint8_t* mac, uint32_t macsize)
+{
+	_mr_stream_ctx* stream = _stream;
+	FAILIF(!stream || !mac, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(!stream->receiving, MR_E_INVALIDOP, "The stream is for sending");
+	FAILIF(macsize < MR_STREAM_MAC_SIZE, MR_E_INVALIDSIZE, "The MAC must be at least 16 bytes");
+
+	uint8_t computedmac[MR_STREAM_MAC_SIZE];
+	mr_result result = stream_mac(stream, computedmac);
+	mr_stream_destroy(stream);
+	_C(result);
+	FAILIF(memcmp(computedmac, mac, MR_STREAM_MAC_SIZE) != 0, MR_E_VERIFYFAIL, "The stream MAC did not match");
+	return MR_E_SUCCESS;
+}
+
+void mr_stream_destroy(mr_stream_ctx _stream)
+{
+	_mr_stream_ctx* stream = _stream;
+	if (stream)
+	{
+		_mr_ctx* ctx = stream->ctx;
+		if (stream->aes)
+		{
+			mr_aes_destroy(stream->aes);
+		}
+		if (stream->mac)
+		{
+			mr_poly_destroy(stream->mac);
+		}
+		mr_memzero(stream, sizeof(_mr_stream_ctx));
+		mr_free(ctx, stream);
+	}
+}
+
 mr_result mr_ctx_is_initialized(mr_ctx _ctx, bool* initialized)
 {
 	_mr_ctx* ctx = _ctx;
@@ -1182,6 +1954,11 @@ void mr_ctx_destroy(mr_ctx _ctx)
 			ctx->identity = 0;
 		}
 
+		if (ctx->txn)
+		{
+			mr_ctx_rollback(ctx);
+		}
+
 		ratchet_destroy_all(ctx);
 
 		if (ctx->config.is_client && ctx->init.client)
@@ -1195,19 +1972,9 @@ void mr_ctx_destroy(mr_ctx _ctx)
 			ctx->init.client = 0;
 		}
 
-		if (!ctx->config.is_client && ctx->init.server)
+		if (!ctx->config.is_client)
 		{
-			if (ctx->init.server->localratchetstep0)
-			{
-				mr_ecdh_destroy(ctx->init.server->localratchetstep0);
-			}
-			if (ctx->init.server->localratchetstep1)
-			{
-				mr_ecdh_destroy(ctx->init.server->localratchetstep1);
-			}
-
-			mr_free(ctx, ctx->init.server);
-			ctx->init.server = 0;
+			ctx_free_server_initialization(ctx);
 		}
 
 		mr_memzero(ctx, sizeof(_mr_ctx));
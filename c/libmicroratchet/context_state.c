@@ -7,7 +7,7 @@
 // and so some objects have a 4 byte header containing
 // bits indiciating what is present
 
-#define STORAGE_VERSION 1
+#define STORAGE_VERSION 2
 
 
 // ratchet state
@@ -22,6 +22,9 @@
 #define HAS_SCHAIN_OK_BIT (1 << 8)
 #define HAS_RCHAIN_BIT (1 << 9)
 #define HAS_RCHAIN_OK_BIT (1 << 10)
+#define HAS_RCHAIN_REPLAY_BIT (1 << 11)
+#define HAS_RCHAIN_CHECKPOINTS_BIT (1 << 12)
+#define HAS_SENDPENDING_BIT (1 << 13)
 
 // main state
 #define HAS_INIT_BIT (1 << 0)
@@ -41,6 +44,7 @@
 #define HAS_CLIENT (1 << 2)
 #define HAS_INITIALIZATION_NONCE_BIT (1 << 3)
 #define HAS_LOCALECDH_BIT (1 << 4)
+#define HAS_COOKIE_BIT (1 << 5)
 
 
 static inline bool allzeroes(const uint8_t* d, uint32_t amt)
@@ -53,6 +57,21 @@ static inline bool allzeroes(const uint8_t* d, uint32_t amt)
 	return true;
 }
 
+#if MR_CHAIN_CHECKPOINTS > 0
+static uint32_t checkpoints_count(const _mr_receiving_chain_state* chain)
+{
+	uint32_t count = 0;
+	for (int i = 0; i < MR_CHAIN_CHECKPOINTS; i++)
+	{
+		if (!allzeroes(chain->checkpoints[i].chainkey, KEY_SIZE))
+		{
+			count++;
+		}
+	}
+	return count;
+}
+#endif
+
 static uint32_t init_size_needed_client(_mr_initialization_state_client* c)
 {
 	uint32_t size = 0;
@@ -66,6 +85,10 @@ static uint32_t init_size_needed_client(_mr_initialization_state_client* c)
 		{
 			size += mr_ecdh_store_size_needed(c->localecdhforinit);
 		}
+		if (!allzeroes(c->cookie, COOKIE_SIZE))
+		{
+			size += COOKIE_SIZE;
+		}
 	}
 	return size;
 }
@@ -134,6 +157,10 @@ static uint32_t ratchet_size_needed(_mr_ratchet_state* r)
 	{
 		size += KEY_SIZE;
 	}
+	if (r->sendingpending)
+	{
+		size += ECNUM_SIZE;
+	}
 	if (r->sendingchain.generation != 0)
 	{
 		size += 4;
@@ -153,6 +180,19 @@ static uint32_t ratchet_size_needed(_mr_ratchet_state* r)
 			size += 4;
 			size += KEY_SIZE;
 		}
+		if (!allzeroes((const uint8_t*)r->receivingchain.replay, sizeof(r->receivingchain.replay)))
+		{
+			size += 4;
+			size += sizeof(r->receivingchain.replay);
+		}
+#if MR_CHAIN_CHECKPOINTS > 0
+		uint32_t checkpoints = checkpoints_count(&r->receivingchain);
+		if (checkpoints)
+		{
+			size += 4;
+			size += checkpoints * (4 + KEY_SIZE);
+		}
+#endif
 	}
 
 	return size;
@@ -245,6 +285,11 @@ mr_result mr_ctx_state_store(mr_ctx _ctx, uint8_t* ptr, uint32_t space)
 					WRITEECDH(c->localecdhforinit);
 					*mainheader |= HAS_LOCALECDH_BIT;
 				}
+				if (!allzeroes(c->cookie, COOKIE_SIZE))
+				{
+					WRITEDATA(c->cookie, COOKIE_SIZE);
+					*mainheader |= HAS_COOKIE_BIT;
+				}
 			}
 		}
 		else
@@ -330,6 +375,12 @@ mr_result mr_ctx_state_store(mr_ctx _ctx, uint8_t* ptr, uint32_t space)
 			WRITEDATA(r->nextreceiveheaderkey, KEY_SIZE);
 			*ratchetheader |= HAS_NRHK_BIT;
 		}
+		if (r->sendingpending)
+		{
+			// the sending chain is derived after loading
+			WRITEDATA(r->remotepublickey, ECNUM_SIZE);
+			*ratchetheader |= HAS_SENDPENDING_BIT;
+		}
 		if (!allzeroes(r->sendingchain.chainkey, KEY_SIZE))
 		{
 			WRITEUINT32(r->sendingchain.generation);
@@ -353,6 +404,34 @@ mr_result mr_ctx_state_store(mr_ctx _ctx, uint8_t* ptr, uint32_t space)
 				WRITEDATA(r->receivingchain.oldchainkey, KEY_SIZE);
 				*ratchetheader |= HAS_RCHAIN_OK_BIT;
 			}
+			if (!allzeroes((const uint8_t*)r->receivingchain.replay, sizeof(r->receivingchain.replay)))
+			{
+				// the window size is written so state can be loaded
+				// by a build with a different window size.
+				uint32_t words = REPLAY_WINDOW_WORDS;
+				WRITEUINT32(words);
+				for (uint32_t w = 0; w < words; w++)
+				{
+					WRITEUINT32(r->receivingchain.replay[w]);
+				}
+				*ratchetheader |= HAS_RCHAIN_REPLAY_BIT;
+			}
+#if MR_CHAIN_CHECKPOINTS > 0
+			uint32_t checkpoints = checkpoints_count(&r->receivingchain);
+			if (checkpoints)
+			{
+				WRITEUINT32(checkpoints);
+				for (int c = 0; c < MR_CHAIN_CHECKPOINTS; c++)
+				{
+					if (!allzeroes(r->receivingchain.checkpoints[c].chainkey, KEY_SIZE))
+					{
+						WRITEUINT32(r->receivingchain.checkpoints[c].generation);
+						WRITEDATA(r->receivingchain.checkpoints[c].chainkey, KEY_SIZE);
+					}
+				}
+				*ratchetheader |= HAS_RCHAIN_CHECKPOINTS_BIT;
+			}
+#endif
 		}
 
 		r = r->next;
@@ -387,11 +466,13 @@ mr_result mr_ctx_state_load(mr_ctx _ctx, const uint8_t* ptr, uint32_t space, uin
 {
 	// TODO: memory could leak if an allocation fails
 	_mr_ctx* ctx = _ctx;
+	FAILIF(ctx->txn, MR_E_INVALIDOP, "State cannot be loaded during a transaction");
 
 	uint32_t ospace = space;
 	bool client = ctx->config.is_client;
 	uint32_t mainheader;
 	READUINT32(mainheader);
+	FAILIF((mainheader >> 24) > STORAGE_VERSION, MR_E_INVALIDOP, "The state was stored by a newer version");
 	if (mainheader & HAS_INIT_BIT)
 	{
 		ctx->init.initialized = false;
@@ -423,6 +504,10 @@ mr_result mr_ctx_state_load(mr_ctx _ctx, const uint8_t* ptr, uint32_t space, uin
 				{
 					READECDH(c->localecdhforinit);
 				}
+				if (mainheader & HAS_COOKIE_BIT)
+				{
+					READDATA(c->cookie, COOKIE_SIZE);
+				}
 			}
 			else
 			{
@@ -553,6 +638,11 @@ mr_result mr_ctx_state_load(mr_ctx _ctx, const uint8_t* ptr, uint32_t space, uin
 		{
 			READDATA(r->nextreceiveheaderkey, KEY_SIZE);
 		}
+		if (ratchetheader & HAS_SENDPENDING_BIT)
+		{
+			READDATA(r->remotepublickey, ECNUM_SIZE);
+			r->sendingpending = true;
+		}
 		if (ratchetheader & HAS_SCHAIN_BIT)
 		{
 			READUINT32(r->sendingchain.generation);
@@ -572,6 +662,44 @@ mr_result mr_ctx_state_load(mr_ctx _ctx, const uint8_t* ptr, uint32_t space, uin
 				READUINT32(r->receivingchain.oldgeneration);
 				READDATA(r->receivingchain.oldchainkey, KEY_SIZE);
 			}
+			if (ratchetheader & HAS_RCHAIN_REPLAY_BIT)
+			{
+				// if the window stored is bigger than ours the oldest
+				// generations are forgotten and considered replayed.
+				uint32_t words;
+				READUINT32(words);
+				for (uint32_t w = 0; w < words; w++)
+				{
+					uint32_t word;
+					READUINT32(word);
+					if (w < REPLAY_WINDOW_WORDS)
+					{
+						r->receivingchain.replay[w] = word;
+					}
+				}
+			}
+			if (ratchetheader & HAS_RCHAIN_CHECKPOINTS_BIT)
+			{
+				// checkpoints that don't fit are dropped. Late messages
+				// will be received from an older key or not at all.
+				uint32_t checkpoints;
+				READUINT32(checkpoints);
+				for (uint32_t c = 0; c < checkpoints; c++)
+				{
+					uint32_t generation;
+					uint8_t chainkey[KEY_SIZE];
+					READUINT32(generation);
+					READDATA(chainkey, KEY_SIZE);
+#if MR_CHAIN_CHECKPOINTS > 0
+					if (c < MR_CHAIN_CHECKPOINTS)
+					{
+						r->receivingchain.checkpoints[c].generation = generation;
+						mr_memcpy(r->receivingchain.checkpoints[c].chainkey, chainkey, KEY_SIZE);
+					}
+#endif
+					mr_memzero(chainkey, KEY_SIZE);
+				}
+			}
 		}
 	}
 
@@ -15,6 +15,48 @@
 #define HL_STATE_INITIALIZING 1
 #define HL_STATE_INITIALIZED 2
 
+// the number of size classes idle actions are pooled in. The
+// smallest class fits a minimum sized message with ECDH and each
+// class after that is twice the size of the one before.
+#define HL_POOL_BUCKETS 8
+
+// the default maximum number of idle actions kept per size
+// class and idle wait handles kept for reuse.
+#define HL_DEFAULT_POOL_SIZE 8
+
+// the default maximum number of messages passed to
+// transmit_batch or receive_batch at once.
+#define HL_DEFAULT_BATCH_SIZE 16
+
+// the size of the length prefix of each payload in
+// a coalesced message.
+#define HL_RECORD_HEADER_SIZE 2
+
+// the size of the header of each fragment when an mtu is set:
+// message id (2), fragment index (1), fragment count (1), length (2).
+#define HL_FRAGMENT_HEADER_SIZE 6
+
+// the default number of messages reassembled at once.
+#define HL_DEFAULT_REASSEMBLY_SLOTS 4
+
+// the default maximum number of actions processed for a
+// context before a loop moves on to the next context.
+#define HL_DEFAULT_QUANTUM 8
+
+// the most initialization messages held back whose signatures are
+// verified together
+#define HL_HANDSHAKE_BATCH 16
+
+// the timers of a high-level context
+#define HL_TIMER_INITIALIZE 1
+#define HL_TIMER_KEEPALIVE 2
+
+// the queue lanes. Control actions are always processed
+// before bulk actions (messages to send).
+#define HL_LANE_CONTROL 0
+#define HL_LANE_BULK 1
+#define HL_LANES 2
+
 // some crude reference counting to ensure
 // objects can be referenced from multiple threads
 // safely
@@ -62,9 +104,25 @@ struct t_action {
 	// the size of the buffer for sending
 	uint32_t space_available;
 
+	// the size of the buffer allocated along with the action
+	uint32_t capacity;
+
+	// the pool size class of the action or HL_POOL_BUCKETS
+	// if the action is too big to be pooled
+	uint32_t bucket;
+
+	// if set, data points to a buffer owned by the caller
+	// that is handed back through this function when the
+	// action is freed.
+	release_fn release;
+	void* release_user;
+
 	// if set, notify will be called with this argument
 	void* notify;
 
+	// when the action was queued if there is a clock
+	uint32_t enqueued;
+
 	// the result of the action
 	mr_result result;
 
@@ -75,6 +133,25 @@ struct t_action {
 	struct t_action* next;
 };
 typedef struct t_action action;
+typedef struct t_hlloop hlloop;
+
+// a message being reassembled from fragments. The slot
+// is free if there is no data.
+typedef struct t_hlreassembly {
+	uint8_t* data;
+	uint32_t size;
+	uint32_t sequence;
+	uint16_t id;
+	uint8_t count;
+	uint8_t received;
+	uint8_t have[32];
+} hlreassembly;
+
+// a list of queued actions
+typedef struct t_hllane {
+	action* head;
+	action** ptail;
+} hllane;
 
 typedef struct t_hlctx {
 
@@ -86,8 +163,21 @@ typedef struct t_hlctx {
 	// will exit.
 	bool active;
 
-	// the main action list
-	action* head;
+	// the queued actions by lane
+	hllane lanes[HL_LANES];
+
+	// protects the action lanes and the counts below. Producers on any
+	// thread race with the main loop so they are only touched while
+	// holding it.
+	ptrdiff_t queue_lock;
+
+	// the number of queued actions counted against the queue capacity,
+	// the number of producers waiting for space, the wait handle they
+	// wait on and whether the high watermark was reached.
+	uint32_t queued;
+	uint32_t space_waiters;
+	void* space_notify;
+	bool above_watermark;
 
 	// configuration passed to mr_hl_mainloop
 	const mr_hl_config* config;
@@ -108,8 +198,136 @@ typedef struct t_hlctx {
 
 	// the result of initialization
 	mr_result initialize_result;
+
+	// protects the pools below
+	ptrdiff_t pool_lock;
+
+	// the maximum number of items kept in each pool
+	uint32_t pool_size;
+
+	// idle actions kept for reuse, by size class
+	action* action_pool[HL_POOL_BUCKETS];
+	uint32_t action_pool_count[HL_POOL_BUCKETS];
+
+	// idle wait handles kept for reuse
+	void** waithandle_pool;
+	uint32_t waithandle_pool_count;
+
+	// space for collecting actions processed together
+	// by transmit_batch and receive_batch
+	uint32_t batch_size;
+	action** batch_actions;
+	mr_iovec* batch_iov;
+
+	// the header keys of a batch of received messages found
+	// in parallel, or zeroes for messages not recognized.
+	uint8_t* batch_keys;
+
+	// the message payloads are being coalesced into and
+	// the time by which it must be sent
+	action* coalesce;
+	uint32_t coalesce_deadline;
+
+	// the context this belongs to
+	_mr_ctx* ctx;
+
+	// the loop this context is attached to, if any, the next context
+	// attached to the same loop and whether a thread is servicing it.
+	hlloop* loop;
+	struct t_hlctx* loop_next;
+	bool busy;
+
+	// the timer wheel timers are scheduled on and the lock protecting it
+	// (and timers_due), or null if there is no clock. The wheel belongs to
+	// the loop if the context is attached to one.
+	_mr_timer_wheel* wheel;
+	ptrdiff_t* wheel_lock;
+	ptrdiff_t own_wheel_lock;
+
+	// the timers and which of them have fired and need handling
+	_mr_timer initialize_timer;
+	_mr_timer keepalive_timer;
+	uint32_t timers_due;
+
+	// when the current initialization attempt was started and how
+	// long to wait before the next attempt
+	uint32_t initialize_started;
+	uint32_t initialize_interval;
+
+	// when a message with ECDH parameters was last sent, how many
+	// messages have been sent since and whether a keepalive is needed
+	uint32_t last_ecdh;
+	uint32_t messages_without_ecdh;
+	bool keepalive_pending;
+
+	// when pipelining, the ring of encrypted messages waiting for
+	// mr_hl_transmitloop, the lock protecting it and the wait handle
+	// the transmit loop waits on.
+	action** pipeline;
+	uint32_t pipeline_depth;
+	uint32_t pipeline_head;
+	uint32_t pipeline_count;
+	ptrdiff_t pipeline_lock;
+	void* transmit_notify;
+
+	// when an mtu is set, the id of the next message to fragment, the
+	// buffer fragments are encrypted into and the messages being
+	// reassembled.
+	uint16_t fragment_id;
+	uint8_t* fragment_buffer;
+	hlreassembly* reassembly;
+	uint32_t reassembly_slots;
+	uint32_t reassembly_sequence;
+
+	// received messages that returned MR_E_PENDING, oldest first. They
+	// are tried again when there is nothing else to do.
+	action* parked_head;
+	action* parked_tail;
+
+	// when attached to a loop that holds back handshakes, the received
+	// initialization messages waiting for established sessions to run out
+	// of work, oldest first, and the thousandths of a handshake that can
+	// still be accepted as of when they were last counted.
+	action* handshake_head;
+	action* handshake_tail;
+	uint64_t handshake_tokens;
+	uint32_t handshake_counted;
+
+	// counters returned by mr_hl_get_stats and the lock protecting them
+	mr_hl_stats stats;
+	ptrdiff_t stats_lock;
 } hlctx;
 
+struct t_hlloop {
+
+	// will be true until mr_hl_loop_stop is called
+	bool active;
+
+	// configuration passed to mr_hl_loop_create
+	mr_hl_loop_config config;
+
+	// the single wait handle notified by all attached
+	// contexts when actions are enqueued
+	void* notify;
+
+	// protects the list of contexts below
+	ptrdiff_t lock;
+
+	// the attached contexts and the one to service next
+	hlctx* contexts;
+	hlctx* next;
+	uint32_t count;
+
+	// the number of initialization messages waiting across all attached
+	// contexts and the number dropped. Also protected by lock.
+	uint32_t handshakes_queued;
+	uint64_t handshakes_shed;
+
+	// the timers of all attached contexts if there is a clock
+	_mr_timer_wheel wheel;
+	ptrdiff_t wheel_lock;
+};
+
 static uint32_t quantize(uint32_t size, uint32_t multiple)
 {
 	if (multiple <= 1)
@@ -123,534 +341,2576 @@ static uint32_t quantize(uint32_t size, uint32_t multiple)
 	}
 }
 
-static action* hl_action_dequeue(_mr_ctx* ctx, hlctx* hl, action** phead)
+// get the current time for a context.
+static uint32_t hl_now(hlctx* hl)
+{
+	return hl->loop
+		? hl->loop->config.now(hl->loop->config.user)
+		: hl->config->now(hl->config->user);
+}
+
+// schedule a timer of a context to fire after a delay in milliseconds.
+static void hl_timer_schedule(hlctx* hl, _mr_timer* timer, uint32_t delay)
 {
-	action* act = *phead;
-	while (act)
+	if (hl->wheel)
 	{
-		// replace the head if the head remains the head
-		if ((action*)ATOMIC_COMPARE_EXCHANGE(*phead, act->next, act))
-		{
-			act->next = 0;
-			break;
-		}
+		uint32_t now = hl_now(hl);
+		spin_lock(hl->wheel_lock);
+		timer_schedule(hl->wheel, timer, now + delay);
+		spin_unlock(hl->wheel_lock);
+	}
+}
 
-		act = *phead;
+// cancel a timer of a context.
+static void hl_timer_cancel(hlctx* hl, _mr_timer* timer)
+{
+	if (hl->wheel)
+	{
+		spin_lock(hl->wheel_lock);
+		timer_cancel(hl->wheel, timer);
+		hl->timers_due &= ~timer->id;
+		spin_unlock(hl->wheel_lock);
 	}
+}
 
-	return act;
+// advance a timer wheel and mark the contexts whose timers have
+// fired. The timers are handled when the contexts are next processed.
+static void hl_timers_expire(_mr_timer_wheel* wheel, ptrdiff_t* lock, uint32_t now)
+{
+	spin_lock(lock);
+	_mr_timer* timer = timer_wheel_advance(wheel, now);
+	while (timer)
+	{
+		_mr_timer* next = timer->next;
+		timer->next = 0;
+		((hlctx*)timer->owner)->timers_due |= timer->id;
+		timer = next;
+	}
+	spin_unlock(lock);
 }
 
-static bool hl_action_enqueue(_mr_ctx *ctx, hlctx *hl, action** phead, action* act)
+// get the size class for a buffer of the given size and
+// the capacity of buffers in that class.
+static uint32_t hl_pool_bucket(const hlctx* hl, uint32_t size, uint32_t* capacity)
 {
-	for (;;)
+	uint32_t classsize = MIN_MESSAGE_SIZE_WITH_ECDH;
+	for (uint32_t i = 0; i < HL_POOL_BUCKETS; i++, classsize <<= 1)
 	{
-		if (!hl->active)
+		uint32_t classcapacity = quantize(classsize, hl->config->message_quantization);
+		if (size <= classcapacity)
 		{
-			return false;
+			*capacity = classcapacity;
+			return i;
 		}
+	}
+
+	*capacity = size;
+	return HL_POOL_BUCKETS;
+}
+
+// get an action with a buffer of at least the given size, either
+// from the pool or by allocating a new one.
+static mr_result hl_action_get(_mr_ctx* ctx, hlctx* hl, uint32_t size, action** pact)
+{
+	uint32_t capacity;
+	uint32_t bucket = hl_pool_bucket(hl, size, &capacity);
 
-		action* head = *phead;
-		if (!head)
+	action* act = 0;
+	if (bucket < HL_POOL_BUCKETS)
+	{
+		spin_lock(&hl->pool_lock);
+		act = hl->action_pool[bucket];
+		if (act)
 		{
-			// this item is will be the first in the list
-			action* zero = 0;
-			if (ATOMIC_COMPARE_EXCHANGE(*phead, act, zero))
-			{
-				return true;
-			}
+			hl->action_pool[bucket] = act->next;
+			hl->action_pool_count[bucket]--;
 		}
-		else
-		{
-			// find the tail
-			action* item = head;
-			while (item->next) item = item->next;
+		spin_unlock(&hl->pool_lock);
+	}
 
-			// tack on the new item if the tail remains the tail
-			action* zero = 0;
-			if (ATOMIC_COMPARE_EXCHANGE(item->next, act, zero))
-			{
-				if (*phead)
-				{
-					return true;
-				}
-				// if the head changed we tacked it onto the wrong list
-			}
-		}
+	if (!act)
+	{
+		_C(mr_allocate(ctx, sizeof(action) + capacity, (void**)&act));
 	}
+
+	mr_memzero(act, sizeof(action));
+	act->data = (uint8_t*)act + sizeof(action);
+	act->capacity = capacity;
+	act->bucket = bucket;
+	*pact = act;
+
+	return MR_E_SUCCESS;
 }
 
-static bool mr_hl_release(_mr_ctx* ctx, hlctx* hl)
+// get a wait handle from the pool or create a new one.
+static void* hl_waithandle_get(hlctx* hl)
 {
-	if (ref_release(hl))
+	void* wh = 0;
+
+	spin_lock(&hl->pool_lock);
+	if (hl->waithandle_pool_count)
 	{
-		hl->config->destroy_wait_handle(hl->config->user, hl->action_notify);
-		hl->action_notify = 0;
-		memset(hl, 0xcc, sizeof(hl));
-		mr_free(ctx, hl);
-		ctx->highlevel = 0;
-		return true;
+		wh = hl->waithandle_pool[--hl->waithandle_pool_count];
 	}
+	spin_unlock(&hl->pool_lock);
 
-	return false;
+	if (!wh)
+	{
+		wh = hl->config->create_wait_handle(hl->config->user);
+	}
+
+	return wh;
 }
 
-static bool mr_act_release(_mr_ctx* ctx, hlctx* hl, action* act)
+// return a wait handle to the pool. A handle that may still
+// receive a notification (i.e. its wait timed out) is not
+// reusable and will be destroyed.
+static void hl_waithandle_put(hlctx* hl, void* wh, bool reusable)
 {
-	if (ref_release(act))
+	if (reusable)
 	{
-		// we need to free
-		if (act->notify) hl->config->destroy_wait_handle(hl->config->user, act->notify);
-		memset(act, 0xcc, sizeof(action));
-		mr_free(ctx, act);
-		return true;
+		spin_lock(&hl->pool_lock);
+		if (hl->waithandle_pool_count < hl->pool_size)
+		{
+			hl->waithandle_pool[hl->waithandle_pool_count++] = wh;
+			wh = 0;
+		}
+		spin_unlock(&hl->pool_lock);
 	}
 
-	return false;
+	if (wh)
+	{
+		hl->config->destroy_wait_handle(hl->config->user, wh);
+	}
 }
 
-static mr_result hl_action_add(mr_ctx _ctx, int naction, const uint8_t* data, uint32_t amount, uint32_t timeout)
+// return an action to the pool or free it if the pool is full.
+static void hl_action_put(_mr_ctx* ctx, hlctx* hl, action* act)
 {
-	_mr_ctx* ctx = (_mr_ctx*)_ctx;
-	FAILIF(!ctx, MR_E_INVALIDARG, "ctx must be provided");
-	hlctx* hl = (hlctx*)ctx->highlevel;
-	FAILIF(!hl, MR_E_INVALIDOP, "The high level event loop is not running");
-	FAILIF(!ref_acquire(hl), MR_E_INVALIDOP, "The high level event loop has exited");
+	if (act->release)
+	{
+		act->release(act->release_user, act->data);
+		act->release = 0;
+	}
 
-	const mr_hl_config* hlconfig = hl->config;
+	if (act->notify)
+	{
+		hl_waithandle_put(hl, act->notify, !act->timeout);
+		act->notify = 0;
+	}
 
-	mr_result result = MR_E_SUCCESS;
-	size_t actionid = (size_t)ATOMIC_INCREMENT(action_id_counter);
+	if (act->bucket < HL_POOL_BUCKETS)
+	{
+		spin_lock(&hl->pool_lock);
+		if (hl->action_pool_count[act->bucket] < hl->pool_size)
+		{
+			act->next = hl->action_pool[act->bucket];
+			hl->action_pool[act->bucket] = act;
+			hl->action_pool_count[act->bucket]++;
+			act = 0;
+		}
+		spin_unlock(&hl->pool_lock);
+	}
 
-	// copy argument data
-	action* newact;
-	if (naction == HL_ACTION_SEND)
+	if (act)
 	{
-		// check
-		FAILIF(!data, MR_E_INVALIDARG, "data must be provided");
-		FAILIF(!amount, MR_E_INVALIDARG, "amount must be greater than zero");
+		memset(act, 0xcc, sizeof(action));
+		mr_free(ctx, act);
+	}
+}
 
-		// we allocate a buffer slightly bigger for header, padding and (sometimes) ECDH
-		// we do it here because otherwise we would need to allocate AGAIN later.
-		uint32_t space_available = amount + OVERHEAD_WITH_ECDH;
-		if (space_available < MIN_MESSAGE_SIZE_WITH_ECDH)
+// free everything kept in the pools.
+static void hl_pool_drain(_mr_ctx* ctx, hlctx* hl)
+{
+	for (uint32_t i = 0; i < HL_POOL_BUCKETS; i++)
+	{
+		action* act = hl->action_pool[i];
+		while (act)
 		{
-			space_available = MIN_MESSAGE_SIZE_WITH_ECDH;
+			action* next = act->next;
+			mr_free(ctx, act);
+			act = next;
 		}
-		space_available = quantize(space_available, hlconfig->message_quantization);
+		hl->action_pool[i] = 0;
+		hl->action_pool_count[i] = 0;
+	}
 
-		// allocate space for the message and its data
-		uint8_t* buffer;
-		_C(mr_allocate(ctx, sizeof(action) + space_available, (void**)&buffer));
-		newact = (action*)buffer;
-		mr_memzero(newact, sizeof(action));
-		newact->data = buffer + sizeof(action);
-		newact->size = amount;
-		newact->space_available = space_available;
+	while (hl->waithandle_pool_count)
+	{
+		hl->config->destroy_wait_handle(hl->config->user, hl->waithandle_pool[--hl->waithandle_pool_count]);
+	}
+}
 
-		// copy in data
-		mr_memcpy(newact->data, data, amount);
+// free the buffer of a message being reassembled.
+static void hl_reassembly_free(_mr_ctx* ctx, hlreassembly* slot)
+{
+	if (slot->data)
+	{
+		mr_free(ctx, slot->data);
+		slot->data = 0;
 	}
-	else if (naction == HL_ACTION_RECEIVE_DATA || naction == HL_ACTION_RECEIVE)
+}
+
+static bool mr_act_release(_mr_ctx* ctx, hlctx* hl, action* act)
+{
+	if (ref_release(act))
 	{
-		// check
-		FAILIF(!amount, MR_E_INVALIDARG, "amount must be greater than zero");
-		if (naction == HL_ACTION_RECEIVE_DATA)
+		// we need to free or recycle
+		hl_action_put(ctx, hl, act);
+		return true;
+	}
+
+	return false;
+}
+
+// completes an action by setting its result and notifying anyone
+// waiting for it, then releases the reference held by the queue.
+static void hl_action_complete(_mr_ctx* ctx, hlctx* hl, action* item, mr_result result, bool initialize_notify)
+{
+	const mr_hl_config* config = hl->config;
+
+	if (!item->timeout)
+	{
+		if (item->naction == HL_ACTION_SEND && result == MR_E_SUCCESS)
 		{
-			FAILIF(!data, MR_E_INVALIDARG, "data must be provided");
+			uint32_t latency = hl->wheel ? hl_now(hl) - item->enqueued : 0;
+			spin_lock(&hl->stats_lock);
+			hl->stats.messages_sent++;
+			hl->stats.payload_bytes_sent += item->size;
+			hl->stats.send_latency_total += latency;
+			if (latency > hl->stats.send_latency_max)
+			{
+				hl->stats.send_latency_max = latency;
+			}
+			spin_unlock(&hl->stats_lock);
 		}
 
-		uint32_t spaceavailable = amount;
-		if (!ctx->init.initialized && amount < 256)
+		// set the result
+		item->result = result;
+
+		// notify that the action is completed
+		if (item->notify)
 		{
-			// during initialization, larger buffers
-			// are needed for response messages
-			spaceavailable = 256;
+			TRACEMSGCTX(ctx, "--->item->notify");
+			config->notify(config->user, item->notify);
 		}
 
-		// allocate space for the action and arguments
-		uint8_t* buffer;
-		_C(mr_allocate(ctx, sizeof(action) + spaceavailable, (void**)&buffer));
-		newact = (action*)buffer;
-		mr_memzero(newact, sizeof(action));
-		newact->data = buffer + sizeof(action);
-		newact->size = amount;
-		newact->space_available = spaceavailable;
-
-		if (naction == HL_ACTION_RECEIVE_DATA)
+		// we need to notify this after the one above because
+		// it works like an action complete notification.
+		if (initialize_notify)
 		{
-			// copy in data if we have it already
-			mr_memcpy(newact->data, data, amount);
+			TRACEMSGCTX(ctx, "--->hl.initialize_notify");
+			config->notify(config->user, hl->initialize_notify);
 		}
 	}
-	else if (naction == HL_ACTION_NONE || naction == HL_ACTION_TERMINATE || naction == HL_ACTION_INITIALIZE)
+	else
 	{
-		// just allocate the action
-		_C(mr_allocate(ctx, sizeof(action), (void**)&newact));
-		mr_memzero(newact, sizeof(action));
+		TRACEMSGCTX(ctx, "****completed timed out action");
 	}
-	else
+
+	// release and perhaps free the item
+	if (mr_act_release(ctx, hl, item))
 	{
-		FAILMSG(MR_E_INVALIDARG, "Invalid action");
+		TRACEMSGCTX(ctx, "####free action from inside mainloop");
 	}
+}
 
-	// setup other action paramters
-	newact->naction = naction;
-	newact->next = 0;
-	newact->result = MR_E_SUCCESS;
-	newact->timeout = false;
+// gets the lane an action is queued in.
+static uint32_t hl_action_lane(const action* act)
+{
+	return act->naction == HL_ACTION_SEND ? HL_LANE_BULK : HL_LANE_CONTROL;
+}
 
-	if (timeout == 0)
+// checks whether an action counts against the queue capacity.
+static bool hl_action_bounded(const action* act)
+{
+	return act->naction == HL_ACTION_SEND ||
+		act->naction == HL_ACTION_RECEIVE ||
+		act->naction == HL_ACTION_RECEIVE_DATA;
+}
+
+// checks whether there are no queued actions.
+static bool hl_queue_empty(const hlctx* hl)
+{
+	return !hl->lanes[HL_LANE_CONTROL].head && !hl->lanes[HL_LANE_BULK].head;
+}
+
+// accounts for an action removed from the queue. Must be called while
+// holding the queue lock. Returns true if the low watermark was reached.
+static bool hl_action_removed(hlctx* hl, action* act)
+{
+	if (hl_action_bounded(act))
 	{
-		newact->notify = 0;
-		TRACEMSGCTX(ctx, "####enqueueing action without waiting");
-		if (hl_action_enqueue(ctx, hl, &hl->head, newact))
-		{
-			TRACEMSGCTX(ctx, "--->notify hl->action_notify");
-			hlconfig->notify(hlconfig->user, hl->action_notify);
-			result = MR_E_ACTION_ENQUEUED;
-		}
-		else
+		hl->queued--;
+		if (hl->above_watermark && hl->queued <= hl->config->queue_low_watermark)
 		{
-			// free the item
-			newact->ref = 1;
-			mr_act_release(ctx, hl, newact);
-			FAILMSGNOEXIT("Could not enqueue the item beause the main loop is exiting");
-			result = MR_E_INVALIDOP;
+			hl->above_watermark = false;
+			return true;
 		}
 	}
-	else
+
+	return false;
+}
+
+// lets producers know there is space in the queue again. Must be called
+// after removing actions from the queue and releasing the queue lock.
+static void hl_space_available(hlctx* hl, bool low_watermark)
+{
+	const mr_hl_config* config = hl->config;
+	if (hl->space_notify && hl->space_waiters)
 	{
-		ref_acquire(newact);
+		config->notify(config->user, hl->space_notify);
+	}
 
-		// create a wait handle for the action
-		newact->notify = hlconfig->create_wait_handle(hlconfig->user);
+	if (low_watermark)
+	{
+		config->queue_watermark(config->user, false);
+	}
+}
 
-		// enqueue the action
-		TRACEMSGCTX(ctx, "####enqueueing action");
-		if (hl_action_enqueue(ctx, hl, &hl->head, newact))
-		{
-			TRACEMSGCTX(ctx, "--->notify hl->action_notify");
-			hlconfig->notify(hlconfig->user, hl->action_notify);
+// unlinks an action from a lane. Must be called while holding the queue
+// lock. Returns false if the action was not in the lane.
+static bool hl_lane_remove(hllane* lane, action* act)
+{
+	action** pitem = &lane->head;
+	while (*pitem && *pitem != act) pitem = &(*pitem)->next;
+	if (!*pitem)
+	{
+		return false;
+	}
 
-			// block until the action is completed or timed out
-			bool wait_success = hl->active &&  hlconfig->wait(hlconfig->user, newact->notify, timeout);
+	*pitem = act->next;
+	if (lane->ptail == &act->next)
+	{
+		lane->ptail = pitem;
+	}
+	act->next = 0;
+	return true;
+}
 
-			TRACEMSGCTX(ctx, "####action completed");
+// takes the next action to process, control actions first. If
+// control_only is set, bulk actions are left in the queue.
+static action* hl_action_dequeue(hlctx* hl, bool control_only)
+{
+	action* act = 0;
+	bool low_watermark = false;
+	uint32_t lanes = control_only ? HL_LANE_CONTROL + 1 : HL_LANES;
 
-			// return the result of the action
-			if (wait_success)
-			{
-				result = newact->result;
-			}
-			else
+	spin_lock(&hl->queue_lock);
+	for (uint32_t i = 0; i < lanes && !act; i++)
+	{
+		hllane* lane = &hl->lanes[i];
+		act = lane->head;
+		if (act)
+		{
+			lane->head = act->next;
+			if (!lane->head)
 			{
-				newact->timeout = true;
-				result = MR_E_TIMEOUT;
+				lane->ptail = &lane->head;
 			}
+			act->next = 0;
+			low_watermark = hl_action_removed(hl, act);
 		}
-		else
-		{
-			FAILMSGNOEXIT("Could not enqueue the item beause the main loop is exiting");
-			result = MR_E_INVALIDOP;
-		}
+	}
+	spin_unlock(&hl->queue_lock);
 
-		// release and maybe free the item
-		if (mr_act_release(ctx, hl, newact))
-		{
-			TRACEMSGCTX(ctx, "####free action from outside mainloop");
-		}
+	if (act)
+	{
+		hl_space_available(hl, low_watermark);
 	}
 
-	// release and possibly free the high level context
-	if (mr_hl_release(ctx, hl))
+	return act;
+}
+
+// the part of a timeout that started at the given time that is left. Without
+// a clock there is no telling how much has passed and all of it is left.
+static uint32_t hl_remaining(hlctx* hl, uint32_t started, uint32_t timeout)
+{
+	if (!hl->wheel || timeout == 0xffffffff)
 	{
-		TRACEMSGCTX(ctx, "Free HL context from hl_action_add");
+		return timeout;
 	}
 
-	return result;
+	uint32_t elapsed = hl_now(hl) - started;
+	return elapsed < timeout ? timeout - elapsed : 0;
 }
 
-mr_result mr_hl_mainloop(mr_ctx _ctx, const mr_hl_config* config)
+// adds an action to the end of its lane, applying the queue capacity.
+// If an action is dropped to make space it is completed with
+// MR_E_QUEUEFULL. When blocking, waits for space until timeout
+// milliseconds after started.
+static mr_result hl_action_enqueue(_mr_ctx* ctx, hlctx* hl, action* act, uint32_t started, uint32_t timeout)
 {
-	_mr_ctx* ctx = (_mr_ctx*)_ctx;
-	FAILIF(!ctx, MR_E_INVALIDARG, "ctx must be provided");
-	FAILIF(!config, MR_E_INVALIDARG, "config must be provided");
-	FAILIF(!ctx->identity, MR_E_INVALIDOP, "context identity must be set before calling mainloop");
-	FAILIF(!(config->create_wait_handle && config->wait && config->notify &&
+	const mr_hl_config* config = hl->config;
+	bool bounded = config->queue_capacity && hl_action_bounded(act);
+	mr_result result = MR_E_SUCCESS;
+	action* dropped = 0;
+	bool high_watermark = false;
+
+	spin_lock(&hl->queue_lock);
+	if (bounded && hl->queued >= config->queue_capacity)
+	{
+		if (config->queue_policy == MR_HL_QUEUE_BLOCK)
+		{
+			// wait for space. Any thread taking actions off the queue
+			// will notify while there are waiters. Another thread may
+			// take the space first, so only what is left of the timeout
+			// is waited for each time.
+			while (hl->active && hl->queued >= config->queue_capacity)
+			{
+				uint32_t remaining = timeout ? hl_remaining(hl, started, timeout) : 0xffffffff;
+				if (!remaining)
+				{
+					result = MR_E_TIMEOUT;
+					break;
+				}
+
+				hl->space_waiters++;
+				spin_unlock(&hl->queue_lock);
+				bool notified = config->wait(config->user, hl->space_notify, remaining);
+				spin_lock(&hl->queue_lock);
+				hl->space_waiters--;
+
+				if (!notified && timeout)
+				{
+					result = MR_E_TIMEOUT;
+					break;
+				}
+			}
+		}
+		else if (config->queue_policy == MR_HL_QUEUE_DROP && hl->lanes[HL_LANE_BULK].head)
+		{
+			// the new action takes the place of the dropped one
+			dropped = hl->lanes[HL_LANE_BULK].head;
+			hl_lane_remove(&hl->lanes[HL_LANE_BULK], dropped);
+			hl->queued--;
+		}
+		else
+		{
+			result = MR_E_QUEUEFULL;
+		}
+	}
+
+	if (result == MR_E_SUCCESS && !hl->active)
+	{
+		result = MR_E_INVALIDOP;
+	}
+
+	if (result == MR_E_SUCCESS)
+	{
+		hllane* lane = &hl->lanes[hl_action_lane(act)];
+		*lane->ptail = act;
+		lane->ptail = &act->next;
+
+		if (hl_action_bounded(act))
+		{
+			hl->queued++;
+			if (config->queue_watermark && !hl->above_watermark && hl->queued >= config->queue_high_watermark)
+			{
+				hl->above_watermark = true;
+				high_watermark = true;
+			}
+		}
+	}
+
+	// pass the wakeup on if there is still space for another waiter
+	bool more_space = bounded && hl->space_waiters && (hl->queued < config->queue_capacity || !hl->active);
+	spin_unlock(&hl->queue_lock);
+
+	if (more_space)
+	{
+		config->notify(config->user, hl->space_notify);
+	}
+
+	if (dropped)
+	{
+		TRACEMSGCTX(ctx, "####dropped the oldest queued action");
+		hl_action_complete(ctx, hl, dropped, MR_E_QUEUEFULL, false);
+	}
+
+	if (high_watermark)
+	{
+		config->queue_watermark(config->user, true);
+	}
+
+	return result;
+}
+
+// checks whether the pipeline has no room for another message.
+static bool hl_pipeline_full(hlctx* hl)
+{
+	return hl->pipeline && hl->pipeline_count == hl->pipeline_depth;
+}
+
+// hands an encrypted message to the transmit loop. The size of the
+// action must be the number of bytes to transmit. Returns false if
+// the pipeline is full.
+static bool hl_pipeline_push(hlctx* hl, action* act)
+{
+	bool pushed = false;
+
+	spin_lock(&hl->pipeline_lock);
+	if (hl->pipeline_count < hl->pipeline_depth)
+	{
+		hl->pipeline[(hl->pipeline_head + hl->pipeline_count) % hl->pipeline_depth] = act;
+		hl->pipeline_count++;
+		pushed = true;
+	}
+	spin_unlock(&hl->pipeline_lock);
+
+	if (pushed)
+	{
+		hl->config->notify(hl->config->user, hl->transmit_notify);
+	}
+
+	return pushed;
+}
+
+// takes the oldest message from the pipeline. was_full receives
+// whether the pipeline was full before.
+static action* hl_pipeline_pop(hlctx* hl, bool* was_full)
+{
+	action* act = 0;
+
+	spin_lock(&hl->pipeline_lock);
+	*was_full = hl->pipeline_count == hl->pipeline_depth;
+	if (hl->pipeline_count)
+	{
+		act = hl->pipeline[hl->pipeline_head];
+		hl->pipeline_head = (hl->pipeline_head + 1) % hl->pipeline_depth;
+		hl->pipeline_count--;
+	}
+	spin_unlock(&hl->pipeline_lock);
+
+	return act;
+}
+
+static bool mr_hl_release(_mr_ctx* ctx, hlctx* hl)
+{
+	if (ref_release(hl))
+	{
+		// messages that never made it to the transmit loop
+		bool was_full;
+		action* act;
+		while (hl->pipeline && (act = hl_pipeline_pop(hl, &was_full)) != 0)
+		{
+			mr_act_release(ctx, hl, act);
+		}
+
+		hl_pool_drain(ctx, hl);
+		for (uint32_t i = 0; i < hl->reassembly_slots; i++)
+		{
+			hl_reassembly_free(ctx, &hl->reassembly[i]);
+		}
+		if (hl->initialize_buffer)
+		{
+			mr_free(ctx, hl->initialize_buffer);
+			hl->initialize_buffer = 0;
+		}
+		if (!hl->loop)
+		{
+			hl->config->destroy_wait_handle(hl->config->user, hl->action_notify);
+		}
+		if (hl->space_notify)
+		{
+			hl->config->destroy_wait_handle(hl->config->user, hl->space_notify);
+		}
+		if (hl->transmit_notify)
+		{
+			hl->config->destroy_wait_handle(hl->config->user, hl->transmit_notify);
+		}
+		hl->action_notify = 0;
+		memset(hl, 0xcc, sizeof(hlctx));
+		mr_free(ctx, hl);
+		ctx->highlevel = 0;
+		return true;
+	}
+
+	return false;
+}
+
+// wake up whatever is processing actions for the context.
+static void hl_wake(hlctx* hl)
+{
+	if (hl->loop)
+	{
+		hl->loop->config.notify(hl->loop->config.user, hl->loop->notify);
+	}
+	else
+	{
+		hl->config->notify(hl->config->user, hl->action_notify);
+	}
+}
+
+static mr_result hl_action_submit(_mr_ctx* ctx, hlctx* hl, action* newact, uint32_t timeout);
+
+static mr_result hl_action_add(mr_ctx _ctx, int naction, const uint8_t* data, uint32_t amount, uint32_t timeout)
+{
+	_mr_ctx* ctx = (_mr_ctx*)_ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "ctx must be provided");
+	hlctx* hl = (hlctx*)ctx->highlevel;
+	FAILIF(!hl, MR_E_INVALIDOP, "The high level event loop is not running");
+	FAILIF(!ref_acquire(hl), MR_E_INVALIDOP, "The high level event loop has exited");
+
+	const mr_hl_config* hlconfig = hl->config;
+
+	size_t actionid = (size_t)ATOMIC_INCREMENT(action_id_counter);
+
+	// copy argument data
+	action* newact;
+	if (naction == HL_ACTION_SEND)
+	{
+		// check
+		FAILIF(!data, MR_E_INVALIDARG, "data must be provided");
+		FAILIF(!amount, MR_E_INVALIDARG, "amount must be greater than zero");
+
+		// we allocate a buffer slightly bigger for header, padding and (sometimes) ECDH
+		// we do it here because otherwise we would need to allocate AGAIN later.
+		uint32_t space_available = amount + OVERHEAD_WITH_ECDH;
+		if (space_available < MIN_MESSAGE_SIZE_WITH_ECDH)
+		{
+			space_available = MIN_MESSAGE_SIZE_WITH_ECDH;
+		}
+		space_available = quantize(space_available, hlconfig->message_quantization);
+
+		// get space for the message and its data
+		_C(hl_action_get(ctx, hl, space_available, &newact));
+		newact->size = amount;
+		newact->space_available = space_available;
+
+		// copy in data
+		mr_memcpy(newact->data, data, amount);
+	}
+	else if (naction == HL_ACTION_RECEIVE_DATA || naction == HL_ACTION_RECEIVE)
+	{
+		// check
+		FAILIF(!amount, MR_E_INVALIDARG, "amount must be greater than zero");
+		if (naction == HL_ACTION_RECEIVE_DATA)
+		{
+			FAILIF(!data, MR_E_INVALIDARG, "data must be provided");
+		}
+
+		uint32_t spaceavailable = amount;
+		if (!ctx->init.initialized && amount < 256)
+		{
+			// during initialization, larger buffers
+			// are needed for response messages
+			spaceavailable = 256;
+		}
+
+		// get space for the action and arguments
+		_C(hl_action_get(ctx, hl, spaceavailable, &newact));
+		newact->size = amount;
+		newact->space_available = spaceavailable;
+
+		if (naction == HL_ACTION_RECEIVE_DATA)
+		{
+			// copy in data if we have it already
+			mr_memcpy(newact->data, data, amount);
+		}
+	}
+	else if (naction == HL_ACTION_NONE || naction == HL_ACTION_TERMINATE || naction == HL_ACTION_INITIALIZE)
+	{
+		// just get the action
+		_C(hl_action_get(ctx, hl, 0, &newact));
+	}
+	else
+	{
+		FAILMSG(MR_E_INVALIDARG, "Invalid action");
+	}
+
+	newact->naction = naction;
+	return hl_action_submit(ctx, hl, newact, timeout);
+}
+
+// enqueues an action and waits for it if a timeout is given. Releases
+// the reference to the high level context held by the caller.
+static mr_result hl_action_submit(_mr_ctx* ctx, hlctx* hl, action* newact, uint32_t timeout)
+{
+	const mr_hl_config* hlconfig = hl->config;
+	mr_result result = MR_E_SUCCESS;
+
+	// setup other action paramters
+	newact->next = 0;
+	newact->enqueued = hl->wheel ? hl_now(hl) : 0;
+	newact->result = MR_E_SUCCESS;
+	newact->timeout = false;
+
+	// the queue holds a reference until the main loop is done with the action
+	newact->ref = 1;
+
+	if (timeout == 0)
+	{
+		newact->notify = 0;
+		TRACEMSGCTX(ctx, "####enqueueing action without waiting");
+		result = hl_action_enqueue(ctx, hl, newact, 0, 0);
+		if (result == MR_E_SUCCESS)
+		{
+			TRACEMSGCTX(ctx, "--->notify hl->action_notify");
+			hl_wake(hl);
+			result = MR_E_ACTION_ENQUEUED;
+		}
+		else
+		{
+			// free the item
+			mr_act_release(ctx, hl, newact);
+			FAILMSGNOEXIT("Could not enqueue the item");
+		}
+	}
+	else
+	{
+		ref_acquire(newact);
+
+		// get a wait handle for the action
+		newact->notify = hl_waithandle_get(hl);
+
+		// enqueue the action. The timeout covers both waiting
+		// for space in the queue and waiting for completion.
+		TRACEMSGCTX(ctx, "####enqueueing action");
+		uint32_t started = hl->wheel ? hl_now(hl) : 0;
+		result = hl_action_enqueue(ctx, hl, newact, started, timeout);
+		if (result == MR_E_SUCCESS)
+		{
+			TRACEMSGCTX(ctx, "--->notify hl->action_notify");
+			hl_wake(hl);
+
+			// block until the action is completed or timed out. Once enqueued an
+			// action is always completed, even if the main loop is exiting.
+			uint32_t remaining = hl_remaining(hl, started, timeout);
+			bool wait_success = hlconfig->wait(hlconfig->user, newact->notify, remaining ? remaining : 1);
+
+			TRACEMSGCTX(ctx, "####action completed");
+
+			// return the result of the action
+			if (wait_success)
+			{
+				result = newact->result;
+			}
+			else
+			{
+				// take the action back out of the queue if it is still
+				// there. Otherwise it is being processed and will be
+				// completed and freed by the main loop.
+				spin_lock(&hl->queue_lock);
+				bool removed = hl_lane_remove(&hl->lanes[hl_action_lane(newact)], newact);
+				bool low_watermark = removed && hl_action_removed(hl, newact);
+				if (!removed)
+				{
+					newact->timeout = true;
+				}
+				spin_unlock(&hl->queue_lock);
+
+				if (removed)
+				{
+					TRACEMSGCTX(ctx, "####reclaimed timed out action");
+					hl_space_available(hl, low_watermark);
+					mr_act_release(ctx, hl, newact);
+				}
+
+				result = MR_E_TIMEOUT;
+			}
+		}
+		else
+		{
+			// release the reference that would have been held by the queue
+			mr_act_release(ctx, hl, newact);
+			FAILMSGNOEXIT("Could not enqueue the item");
+		}
+
+		// release and maybe free the item
+		if (mr_act_release(ctx, hl, newact))
+		{
+			TRACEMSGCTX(ctx, "####free action from outside mainloop");
+		}
+	}
+
+	// release and possibly free the high level context
+	if (mr_hl_release(ctx, hl))
+	{
+		TRACEMSGCTX(ctx, "Free HL context from hl_action_submit");
+	}
+
+	return result;
+}
+
+// dequeues the actions directly following the given one for as long
+// as they are of the same kind so that they can be processed together.
+// Returns the number of actions placed in hl->batch_actions.
+static uint32_t hl_action_collect(hlctx* hl, action* first)
+{
+	uint32_t count = 0;
+	hl->batch_actions[count++] = first;
+	hllane* lane = &hl->lanes[hl_action_lane(first)];
+	bool low_watermark = false;
+
+	spin_lock(&hl->queue_lock);
+	while (count < hl->batch_size)
+	{
+		action* head = lane->head;
+		if (!head || head->naction != first->naction)
+		{
+			break;
+		}
+
+		hl_lane_remove(lane, head);
+		low_watermark |= hl_action_removed(hl, head);
+		hl->batch_actions[count++] = head;
+	}
+	spin_unlock(&hl->queue_lock);
+
+	if (count > 1)
+	{
+		hl_space_available(hl, low_watermark);
+	}
+
+	return count;
+}
+
+// decides whether the next message sent should include ECDH parameters.
+static bool hl_include_ecdh(hlctx* hl)
+{
+	return hl->config->ecdh_frequency <= 1 ? true : (++hl->message_nr) % hl->config->ecdh_frequency;
+}
+
+// keeps track of a message encrypted to be transmitted.
+static void hl_encrypted(hlctx* hl, uint32_t payloadsize, uint32_t messagesize)
+{
+	spin_lock(&hl->stats_lock);
+	hl->stats.messages_transmitted++;
+	hl->stats.bytes_transmitted += messagesize;
+	spin_unlock(&hl->stats_lock);
+
+	// keep track of ECDH parameters sent for keepalives. This
+	// mirrors how mr_ctx_send decides whether to include them.
+	if (messagesize - payloadsize >= OVERHEAD_WITH_ECDH)
+	{
+		hl->messages_without_ecdh = 0;
+		if (hl->wheel)
+		{
+			hl->last_ecdh = hl_now(hl);
+		}
+	}
+	else if (hl->config->keepalive_messages && ++hl->messages_without_ecdh >= hl->config->keepalive_messages)
+	{
+		hl->keepalive_pending = true;
+	}
+}
+
+// the largest message transmitted when an mtu is set.
+static uint32_t hl_message_limit(const mr_hl_config* config)
+{
+	uint32_t multiple = config->message_quantization;
+	return multiple > 1 ? config->mtu - config->mtu % multiple : config->mtu;
+}
+
+// the most payload carried by a single fragment.
+static uint32_t hl_fragment_capacity(const mr_hl_config* config)
+{
+	return hl_message_limit(config) - OVERHEAD_WITHOUT_ECDH - HL_FRAGMENT_HEADER_SIZE;
+}
+
+// splits the payload of a SEND action into fragments no larger than the
+// mtu and transmits them one after the other. Each fragment is encrypted
+// straight from the payload into the fragment buffer.
+static mr_result hl_send_fragments(_mr_ctx* ctx, hlctx* hl, action* item)
+{
+	const mr_hl_config* config = hl->config;
+	FAILIF(!ctx->init.initialized, MR_E_INVALIDOP, "Cannot send before initialization has completed");
+
+	uint32_t limit = hl_message_limit(config);
+	uint32_t capacity = hl_fragment_capacity(config);
+	uint32_t count = (item->size + capacity - 1) / capacity;
+	FAILIF(count > 255, MR_E_INVALIDSIZE, "The payload needs more than 255 fragments");
+
+	uint16_t id = hl->fragment_id++;
+	uint32_t offset = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t length = item->size - offset < capacity ? item->size - offset : capacity;
+		uint8_t header[HL_FRAGMENT_HEADER_SIZE] = {
+			(uint8_t)(id >> 8), (uint8_t)id,
+			(uint8_t)i, (uint8_t)count,
+			(uint8_t)(length >> 8), (uint8_t)length
+		};
+		mr_iovec parts[2] = { { header, sizeof(header) }, { item->data + offset, length } };
+
+		// full fragments fill the mtu. Smaller ones include ECDH
+		// parameters if there is room for them.
+		uint32_t payloadsize = HL_FRAGMENT_HEADER_SIZE + length;
+		bool ecdh = hl_include_ecdh(hl);
+		uint32_t size = payloadsize + (ecdh ? OVERHEAD_WITH_ECDH : OVERHEAD_WITHOUT_ECDH);
+		uint32_t minimum = ecdh ? MIN_MESSAGE_SIZE_WITH_ECDH : MIN_MESSAGE_SIZE;
+		size = quantize(size < minimum ? minimum : size, config->message_quantization);
+		if (size > limit)
+		{
+			size = limit;
+		}
+
+		_C(mr_ctx_send_gather(ctx, parts, 2, hl->fragment_buffer, size));
+		hl_encrypted(hl, payloadsize, size);
+		FAILIF(config->transmit(config->user, hl->fragment_buffer, size) != size, MR_E_FAIL, "Transmit failed");
+		offset += length;
+	}
+
+	return MR_E_SUCCESS;
+}
+
+// passes a received payload to the data callback.
+static void hl_deliver(hlctx* hl, const uint8_t* payload, uint32_t size)
+{
+	spin_lock(&hl->stats_lock);
+	hl->stats.messages_received++;
+	hl->stats.payload_bytes_received += size;
+	spin_unlock(&hl->stats_lock);
+
+	if (hl->config->data_callback)
+	{
+		TRACEMSGCTX(hl->ctx, "****invoking data callback");
+		hl->config->data_callback(hl->config->user, payload, size);
+	}
+}
+
+// collects a received fragment, delivering the message once all of its
+// fragments are in. Fragments may arrive in any order. If all slots are
+// taken, the message that started reassembly first is given up on.
+static mr_result hl_reassemble(_mr_ctx* ctx, hlctx* hl, const uint8_t* payload, uint32_t size)
+{
+	// all zeroes is padding (i.e. a keepalive)
+	if (size < HL_FRAGMENT_HEADER_SIZE || payload[3] == 0)
+	{
+		return MR_E_SUCCESS;
+	}
+
+	uint32_t capacity = hl_fragment_capacity(hl->config);
+	uint16_t id = (uint16_t)((payload[0] << 8) | payload[1]);
+	uint8_t index = payload[2];
+	uint8_t count = payload[3];
+	uint32_t length = ((uint32_t)payload[4] << 8) | payload[5];
+	FAILIF(index >= count || length > size - HL_FRAGMENT_HEADER_SIZE || length > capacity ||
+		(index < count - 1 && length != capacity),
+		MR_E_INVALIDSIZE, "A fragment had an invalid header");
+	payload += HL_FRAGMENT_HEADER_SIZE;
+
+	if (count == 1)
+	{
+		hl_deliver(hl, payload, length);
+		return MR_E_SUCCESS;
+	}
+
+	hlreassembly* slot = 0;
+	hlreassembly* victim = 0;
+	for (uint32_t i = 0; i < hl->reassembly_slots; i++)
+	{
+		hlreassembly* s = &hl->reassembly[i];
+		if (s->data && s->id == id && s->count == count)
+		{
+			slot = s;
+			break;
+		}
+		else if (!victim || (victim->data && (!s->data || (int32_t)(s->sequence - victim->sequence) < 0)))
+		{
+			victim = s;
+		}
+	}
+
+	if (!slot)
+	{
+		if (victim->data)
+		{
+			TRACEMSGCTX(ctx, "****dropping incomplete message");
+			hl_reassembly_free(ctx, victim);
+			spin_lock(&hl->stats_lock);
+			hl->stats.messages_dropped++;
+			spin_unlock(&hl->stats_lock);
+		}
+
+		slot = victim;
+		_C(mr_allocate(ctx, count * capacity, (void**)&slot->data));
+		mr_memzero(slot->have, sizeof(slot->have));
+		slot->size = 0;
+		slot->sequence = hl->reassembly_sequence++;
+		slot->id = id;
+		slot->count = count;
+		slot->received = 0;
+	}
+
+	// duplicates are ignored
+	if (slot->have[index / 8] & (1 << (index % 8)))
+	{
+		return MR_E_SUCCESS;
+	}
+
+	slot->have[index / 8] |= (uint8_t)(1 << (index % 8));
+	mr_memcpy(slot->data + index * capacity, payload, length);
+	slot->size += length;
+	if (++slot->received == count)
+	{
+		hl_deliver(hl, slot->data, slot->size);
+		hl_reassembly_free(ctx, slot);
+	}
+
+	return MR_E_SUCCESS;
+}
+
+// encrypts the message of a SEND action in place. On success
+// size will receive the number of bytes to transmit.
+static mr_result hl_encrypt(_mr_ctx* ctx, hlctx* hl, action* item, uint32_t* size)
+{
+	FAILIF(!ctx->init.initialized, MR_E_INVALIDOP, "Cannot send before initialization has completed");
+
+	uint32_t space_available = item->space_available;
+	if (!hl_include_ecdh(hl))
+	{
+		// the message size is already padded at least MIN_MESSAGE_SIZE
+		space_available -= ECNUM_SIZE;
+	}
+
+	_C(mr_ctx_send(ctx, item->data, item->size, space_available));
+	*size = space_available;
+	hl_encrypted(hl, item->size, space_available);
+
+	return MR_E_SUCCESS;
+}
+
+// check if a buffer is all zeroes. Keepalives carry no payload
+// and so consist only of padding.
+static bool hl_is_empty(const uint8_t* payload, uint32_t size)
+{
+	uint8_t bits = 0;
+	for (uint32_t i = 0; i < size; i++)
+	{
+		bits |= payload[i];
+	}
+	return bits == 0;
+}
+
+// processes the data received for a RECEIVE or RECEIVE_DATA action.
+// initialize_notify is set if initialization completed as a result. checked
+// is the signature of an initialization request verified already, if any.
+static mr_result hl_process_received(_mr_ctx* ctx, hlctx* hl, action* item, const uint8_t* headerkey,
+	const _mr_checked_signature* checked, bool* initialize_notify)
+{
+	const mr_hl_config* config = hl->config;
+	bool initdonebefore = ctx->init.initialized;
+
+	// process the received data
+	uint32_t data_received_size;
+	uint8_t* payload = 0;
+	mr_result result = headerkey
+		? mr_ctx_receive_verified(ctx,
+			item->data,
+			item->size,
+			item->space_available,
+			headerkey,
+			KEY_SIZE,
+			&payload,
+			&data_received_size)
+		: ctx_receive_checked(ctx,
+			item->data,
+			item->size,
+			item->space_available,
+			checked,
+			&payload,
+			&data_received_size);
+
+	if (result == MR_E_SUCCESS || result == MR_E_SENDBACK)
+	{
+		spin_lock(&hl->stats_lock);
+		hl->stats.messages_arrived++;
+		hl->stats.bytes_arrived += item->size;
+		spin_unlock(&hl->stats_lock);
+	}
+
+	if (result == MR_E_SUCCESS)
+	{
+		// call the data callback
+		if (data_received_size && config->mtu)
+		{
+			result = hl_reassemble(ctx, hl, payload, data_received_size);
+		}
+		else if (config->data_callback && data_received_size && config->coalesce_threshold)
+		{
+			// split up coalesced payloads. The padding at the end of
+			// the message reads as a zero length which terminates.
+			uint32_t offset = 0;
+			while (offset + HL_RECORD_HEADER_SIZE <= data_received_size)
+			{
+				uint32_t recordsize = ((uint32_t)payload[offset] << 8) | payload[offset + 1];
+				offset += HL_RECORD_HEADER_SIZE;
+				if (recordsize == 0)
+				{
+					break;
+				}
+				else if (recordsize > data_received_size - offset)
+				{
+					DEBUGMSG("A coalesced message contained an invalid payload size");
+					result = MR_E_INVALIDSIZE;
+					break;
+				}
+
+				hl_deliver(hl, payload + offset, recordsize);
+				offset += recordsize;
+			}
+		}
+		else if (config->data_callback && data_received_size &&
+			!((config->keepalive_interval || config->keepalive_messages) && hl_is_empty(payload, data_received_size)))
+		{
+			hl_deliver(hl, payload, data_received_size);
+		}
+		else
+		{
+			TRACEMSGCTX(ctx, "****NOT invoking data callback");
+		}
+	}
+	else if (result == MR_E_SENDBACK)
+	{
+		TRACEMSGCTX(ctx, "****transmitting sendback data");
+		// we need to send an initialization response
+		if (config->transmit(config->user, payload, data_received_size) != data_received_size)
+		{
+			DEBUGMSG("transmission of sendback data failed");
+			// if the transmit fails, the whole initialization process needs
+			// to start over. We rely on a timeout to make this happen.
+			result = MR_E_FAIL;
+		}
+	}
+
+	// check if initialization is done
+	if (ctx->init.initialized && !initdonebefore)
+	{
+		TRACEMSGCTX(ctx, "****initialization completed");
+		if (hl->initialize_notify)
+		{
+			TRACEMSGCTX(ctx, "****notifying initialization is complete");
+			*initialize_notify = true;
+			hl->initialize_result = MR_E_SUCCESS;
+		}
+		if (hl->initialize_buffer)
+		{
+			mr_free(ctx, hl->initialize_buffer);
+			hl->initialize_buffer = 0;
+		}
+
+		// stop retrying and start sending keepalives
+		hl_timer_cancel(hl, &hl->initialize_timer);
+		hl->messages_without_ecdh = 0;
+		if (hl->wheel && config->keepalive_interval)
+		{
+			hl->last_ecdh = hl_now(hl);
+			hl_timer_schedule(hl, &hl->keepalive_timer, config->keepalive_interval);
+		}
+	}
+
+	return result;
+}
+
+// encrypts and transmits the payloads coalesced so far.
+static mr_result hl_coalesce_flush(_mr_ctx* ctx, hlctx* hl)
+{
+	action* act = hl->coalesce;
+	if (!act)
+	{
+		return MR_E_SUCCESS;
+	}
+
+	TRACEMSGCTX(ctx, "****flushing coalesced payloads");
+	hl->coalesce = 0;
+
+	uint32_t size = 0;
+	mr_result result = hl_encrypt(ctx, hl, act, &size);
+	if (result == MR_E_SUCCESS && hl->config->transmit(hl->config->user, act->data, size) != size)
+	{
+		DEBUGMSG("Transmit failed");
+		result = MR_E_FAIL;
+	}
+
+	mr_act_release(ctx, hl, act);
+	return result;
+}
+
+// appends the payload of a SEND action to the message payloads
+// are being coalesced into, sending it once it is full enough.
+static mr_result hl_coalesce(_mr_ctx* ctx, hlctx* hl, action* item)
+{
+	const mr_hl_config* config = hl->config;
+	FAILIF(!ctx->init.initialized, MR_E_INVALIDOP, "Cannot send before initialization has completed");
+	FAILIF(item->size > 0xffff, MR_E_INVALIDSIZE, "Coalesced payloads cannot be larger than 65535 bytes");
+
+	uint32_t recordsize = HL_RECORD_HEADER_SIZE + item->size;
+
+	// send what we have if the payload will not fit
+	action* act = hl->coalesce;
+	if (act && act->size + recordsize > act->space_available - OVERHEAD_WITH_ECDH)
+	{
+		_C(hl_coalesce_flush(ctx, hl));
+		act = 0;
+	}
+
+	if (!act)
+	{
+		uint32_t space_available = (recordsize > config->coalesce_threshold ? recordsize : config->coalesce_threshold) + OVERHEAD_WITH_ECDH;
+		if (space_available < MIN_MESSAGE_SIZE_WITH_ECDH)
+		{
+			space_available = MIN_MESSAGE_SIZE_WITH_ECDH;
+		}
+		space_available = quantize(space_available, config->message_quantization);
+
+		_C(hl_action_get(ctx, hl, space_available, &act));
+		act->ref = 1;
+		act->naction = HL_ACTION_SEND;
+		act->space_available = space_available;
+		hl->coalesce = act;
+		hl->coalesce_deadline = config->now ? config->now(config->user) + config->coalesce_delay : 0;
+	}
+
+	act->data[act->size] = (uint8_t)(item->size >> 8);
+	act->data[act->size + 1] = (uint8_t)item->size;
+	mr_memcpy(act->data + act->size + HL_RECORD_HEADER_SIZE, item->data, item->size);
+	act->size += recordsize;
+
+	if (act->size >= config->coalesce_threshold)
+	{
+		_C(hl_coalesce_flush(ctx, hl));
+	}
+
+	return MR_E_SUCCESS;
+}
+
+// gets the number of milliseconds until coalesced payloads must be sent.
+static uint32_t hl_coalesce_remaining(hlctx* hl)
+{
+	const mr_hl_config* config = hl->config;
+	if (!config->coalesce_delay || !config->now)
+	{
+		return 0;
+	}
+
+	int32_t remaining = (int32_t)(hl->coalesce_deadline - config->now(config->user));
+	return remaining > 0 ? (uint32_t)remaining : 0;
+}
+
+// encrypts a run of queued SEND actions back to back and hands
+// them to transmit_batch all at once.
+static void hl_send_batch(_mr_ctx* ctx, hlctx* hl, action* first)
+{
+	const mr_hl_config* config = hl->config;
+	action** batch = hl->batch_actions;
+	mr_iovec* iov = hl->batch_iov;
+	uint32_t count = hl_action_collect(hl, first);
+	uint32_t ntransmit = 0;
+
+	TRACEMSGCTX(ctx, "****dequeued SEND action batch");
+	for (uint32_t i = 0; i < count; i++)
+	{
+		action* item = batch[i];
+		if (!item->timeout)
+		{
+			uint32_t size = 0;
+			item->result = hl_encrypt(ctx, hl, item, &size);
+			if (item->result == MR_E_SUCCESS)
+			{
+				iov[ntransmit].data = item->data;
+				iov[ntransmit].size = size;
+				ntransmit++;
+			}
+		}
+	}
+
+	uint32_t transmitted = ntransmit ? config->transmit_batch(config->user, iov, ntransmit) : 0;
+	if (transmitted < ntransmit)
+	{
+		DEBUGMSG("Transmit failed");
+	}
+
+	for (uint32_t i = 0, j = 0; i < count; i++)
+	{
+		action* item = batch[i];
+		if (!item->timeout && item->result == MR_E_SUCCESS && j++ >= transmitted)
+		{
+			item->result = MR_E_FAIL;
+		}
+
+		hl_action_complete(ctx, hl, item, item->result, false);
+	}
+}
+
+// finds the header key of one message in a batch. Runs on a worker thread.
+static void hl_verify_work(void* arg, uint32_t index)
+{
+	hlctx* hl = (hlctx*)arg;
+	action* item = hl->batch_actions[index];
+	uint8_t* key = hl->batch_keys + index * KEY_SIZE;
+	if (mr_ctx_receive_verify(hl->ctx, item->data, item->size, key, KEY_SIZE) != MR_E_SUCCESS)
+	{
+		mr_memzero(key, KEY_SIZE);
+	}
+}
+
+// keeps a received message that is too far ahead in its chain to be
+// tried again later. Returns false if the result is not MR_E_PENDING.
+static bool hl_park(hlctx* hl, action* item, mr_result result)
+{
+	if (result != MR_E_PENDING)
+	{
+		return false;
+	}
+
+	TRACEMSGCTX(hl->ctx, "****parking received message");
+	item->next = 0;
+	if (hl->parked_tail)
+	{
+		hl->parked_tail->next = item;
+	}
+	else
+	{
+		hl->parked_head = item;
+	}
+	hl->parked_tail = item;
+
+	spin_lock(&hl->stats_lock);
+	hl->stats.messages_parked++;
+	spin_unlock(&hl->stats_lock);
+	return true;
+}
+
+// tries the oldest parked message again. Each try moves its chain
+// closer by up to the KDF budget, so the catch-up is spread over
+// several turns of the loop. Once it is received the others follow.
+static void hl_catchup(_mr_ctx* ctx, hlctx* hl)
+{
+	while (hl->parked_head)
+	{
+		action* item = hl->parked_head;
+		mr_result result = MR_E_TIMEOUT;
+		bool initialize_notify = false;
+		if (!item->timeout)
+		{
+			result = hl_process_received(ctx, hl, item, 0, 0, &initialize_notify);
+			if (result == MR_E_PENDING)
+			{
+				break;
+			}
+		}
+
+		hl->parked_head = item->next;
+		if (!hl->parked_head)
+		{
+			hl->parked_tail = 0;
+		}
+		item->next = 0;
+
+		spin_lock(&hl->stats_lock);
+		hl->stats.messages_parked--;
+		spin_unlock(&hl->stats_lock);
+		hl_action_complete(ctx, hl, item, result, initialize_notify);
+	}
+
+	uint32_t outstanding = 0;
+	mr_ctx_catchup(ctx, 0, &outstanding);
+	spin_lock(&hl->stats_lock);
+	hl->stats.catchup_outstanding = outstanding;
+	spin_unlock(&hl->stats_lock);
+}
+
+// whether a received message is initialization work for a server. That
+// is the expensive part: verifying a signature and several key agreements.
+// At most one MAC is checked to find out, the ratchets are not searched.
+static bool hl_is_handshake(_mr_ctx* ctx, const action* item)
+{
+	bool initialization = false;
+	return !ctx->config.is_client &&
+		ctx_is_initialization(ctx, item->data, item->size, &initialization) == MR_E_SUCCESS &&
+		initialization;
+}
+
+// keeps an initialization message received by a server attached to a loop
+// with a handshake queue until established sessions have nothing left to
+// do. It is dropped instead if the context has used up its handshake rate
+// or the queue is full. Returns false if the message is to be processed
+// right away.
+static bool hl_handshake_defer(_mr_ctx* ctx, hlctx* hl, action* item)
+{
+	hlloop* loop = hl->loop;
+	if (!loop || !loop->config.handshake_queue || !hl_is_handshake(ctx, item))
+	{
+		return false;
+	}
+
+	// a token bucket per context. Each millisecond adds rate
+	// thousandths of a handshake, up to the burst.
+	bool admitted = true;
+	if (loop->config.handshake_rate)
+	{
+		uint32_t now = hl_now(hl);
+		uint64_t burst = (uint64_t)loop->config.handshake_burst * 1000;
+		hl->handshake_tokens += (uint64_t)(now - hl->handshake_counted) * loop->config.handshake_rate;
+		hl->handshake_counted = now;
+		if (hl->handshake_tokens > burst)
+		{
+			hl->handshake_tokens = burst;
+		}
+		admitted = hl->handshake_tokens >= 1000;
+	}
+
+	spin_lock(&loop->lock);
+	admitted = admitted && loop->handshakes_queued < loop->config.handshake_queue;
+	if (admitted)
+	{
+		loop->handshakes_queued++;
+	}
+	else
+	{
+		loop->handshakes_shed++;
+	}
+	spin_unlock(&loop->lock);
+
+	if (!admitted)
+	{
+		TRACEMSGCTX(ctx, "****dropping initialization message");
+		spin_lock(&hl->stats_lock);
+		hl->stats.handshakes_shed++;
+		spin_unlock(&hl->stats_lock);
+		hl_action_complete(ctx, hl, item, MR_E_QUEUEFULL, false);
+		return true;
+	}
+
+	TRACEMSGCTX(ctx, "****holding back initialization message");
+	if (loop->config.handshake_rate)
+	{
+		hl->handshake_tokens -= 1000;
+	}
+	item->next = 0;
+	if (hl->handshake_tail)
+	{
+		hl->handshake_tail->next = item;
+	}
+	else
+	{
+		hl->handshake_head = item;
+	}
+	hl->handshake_tail = item;
+
+	spin_lock(&hl->stats_lock);
+	hl->stats.handshakes_queued++;
+	spin_unlock(&hl->stats_lock);
+	return true;
+}
+
+// removes the oldest initialization message held back for a context.
+static action* hl_handshake_take(hlctx* hl)
+{
+	action* item = hl->handshake_head;
+	hl->handshake_head = item->next;
+	if (!hl->handshake_head)
+	{
+		hl->handshake_tail = 0;
+	}
+	item->next = 0;
+
+	spin_lock(&hl->loop->lock);
+	hl->loop->handshakes_queued--;
+	spin_unlock(&hl->loop->lock);
+	spin_lock(&hl->stats_lock);
+	hl->stats.handshakes_queued--;
+	spin_unlock(&hl->stats_lock);
+	return item;
+}
+
+// processes the oldest initialization message held back for a context.
+static void hl_handshake_run(_mr_ctx* ctx, hlctx* hl, const _mr_checked_signature* checked)
+{
+	action* item = hl_handshake_take(hl);
+	mr_result result = MR_E_TIMEOUT;
+	bool initialize_notify = false;
+	if (!item->timeout)
+	{
+		TRACEMSGCTX(ctx, "****processing initialization message held back");
+		result = hl_process_received(ctx, hl, item, 0, checked, &initialize_notify);
+	}
+
+	hl_action_complete(ctx, hl, item, result, initialize_notify);
+}
+
+// processes the first count messages in hl->batch_actions. If there are
+// several and a parallel function is configured, their MACs are checked
+// in parallel first. Nothing else touches the context meanwhile because
+// this is the thread processing it. Decryption, which changes the state
+// of the context, then happens in order on this thread.
+static void hl_process_received_batch(_mr_ctx* ctx, hlctx* hl, uint32_t count)
+{
+	const mr_hl_config* config = hl->config;
+	bool verified = false;
+
+	if (config->parallel && count > 1 && ctx->init.initialized)
+	{
+		TRACEMSGCTX(ctx, "****verifying received messages in parallel");
+		config->parallel(config->user, hl_verify_work, hl, count);
+		verified = true;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		action* item = hl->batch_actions[i];
+		const uint8_t* key = hl->batch_keys + i * KEY_SIZE;
+		bool initialize_notify = false;
+		if (hl_handshake_defer(ctx, hl, item))
+		{
+			continue;
+		}
+
+		// messages not recognized may be under keys earlier messages bring
+		mr_result result = hl_process_received(ctx, hl, item,
+			verified && !hl_is_empty(key, KEY_SIZE) ? key : 0,
+			0, &initialize_notify);
+		if (!hl_park(hl, item, result))
+		{
+			hl_action_complete(ctx, hl, item, result, initialize_notify);
+		}
+	}
+}
+
+// retrieves the data for a run of queued RECEIVE actions with a single
+// call to receive_batch and processes each message received.
+static void hl_receive_batch(_mr_ctx* ctx, hlctx* hl, action* first)
+{
+	const mr_hl_config* config = hl->config;
+	action** batch = hl->batch_actions;
+	mr_iovec* iov = hl->batch_iov;
+	uint32_t count = hl_action_collect(hl, first);
+
+	TRACEMSGCTX(ctx, "****dequeued RECEIVE action batch");
+
+	// timed out actions do not receive, same as when receiving one at a time
+	uint32_t nreceive = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		action* item = batch[i];
+		if (item->timeout)
+		{
+			hl_action_complete(ctx, hl, item, MR_E_TIMEOUT, false);
+		}
+		else
+		{
+			batch[nreceive] = item;
+			iov[nreceive].data = item->data;
+			iov[nreceive].size = item->size;
+			nreceive++;
+		}
+	}
+
+	uint32_t received = nreceive ? config->receive_batch(config->user, iov, nreceive) : 0;
+
+	// fail what was not received
+	uint32_t nprocess = 0;
+	for (uint32_t i = 0; i < nreceive; i++)
+	{
+		action* item = batch[i];
+		if (i < received && iov[i].size > 0 && iov[i].size <= item->size)
+		{
+			item->size = iov[i].size;
+			batch[nprocess++] = item;
+		}
+		else
+		{
+			hl_action_complete(ctx, hl, item, MR_E_FAIL, false);
+		}
+	}
+
+	hl_process_received_batch(ctx, hl, nprocess);
+}
+
+// processes the RECEIVE_DATA action given and those queued directly after it.
+static void hl_receive_data_batch(_mr_ctx* ctx, hlctx* hl, action* first)
+{
+	action** batch = hl->batch_actions;
+	uint32_t count = hl_action_collect(hl, first);
+
+	TRACEMSGCTX(ctx, "****dequeued RECEIVE_DATA action batch");
+
+	uint32_t nprocess = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		action* item = batch[i];
+		if (item->timeout)
+		{
+			hl_action_complete(ctx, hl, item, MR_E_TIMEOUT, false);
+		}
+		else
+		{
+			batch[nprocess++] = item;
+		}
+	}
+
+	hl_process_received_batch(ctx, hl, nprocess);
+}
+
+// sends a new initialization request if initialization has not completed
+// in time, backing off each time, and gives up after INITIALIZE_TIMEOUT.
+static void hl_initialize_retry(_mr_ctx* ctx, hlctx* hl)
+{
+	const mr_hl_config* config = hl->config;
+	if (ctx->init.initialized || !hl->initialize_buffer)
+	{
+		return;
+	}
+
+	mr_result result = MR_E_TIMEOUT;
+	uint32_t elapsed = hl_now(hl) - hl->initialize_started;
+	if (elapsed < INITIALIZE_TIMEOUT)
+	{
+		TRACEMSGCTX(ctx, "****retrying initialization");
+		result = mr_ctx_initiate_initialization(ctx, hl->initialize_buffer, 256, true);
+		if (result == MR_E_SENDBACK)
+		{
+			if (config->transmit(config->user, hl->initialize_buffer, 256) != 256)
+			{
+				// we'll try again next time
+				DEBUGMSG("Transmit failed");
+			}
+
+			hl->initialize_interval *= 2;
+			uint32_t remaining = INITIALIZE_TIMEOUT - elapsed;
+			hl_timer_schedule(hl, &hl->initialize_timer,
+				hl->initialize_interval < remaining ? hl->initialize_interval : remaining);
+			return;
+		}
+	}
+
+	// give up
+	TRACEMSGCTX(ctx, "****initialization failed");
+	mr_free(ctx, hl->initialize_buffer);
+	hl->initialize_buffer = 0;
+	hl->initialize_result = result;
+	if (hl->initialize_notify)
+	{
+		config->notify(config->user, hl->initialize_notify);
+	}
+}
+
+// sends an empty message carrying ECDH parameters if none has been sent
+// for too long or for too many messages so key exchange keeps happening.
+static void hl_keepalive(_mr_ctx* ctx, hlctx* hl, bool timer)
+{
+	const mr_hl_config* config = hl->config;
+	if (!ctx->init.initialized)
+	{
+		return;
+	}
+
+	if (timer)
+	{
+		uint32_t since = hl_now(hl) - hl->last_ecdh;
+		if (since < config->keepalive_interval)
+		{
+			// ECDH parameters went out since the timer was set
+			hl_timer_schedule(hl, &hl->keepalive_timer, config->keepalive_interval - since);
+			return;
+		}
+	}
+
+	// the message is sent directly so ecdh_frequency does not apply. When
+	// pipelining it goes through the pipeline to keep messages in order
+	// and is skipped if the pipeline is full as messages are being sent.
+	uint32_t space_available = quantize(MIN_MESSAGE_SIZE_WITH_ECDH, config->message_quantization);
+	action* act;
+	if (!hl_pipeline_full(hl) && hl_action_get(ctx, hl, space_available, &act) == MR_E_SUCCESS)
+	{
+		TRACEMSGCTX(ctx, "****sending keepalive");
+		act->ref = 1;
+		if (mr_ctx_send(ctx, act->data, 0, space_available) != MR_E_SUCCESS)
+		{
+			DEBUGMSG("Encrypting a keepalive failed");
+			mr_act_release(ctx, hl, act);
+		}
+		else if (hl->pipeline)
+		{
+			hl_encrypted(hl, 0, space_available);
+			hl_pipeline_push(hl, act);
+		}
+		else
+		{
+			hl_encrypted(hl, 0, space_available);
+			if (config->transmit(config->user, act->data, space_available) != space_available)
+			{
+				DEBUGMSG("Transmit failed");
+			}
+			mr_act_release(ctx, hl, act);
+		}
+	}
+
+	hl->messages_without_ecdh = 0;
+	hl->last_ecdh = hl->wheel ? hl_now(hl) : 0;
+	hl->keepalive_pending = false;
+	if (hl->wheel && config->keepalive_interval)
+	{
+		hl_timer_schedule(hl, &hl->keepalive_timer, config->keepalive_interval);
+	}
+}
+
+// handles the timers of a context that have fired.
+static void hl_timers_run(_mr_ctx* ctx, hlctx* hl)
+{
+	uint32_t due = 0;
+	if (hl->wheel)
+	{
+		spin_lock(hl->wheel_lock);
+		due = hl->timers_due;
+		hl->timers_due = 0;
+		spin_unlock(hl->wheel_lock);
+	}
+
+	if (due & HL_TIMER_INITIALIZE)
+	{
+		hl_initialize_retry(ctx, hl);
+	}
+
+	if ((due & HL_TIMER_KEEPALIVE) || hl->keepalive_pending)
+	{
+		hl_keepalive(ctx, hl, !hl->keepalive_pending);
+	}
+}
+
+// creates the high-level structure for a context.
+static mr_result hl_create(_mr_ctx* ctx, const mr_hl_config* config, hlloop* loop, hlctx** phl)
+{
+	FAILIF(!ctx, MR_E_INVALIDARG, "ctx must be provided");
+	FAILIF(!config, MR_E_INVALIDARG, "config must be provided");
+	FAILIF(!ctx->identity, MR_E_INVALIDOP, "context identity must be set before calling mainloop");
+	FAILIF(!(config->create_wait_handle && config->wait && config->notify &&
 		config->transmit &&
 		config->checkkey_callback),
 		MR_E_INVALIDARG,
 		"all callbacks must be provided");
+	FAILIF(config->coalesce_threshold && config->coalesce_delay && !config->now, MR_E_INVALIDARG,
+		"a clock must be provided when coalescing with a delay");
+	FAILIF((config->initialize_retry || config->keepalive_interval) && !(loop ? loop->config.now : config->now),
+		MR_E_INVALIDARG, "a clock must be provided for initialization retries and keepalives");
+	FAILIF(config->queue_policy > MR_HL_QUEUE_DROP, MR_E_INVALIDARG, "invalid queue policy");
+	FAILIF(config->queue_watermark && (!config->queue_high_watermark ||
+		config->queue_low_watermark >= config->queue_high_watermark),
+		MR_E_INVALIDARG, "the high watermark must be above the low watermark");
+	FAILIF(config->pipeline_depth && (config->transmit_batch || config->coalesce_threshold), MR_E_INVALIDARG,
+		"pipelining cannot be combined with batched transmits or coalescing");
+	FAILIF(config->mtu && hl_message_limit(config) < MIN_MESSAGE_SIZE_WITH_ECDH, MR_E_INVALIDARG,
+		"the mtu must allow messages of at least 64 bytes");
+	FAILIF(config->mtu && (config->transmit_batch || config->coalesce_threshold || config->pipeline_depth), MR_E_INVALIDARG,
+		"fragmentation cannot be combined with batched transmits, coalescing or pipelining");
+
+	// create hl structure
+	uint32_t pool_size = config->pool_size ? config->pool_size : HL_DEFAULT_POOL_SIZE;
+	uint32_t batch_size = config->batch_size ? config->batch_size : HL_DEFAULT_BATCH_SIZE;
+	size_t pool_space = pool_size * sizeof(void*);
+	size_t pipeline_space = config->pipeline_depth * sizeof(action*);
+	size_t batch_space = batch_size * (sizeof(mr_iovec) + sizeof(action*) + KEY_SIZE);
+	size_t wheel_space = !loop && config->now ? sizeof(_mr_timer_wheel) : 0;
+	uint32_t reassembly_slots = !config->mtu ? 0 : config->reassembly_slots ? config->reassembly_slots : HL_DEFAULT_REASSEMBLY_SLOTS;
+	size_t reassembly_space = reassembly_slots * sizeof(hlreassembly);
+	size_t fragment_space = config->mtu ? hl_message_limit(config) : 0;
+	size_t fixed_space = sizeof(hlctx) + sizeof(mr_hl_config) + pool_space + pipeline_space + batch_space + wheel_space;
+	uint8_t* buffer;
+	hlctx* hl;
+	_C(mr_allocate(ctx, fixed_space + reassembly_space + fragment_space, (void**)&buffer));
+	mr_memzero(buffer, sizeof(hlctx));
+	hl = (hlctx*)buffer;
+
+	// ensure there is only one
+	hlctx* zero = 0;
+	if (!ATOMIC_COMPARE_EXCHANGE(ctx->highlevel, hl, zero))
+	{
+		mr_free(ctx, hl);
+		FAILMSG(MR_E_INVALIDOP, "mr_hl_mainloop can only be called once for a given context");
+	}
+
+	// initialize the hl structure
+	hl->config = (mr_hl_config*)(buffer + sizeof(hlctx));
+	mr_memcpy((void*)hl->config, config, sizeof(mr_hl_config));
+	hl->pool_size = pool_size;
+	hl->waithandle_pool = (void**)(buffer + sizeof(hlctx) + sizeof(mr_hl_config));
+	if (config->pipeline_depth)
+	{
+		hl->pipeline = (action**)(buffer + sizeof(hlctx) + sizeof(mr_hl_config) + pool_space);
+		hl->pipeline_depth = config->pipeline_depth;
+		hl->transmit_notify = config->create_wait_handle(config->user);
+	}
+	hl->batch_size = batch_size;
+	hl->batch_iov = (mr_iovec*)(buffer + sizeof(hlctx) + sizeof(mr_hl_config) + pool_space + pipeline_space);
+	hl->batch_actions = (action**)(hl->batch_iov + batch_size);
+	hl->batch_keys = (uint8_t*)(hl->batch_actions + batch_size);
+	hl->ctx = ctx;
+	hl->loop = loop;
+	hl->action_notify = loop ? loop->notify : config->create_wait_handle(config->user);
+	for (uint32_t i = 0; i < HL_LANES; i++)
+	{
+		hl->lanes[i].ptail = &hl->lanes[i].head;
+	}
+	if (config->queue_capacity && config->queue_policy == MR_HL_QUEUE_BLOCK)
+	{
+		hl->space_notify = config->create_wait_handle(config->user);
+	}
+
+	// timers are kept on the loop if there is one, otherwise on a wheel of our own
+	if (loop && loop->config.now)
+	{
+		hl->wheel = &loop->wheel;
+		hl->wheel_lock = &loop->wheel_lock;
+	}
+	if (loop && loop->config.handshake_rate)
+	{
+		hl->handshake_tokens = (uint64_t)loop->config.handshake_burst * 1000;
+		hl->handshake_counted = hl_now(hl);
+	}
+	else if (wheel_space)
+	{
+		hl->wheel = (_mr_timer_wheel*)(buffer + sizeof(hlctx) + sizeof(mr_hl_config) + pool_space + pipeline_space + batch_space);
+		hl->wheel_lock = &hl->own_wheel_lock;
+		timer_wheel_init(hl->wheel, config->now(config->user));
+	}
+	if (config->mtu)
+	{
+		// reassembly slots are pointer aligned as they follow the wheel or the batch keys
+		hl->reassembly = (hlreassembly*)(buffer + fixed_space);
+		hl->reassembly_slots = reassembly_slots;
+		mr_memzero(hl->reassembly, reassembly_space);
+		hl->fragment_buffer = buffer + fixed_space + reassembly_space;
+	}
+	hl->initialize_timer.owner = hl;
+	hl->initialize_timer.id = HL_TIMER_INITIALIZE;
+	hl->keepalive_timer.owner = hl;
+	hl->keepalive_timer.id = HL_TIMER_KEEPALIVE;
+	ref_acquire(hl);
+	hl->active = true;
+
+	*phl = hl;
+	return MR_E_SUCCESS;
+}
+
+// processes up to quantum queued actions for a context.
+// Returns the number of actions processed.
+static uint32_t hl_process(_mr_ctx* ctx, hlctx* hl, uint32_t quantum)
+{
+	const mr_hl_config* config = hl->config;
+	uint32_t processed = 0;
+
+	hl_timers_run(ctx, hl);
+
+	while (hl->active && processed < quantum)
+	{
+		// send coalesced payloads that have waited long enough or, if
+		// there is no delay, once there is nothing more queued to add
+		if (hl->coalesce && hl_coalesce_remaining(hl) == 0 && (config->coalesce_delay || hl_queue_empty(hl)))
+		{
+			hl_coalesce_flush(ctx, hl);
+		}
+
+		// when the pipeline is full, messages to send wait
+		action* item = hl_action_dequeue(hl, hl_pipeline_full(hl));
+		if (!item)
+		{
+			break;
+		}
+
+		processed++;
+		bool initialize_notify = false;
+		mr_result result = MR_E_SUCCESS;
+
+		if (item->timeout)
+		{
+			TRACEMSGCTX(ctx, "****dequeued timed out action");
+		}
+		else if (item->naction == HL_ACTION_SEND && config->mtu)
+		{
+			TRACEMSGCTX(ctx, "****dequeued SEND action to fragment");
+			result = hl_send_fragments(ctx, hl, item);
+		}
+		else if (item->naction == HL_ACTION_SEND && config->coalesce_threshold)
+		{
+			TRACEMSGCTX(ctx, "****dequeued SEND action to coalesce");
+			result = hl_coalesce(ctx, hl, item);
+		}
+		else if (item->naction == HL_ACTION_SEND && config->transmit_batch)
+		{
+			hl_send_batch(ctx, hl, item);
+			continue;
+		}
+		else if (item->naction == HL_ACTION_RECEIVE && config->receive_batch)
+		{
+			hl_receive_batch(ctx, hl, item);
+			continue;
+		}
+		else if (item->naction == HL_ACTION_RECEIVE_DATA && config->parallel)
+		{
+			hl_receive_data_batch(ctx, hl, item);
+			continue;
+		}
+		else
+		{
+			// execute the action
+			switch (item->naction)
+			{
+			case HL_ACTION_NONE:
+			{
+				TRACEMSGCTX(ctx, "****dequeued NONE action");
+			}
+			break;
+			case HL_ACTION_INITIALIZE:
+			{
+				TRACEMSGCTX(ctx, "****dequeued INITIALIZE action");
+				if (hl->initialize_buffer)
+				{
+					mr_free(ctx, hl->initialize_buffer);
+				}
+				result = mr_allocate(ctx, 256, (void**)&hl->initialize_buffer);
+				if (result == MR_E_SUCCESS)
+				{
+					result = mr_ctx_initiate_initialization(ctx, hl->initialize_buffer, 256, true);
+
+					if (result == MR_E_SENDBACK)
+					{
+						if (hl->config->transmit(hl->config->user, hl->initialize_buffer, 256) == 256)
+						{
+							// that's it. Now we wait, trying again
+							// later if there is no response.
+							if (hl->wheel && config->initialize_retry)
+							{
+								hl->initialize_started = hl_now(hl);
+								hl->initialize_interval = config->initialize_retry;
+								hl_timer_schedule(hl, &hl->initialize_timer, config->initialize_retry);
+							}
+						}
+						else
+						{
+							DEBUGMSG("Transmit failed");
+							result = MR_E_FAIL;
+						}
+					}
+				}
+
+				if (result < 0)
+				{
+					initialize_notify = true;
+					hl->initialize_result = result;
+				}
+			}
+			break;
+			case HL_ACTION_SEND:
+			{
+				TRACEMSGCTX(ctx, "****dequeued SEND action");
+				uint32_t size = 0;
+				result = hl_encrypt(ctx, hl, item, &size);
+				if (result == MR_E_SUCCESS && hl->pipeline)
+				{
+					// the transmit loop will transmit and complete the action.
+					// There is room because the pipeline was not full.
+					item->space_available = size;
+					hl_pipeline_push(hl, item);
+					continue;
+				}
+				else if (result == MR_E_SUCCESS)
+				{
+					result = config->transmit(config->user, item->data, size) == size
+						? MR_E_SUCCESS
+						: MR_E_FAIL;
+				}
+			}
+			break;
+			case HL_ACTION_RECEIVE:
+			{
+				TRACEMSGCTX(ctx, "****dequeued RECEIVE action");
+				// for RECEIVE we call receive
+				if (config->receive(config->user, item->data, item->size) != item->size)
+				{
+					result = MR_E_FAIL;
+				}
+			}
+			// CASE FALL THROUGH -->
+			case HL_ACTION_RECEIVE_DATA:
+			{
+				if (item->naction == HL_ACTION_RECEIVE_DATA)
+				{
+					TRACEMSGCTX(ctx, "****dequeued RECEIVE_DATA action");
+				}
+
+				if (result == MR_E_SUCCESS && hl_handshake_defer(ctx, hl, item))
+				{
+					continue;
+				}
+				else if (result == MR_E_SUCCESS)
+				{
+					result = hl_process_received(ctx, hl, item, 0, 0, &initialize_notify);
+				}
+			}
+			break;
+			case HL_ACTION_TERMINATE:
+			{
+				TRACEMSGCTX(ctx, "****dequeued TERMINATE action");
+				spin_lock(&hl->queue_lock);
+				hl->active = false;
+				spin_unlock(&hl->queue_lock);
+				hl_space_available(hl, false);
+			}
+			break;
+			default:
+			{
+				TRACEMSGCTX(ctx, "****dequeued INVALID action");
+			}
+			break;
+			}
+		}
+
+		if (!hl_park(hl, item, result))
+		{
+			hl_action_complete(ctx, hl, item, result, initialize_notify);
+		}
+	}
+
+	// catch up on parked messages when there is nothing else to do
+	if (hl->parked_head && hl->active && processed < quantum)
+	{
+		hl_catchup(ctx, hl);
+		processed++;
+	}
+	else if (hl->active && processed < quantum)
+	{
+		// derive sending chains left over from receiving so
+		// the next send doesn't have to. Servers also prepare
+		// a signature for the next peer that initializes.
+		mr_ctx_precompute(ctx);
+		if (!ctx->config.is_client && ctx->identity)
+		{
+			mr_ecdsa_precompute(ctx->identity, 1);
+		}
+	}
+
+	return processed;
+}
+
+// gets the number of milliseconds until a context needs to be processed
+// again if no more actions are queued.
+static uint32_t hl_wait_time(hlctx* hl)
+{
+	if (hl->lanes[HL_LANE_CONTROL].head ||
+		(hl->lanes[HL_LANE_BULK].head && !hl_pipeline_full(hl)) ||
+		!hl->active || hl->timers_due || hl->keepalive_pending || hl->parked_head)
+	{
+		return 0;
+	}
+
+	uint32_t timeout = hl->coalesce ? hl_coalesce_remaining(hl) : 0xffffffff;
+
+	// the timers of attached contexts are waited for by the loop
+	if (hl->wheel && !hl->loop)
+	{
+		uint32_t now = hl_now(hl);
+		spin_lock(hl->wheel_lock);
+		uint32_t next = timer_wheel_next(hl->wheel, now);
+		spin_unlock(hl->wheel_lock);
+		if (next < timeout)
+		{
+			timeout = next;
+		}
+	}
+
+	return timeout;
+}
+
+// stops processing for a context, fails anything still queued
+// and releases the high-level structure.
+static void hl_shutdown(_mr_ctx* ctx, hlctx* hl)
+{
+	spin_lock(&hl->queue_lock);
+	hl->active = false;
+	spin_unlock(&hl->queue_lock);
+	hl_space_available(hl, false);
+	if (hl->transmit_notify)
+	{
+		hl->config->notify(hl->config->user, hl->transmit_notify);
+	}
+
+	hl_timer_cancel(hl, &hl->initialize_timer);
+	hl_timer_cancel(hl, &hl->keepalive_timer);
+
+	// send anything still being coalesced
+	hl_coalesce_flush(ctx, hl);
+
+	// parked messages will not be received anymore
+	while (hl->parked_head)
+	{
+		action* item = hl->parked_head;
+		hl->parked_head = item->next;
+		item->next = 0;
+		hl_action_complete(ctx, hl, item, MR_E_INVALIDOP, false);
+	}
+	hl->parked_tail = 0;
+
+	// and neither will initialization messages held back
+	while (hl->handshake_head)
+	{
+		hl_action_complete(ctx, hl, hl_handshake_take(hl), MR_E_INVALIDOP, false);
+	}
+
+	// drain the queue
+	for (;;)
+	{
+		action* item = hl_action_dequeue(hl, false);
+
+		if (item)
+		{
+			hl_action_complete(ctx, hl, item, MR_E_INVALIDOP, false);
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	TRACEMSGCTX(ctx, "exiting main loop");
+	if (mr_hl_release(ctx, hl))
+	{
+		TRACEMSGCTX(ctx, "Free HL context from main loop");
+	}
+}
+
+mr_result mr_hl_mainloop(mr_ctx _ctx, const mr_hl_config* config)
+{
+	_mr_ctx* ctx = (_mr_ctx*)_ctx;
+	hlctx* hl;
+	_C(hl_create(ctx, config, 0, &hl));
+
+	TRACEMSGCTX(ctx, "****entering high level loop");
+	while (hl->active)
+	{
+		if (hl->wheel)
+		{
+			hl_timers_expire(hl->wheel, hl->wheel_lock, config->now(config->user));
+		}
+
+		hl_process(ctx, hl, 0xffffffff);
+
+		uint32_t timeout = hl_wait_time(hl);
+		if (timeout)
+		{
+			TRACEMSGCTX(ctx, "****waiting for action");
+			config->wait(config->user, hl->action_notify, timeout);
+		}
+	}
+
+	hl_shutdown(ctx, hl);
+
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_hl_transmitloop(mr_ctx _ctx)
+{
+	_mr_ctx* ctx = (_mr_ctx*)_ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "ctx must be provided");
+	hlctx* hl = (hlctx*)ctx->highlevel;
+	FAILIF(!hl, MR_E_INVALIDOP, "The high level event loop is not running");
+	FAILIF(!hl->pipeline, MR_E_INVALIDOP, "Pipelining is not enabled");
+	FAILIF(!ref_acquire(hl), MR_E_INVALIDOP, "The high level event loop has exited");
+
+	const mr_hl_config* config = hl->config;
+
+	TRACEMSGCTX(ctx, "****entering transmit loop");
+	for (;;)
+	{
+		// nothing is added to the pipeline once the main loop is
+		// no longer active so it is drained before exiting.
+		spin_lock(&hl->queue_lock);
+		bool active = hl->active;
+		spin_unlock(&hl->queue_lock);
+
+		bool was_full;
+		action* item = hl_pipeline_pop(hl, &was_full);
+		if (item)
+		{
+			if (was_full)
+			{
+				// the main loop may be waiting for room
+				hl_wake(hl);
+			}
+
+			TRACEMSGCTX(ctx, "****transmitting pipelined message");
+			mr_result result = config->transmit(config->user, item->data, item->space_available) == item->space_available
+				? MR_E_SUCCESS
+				: MR_E_FAIL;
+			hl_action_complete(ctx, hl, item, result, false);
+		}
+		else if (!active)
+		{
+			break;
+		}
+		else
+		{
+			config->wait(config->user, hl->transmit_notify, 0xffffffff);
+		}
+	}
 
-	// create hl structure
-	uint8_t* buffer;
-	hlctx* hl;
-	_C(mr_allocate(ctx, sizeof(hlctx) + sizeof(mr_hl_config), (void**)&buffer));
-	mr_memzero(buffer, sizeof(hlctx));
-	hl = (hlctx*)buffer;
+	TRACEMSGCTX(ctx, "exiting transmit loop");
+	if (mr_hl_release(ctx, hl))
+	{
+		TRACEMSGCTX(ctx, "Free HL context from transmit loop");
+	}
 
-	// ensure there is only one
-	hlctx* zero = 0;
-	if (ATOMIC_COMPARE_EXCHANGE(ctx->highlevel, hl, zero))
+	return MR_E_SUCCESS;
+}
+
+// picks the next attached context not being serviced by another
+// thread and marks it busy.
+static hlctx* hl_loop_pick(hlloop* loop)
+{
+	hlctx* picked = 0;
+
+	spin_lock(&loop->lock);
+	hlctx* hl = loop->next ? loop->next : loop->contexts;
+	for (uint32_t i = 0; hl && i < loop->count; i++)
 	{
-		mr_free(ctx, hl);
-		FAILMSG(MR_E_INVALIDOP, "mr_hl_mainloop can only be called once for a given context");
+		if (!hl->busy)
+		{
+			hl->busy = true;
+			loop->next = hl->loop_next;
+			picked = hl;
+			break;
+		}
+
+		hl = hl->loop_next ? hl->loop_next : loop->contexts;
 	}
+	spin_unlock(&loop->lock);
 
-	// initialize the hl structure
-	hl->config = (mr_hl_config*)(buffer + sizeof(hlctx));
-	mr_memcpy((void*)hl->config, config, sizeof(mr_hl_config));
-	hl->action_notify = config->create_wait_handle(config->user);
-	ref_acquire(hl);
+	return picked;
+}
 
-	TRACEMSGCTX(ctx, "****entering high level loop");
-	hl->active = true;
-	while (hl->active)
+// removes a context from the list of attached contexts.
+static void hl_loop_remove(hlloop* loop, hlctx* hl)
+{
+	spin_lock(&loop->lock);
+	hlctx** pitem = &loop->contexts;
+	while (*pitem && *pitem != hl) pitem = &(*pitem)->loop_next;
+	if (*pitem)
 	{
-		uint32_t timeout = 0xffffffff;
-		action* item = hl_action_dequeue(ctx, hl, &hl->head);
+		*pitem = hl->loop_next;
+		loop->count--;
+	}
+	if (loop->next == hl)
+	{
+		loop->next = hl->loop_next;
+	}
+	spin_unlock(&loop->lock);
+}
 
-		if (item)
+// verifies the signatures of the next initialization message held back
+// for each of the contexts given together. valid is set to the signature
+// of those found valid, which is not verified again when the message is
+// processed, and to null for the others.
+static void hl_handshakes_verify(hlctx** contexts, uint32_t count, _mr_checked_signature* checked, const _mr_checked_signature** valid)
+{
+	const uint8_t* psignatures[HL_HANDSHAKE_BATCH];
+	const uint8_t* pdigests[HL_HANDSHAKE_BATCH];
+	const uint8_t* ppublickeys[HL_HANDSHAKE_BATCH];
+	uint32_t results[HL_HANDSHAKE_BATCH];
+	uint32_t owners[HL_HANDSHAKE_BATCH];
+
+	// messages that are not initialization requests, like those
+	// carrying a cookie, have no signature to check
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		action* item = contexts[i]->handshake_head;
+		valid[i] = 0;
+		if (!item->timeout && ctx_initialization_signature(contexts[i]->ctx, item->data, item->size, &checked[n]) == MR_E_SUCCESS)
+		{
+			psignatures[n] = checked[n].signature;
+			pdigests[n] = checked[n].digest;
+			ppublickeys[n] = checked[n].publickey;
+			owners[n] = i;
+			n++;
+		}
+	}
+
+	if (n > 1 && mr_ecdsa_verify_batch(psignatures, pdigests, ppublickeys, n, results) == MR_E_SUCCESS)
+	{
+		for (uint32_t i = 0; i < n; i++)
 		{
-			if (ref_acquire(item))
+			if (results[i])
 			{
-				bool initialize_notify = false;
+				valid[owners[i]] = &checked[i];
+			}
+		}
+	}
+}
 
-				mr_result result = MR_E_SUCCESS;
+// processes one of the initialization messages held back for each attached
+// context that has any, verifying their signatures together. Returns true
+// if any were processed.
+static bool hl_loop_handshakes(hlloop* loop)
+{
+	hlctx* picked[HL_HANDSHAKE_BATCH];
+	uint32_t npicked = 0;
+	uint32_t count = loop->count;
+	for (uint32_t i = 0; i < count && loop->active && npicked < HL_HANDSHAKE_BATCH; i++)
+	{
+		hlctx* hl = hl_loop_pick(loop);
+		if (!hl)
+		{
+			break;
+		}
 
-				if (!item->timeout)
-				{
-					// execute the action
-					switch (item->naction)
-					{
-					case HL_ACTION_NONE:
-					{
-						TRACEMSGCTX(ctx, "****dequeued NONE action");
-					}
-					break;
-					case HL_ACTION_INITIALIZE:
-					{
-						TRACEMSGCTX(ctx, "****dequeued INITIALIZE action");
-						if (hl->initialize_buffer)
-						{
-							mr_free(ctx, hl->initialize_buffer);
-						}
-						result = mr_allocate(ctx, 256, (void**)&hl->initialize_buffer);
-						if (result == MR_E_SUCCESS)
-						{
-							result = mr_ctx_initiate_initialization(ctx, hl->initialize_buffer, 256, true);
+		if (hl->handshake_head && hl->active)
+		{
+			// stays busy until processed below
+			picked[npicked++] = hl;
+		}
+		else
+		{
+			spin_lock(&loop->lock);
+			hl->busy = false;
+			spin_unlock(&loop->lock);
+		}
+	}
 
-							if (result == MR_E_SENDBACK)
-							{
-								if (hl->config->transmit(hl->config->user, hl->initialize_buffer, 256) == 256)
-								{
-									// that's it. Now we wait
-								}
-								else
-								{
-									DEBUGMSG("Transmit failed");
-									result = MR_E_FAIL;
-								}
-							}
-						}
+	_mr_checked_signature checked[HL_HANDSHAKE_BATCH];
+	const _mr_checked_signature* valid[HL_HANDSHAKE_BATCH];
+	hl_handshakes_verify(picked, npicked, checked, valid);
 
-						if (result < 0)
-						{
-							initialize_notify = true;
-							hl->initialize_result = result;
-						}
-					}
-					break;
-					case HL_ACTION_SEND:
-					{
-						TRACEMSGCTX(ctx, "****dequeued SEND action");
-						if (!ctx->init.initialized)
-						{
-							DEBUGMSG("Cannot send before initialization has completed");
-							result = MR_E_INVALIDOP;
-						}
-						else
-						{
-							bool ecdh = hl->config->ecdh_frequency <= 1 ? true : (++hl->message_nr) % hl->config->ecdh_frequency;
-							uint32_t space_available = item->space_available;
-							if (!ecdh)
-							{
-								// the message size is already padded at least MIN_MESSAGE_SIZE
-								space_available -= ECNUM_SIZE;
-							}
-							result = mr_ctx_send(ctx, item->data, item->size, space_available);
-							if (result == MR_E_SUCCESS)
-							{
-								result = config->transmit(config->user, item->data, space_available) == space_available
-									? MR_E_SUCCESS
-									: MR_E_FAIL;
-							}
+	for (uint32_t i = 0; i < npicked; i++)
+	{
+		hlctx* hl = picked[i];
+		hl_handshake_run(hl->ctx, hl, valid[i]);
 
-							if (result == MR_E_SUCCESS)
-							{
-								break;
-							}
-						}
-					}
-					break;
-					case HL_ACTION_RECEIVE:
-					{
-						TRACEMSGCTX(ctx, "****dequeued RECEIVE action");
-						// for RECEIVE we call receive
-						if (config->receive(config->user, item->data, item->size) != item->size)
-						{
-							result = MR_E_FAIL;
-						}
-					}
-					// CASE FALL THROUGH -->
-					case HL_ACTION_RECEIVE_DATA:
-					{
-						if (item->naction == HL_ACTION_RECEIVE_DATA)
-						{
-							TRACEMSGCTX(ctx, "****dequeued RECEIVE_DATA action");
-						}
+		spin_lock(&loop->lock);
+		hl->busy = false;
+		spin_unlock(&loop->lock);
+	}
 
-						if (result == MR_E_SUCCESS)
-						{
-							bool initdonebefore = ctx->init.initialized;
-							// process the received data
-							uint32_t data_received_size;
-							uint8_t* payload = 0;
-							result = mr_ctx_receive(ctx,
-								item->data,
-								item->size,
-								item->space_available,
-								&payload,
-								&data_received_size);
-
-							if (result == MR_E_SUCCESS)
-							{
-								// call the data callback
-								if (config->data_callback && data_received_size)
-								{
-									TRACEMSGCTX(ctx, "****invoking data callback");
-									config->data_callback(config->user, payload, data_received_size);
-								}
-								else
-								{
-									TRACEMSGCTX(ctx, "****NOT invoking data callback");
-								}
-							}
-							else if (result == MR_E_SENDBACK)
-							{
-								TRACEMSGCTX(ctx, "****transmitting sendback data");
-								// we need to send an initialization response
-								if (config->transmit(config->user, payload, data_received_size) != data_received_size)
-								{
-									DEBUGMSG("transmission of sendback data failed");
-									// if the transmit fails, the whole initialization process needs
-									// to start over. We rely on a timeout to make this happen.
-									result = MR_E_FAIL;
-								}
-							}
+	return npicked > 0;
+}
 
-							// check if initialization is done
-							if (ctx->init.initialized && !initdonebefore)
-							{
-								TRACEMSGCTX(ctx, "****initialization completed");
-								if (hl->initialize_notify)
-								{
-									TRACEMSGCTX(ctx, "****notifying initialization is complete");
-									initialize_notify = true;
-									hl->initialize_result = MR_E_SUCCESS;
-								}
-								if (hl->initialize_buffer)
-								{
-									mr_free(ctx, hl->initialize_buffer);
-								}
-							}
-						}
-					}
-					break;
-					case HL_ACTION_TERMINATE:
-					{
-						TRACEMSGCTX(ctx, "****dequeued TERMINATE action");
-						hl->active = false;
-					}
-					break;
-					default:
-					{
-						TRACEMSGCTX(ctx, "****dequeued INVALID action");
-					}
-					break;
-					}
+// services each attached context in turn until none have work left.
+// Returns the number of milliseconds until servicing is needed again.
+static uint32_t hl_loop_service(hlloop* loop)
+{
+	uint32_t timeout;
+	bool worked;
+	bool first = true;
 
-					// set the result
-					item->result = result;
+	do
+	{
+		timeout = 0xffffffff;
+		worked = false;
 
-					// notify that the action is completed
-					if (item->notify)
-					{
-						TRACEMSGCTX(ctx, "--->item->notify");
-						config->notify(config->user, item->notify);
-					}
+		if (loop->config.now)
+		{
+			hl_timers_expire(&loop->wheel, &loop->wheel_lock, loop->config.now(loop->config.user));
+		}
 
-					// we need to notify this after the one above because
-					// it works like an action complete notification.
-					if (initialize_notify)
-					{
-						TRACEMSGCTX(ctx, "--->hl.initialize_notify");
-						hl->config->notify(hl->config->user, hl->initialize_notify);
-					}
-				}
-				else
-				{
-					TRACEMSGCTX(ctx, "****dequeued timed out action");
-				}
+		uint32_t count = loop->count;
+		for (uint32_t i = 0; i < count && loop->active; i++)
+		{
+			hlctx* hl = hl_loop_pick(loop);
+			if (!hl)
+			{
+				break;
+			}
+
+			_mr_ctx* ctx = hl->ctx;
+			if (hl_process(ctx, hl, loop->config.quantum))
+			{
+				worked = true;
+			}
 
-				// release and perhaps free the item
-				if (mr_act_release(ctx, hl, item))
+			if (!hl->active)
+			{
+				// the context was deactivated
+				hl_loop_remove(loop, hl);
+				hl_shutdown(ctx, hl);
+				worked = true;
+			}
+			else
+			{
+				uint32_t t = hl_wait_time(hl);
+				if (t < timeout)
 				{
-					TRACEMSGCTX(ctx, "####free action from inside mainloop");
+					timeout = t;
 				}
+
+				spin_lock(&loop->lock);
+				hl->busy = false;
+				spin_unlock(&loop->lock);
 			}
 		}
-		else
+
+		// if there is work, wake up another thread running
+		// the loop (if there is one) to help out.
+		if (worked && first)
 		{
-			TRACEMSGCTX(ctx, "****waiting for action");
-			config->wait(config->user, hl->action_notify, 0xffffffff);
+			loop->config.notify(loop->config.user, loop->notify);
 		}
-	}
+		first = false;
 
-	// drain the queue
-	for (;;)
+		// handshakes wait until established sessions have nothing left to do
+		if (!worked && loop->active && loop->handshakes_queued)
+		{
+			worked = hl_loop_handshakes(loop);
+		}
+	} while (worked && loop->active);
+
+	// contexts busy on another thread may still have handshakes waiting
+	if (loop->handshakes_queued)
 	{
-		action* item = hl_action_dequeue(ctx, hl, &hl->head);
+		timeout = 0;
+	}
 
-		if (item && ref_acquire(item))
+	if (loop->config.now)
+	{
+		uint32_t now = loop->config.now(loop->config.user);
+		spin_lock(&loop->wheel_lock);
+		uint32_t next = timer_wheel_next(&loop->wheel, now);
+		spin_unlock(&loop->wheel_lock);
+		if (next < timeout)
 		{
-			item->result = MR_E_INVALIDOP;
-			if (item->notify)
-			{
-				TRACEMSGCTX(ctx, "--->item->notify");
-				config->notify(config->user, item->notify);
-			}
-			if (mr_act_release(ctx, hl, item))
-			{
-				TRACEMSGCTX(ctx, "####free action from inside mainloop shutdown");
-			}
+			timeout = next;
 		}
-		else
+	}
+
+	return loop->active ? timeout : 0;
+}
+
+mr_hl_loop mr_hl_loop_create(const mr_hl_loop_config* config)
+{
+	if (!config || !config->create_wait_handle || !config->destroy_wait_handle || !config->notify ||
+		(config->handshake_rate && !config->now))
+	{
+		return 0;
+	}
+
+	hlloop* loop;
+	int r = mr_allocate(0, sizeof(hlloop), (void**)&loop);
+	if (r != MR_E_SUCCESS || !loop)
+	{
+		return 0;
+	}
+
+	mr_memzero(loop, sizeof(hlloop));
+	mr_memcpy(&loop->config, config, sizeof(mr_hl_loop_config));
+	if (!loop->config.quantum)
+	{
+		loop->config.quantum = HL_DEFAULT_QUANTUM;
+	}
+	if (!loop->config.handshake_burst)
+	{
+		loop->config.handshake_burst = loop->config.handshake_rate;
+	}
+	loop->notify = config->create_wait_handle(config->user);
+	loop->active = true;
+	if (config->now)
+	{
+		timer_wheel_init(&loop->wheel, config->now(config->user));
+	}
+
+	return loop;
+}
+
+mr_result mr_hl_loop_attach(mr_hl_loop _loop, mr_ctx _ctx, const mr_hl_config* config)
+{
+	hlloop* loop = (hlloop*)_loop;
+	_mr_ctx* ctx = (_mr_ctx*)_ctx;
+	FAILIF(!loop, MR_E_INVALIDARG, "loop must be provided");
+	FAILIF(!loop->active, MR_E_INVALIDOP, "The loop has been stopped");
+
+	hlctx* hl;
+	_C(hl_create(ctx, config, loop, &hl));
+
+	// add the context to the end of the list
+	spin_lock(&loop->lock);
+	hlctx** pitem = &loop->contexts;
+	while (*pitem) pitem = &(*pitem)->loop_next;
+	*pitem = hl;
+	loop->count++;
+	spin_unlock(&loop->lock);
+
+	hl_wake(hl);
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_hl_loop_run(mr_hl_loop _loop)
+{
+	hlloop* loop = (hlloop*)_loop;
+	FAILIF(!loop, MR_E_INVALIDARG, "loop must be provided");
+	FAILIF(!loop->config.wait, MR_E_INVALIDOP, "A wait function must be configured to run the loop");
+
+	while (loop->active)
+	{
+		uint32_t timeout = hl_loop_service(loop);
+		if (timeout && loop->active)
 		{
-			break;
+			loop->config.wait(loop->config.user, loop->notify, timeout);
 		}
 	}
 
-	TRACEMSGCTX(ctx, "exiting main loop");
-	if (mr_hl_release(ctx, hl))
+	// wake up other threads running the loop so they also exit
+	loop->config.notify(loop->config.user, loop->notify);
+
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_hl_loop_poll(mr_hl_loop _loop, uint32_t* timeout)
+{
+	hlloop* loop = (hlloop*)_loop;
+	FAILIF(!loop, MR_E_INVALIDARG, "loop must be provided");
+	FAILIF(!loop->active, MR_E_INVALIDOP, "The loop has been stopped");
+
+	uint32_t t = hl_loop_service(loop);
+	if (timeout)
 	{
-		TRACEMSGCTX(ctx, "Free HL context from main loop");
+		*timeout = t;
 	}
 
 	return MR_E_SUCCESS;
 }
 
+mr_result mr_hl_loop_get_stats(mr_hl_loop _loop, mr_hl_loop_stats* stats)
+{
+	hlloop* loop = (hlloop*)_loop;
+	FAILIF(!loop || !stats, MR_E_INVALIDARG, "loop and stats must be provided");
+
+	spin_lock(&loop->lock);
+	stats->handshakes_queued = loop->handshakes_queued;
+	stats->handshakes_shed = loop->handshakes_shed;
+	spin_unlock(&loop->lock);
+
+	return MR_E_SUCCESS;
+}
+
+void mr_hl_loop_stop(mr_hl_loop _loop)
+{
+	hlloop* loop = (hlloop*)_loop;
+	if (loop)
+	{
+		loop->active = false;
+		loop->config.notify(loop->config.user, loop->notify);
+	}
+}
+
+void mr_hl_loop_destroy(mr_hl_loop _loop)
+{
+	hlloop* loop = (hlloop*)_loop;
+	if (loop)
+	{
+		loop->active = false;
+
+		// shut down contexts that are still attached
+		while (loop->contexts)
+		{
+			hlctx* hl = loop->contexts;
+			hl_loop_remove(loop, hl);
+			hl_shutdown(hl->ctx, hl);
+		}
+
+		loop->config.destroy_wait_handle(loop->config.user, loop->notify);
+		memset(loop, 0xcc, sizeof(hlloop));
+		mr_free(0, loop);
+	}
+}
+
 mr_result mr_hl_initialize(mr_ctx _ctx, uint32_t timeout)
 {
 	_mr_ctx* ctx = (_mr_ctx*)_ctx;
@@ -660,14 +2920,15 @@ mr_result mr_hl_initialize(mr_ctx _ctx, uint32_t timeout)
 	FAILIF(hl->initialize_notify, MR_E_INVALIDOP, "initialization already in process");
 	FAILIF(!ref_acquire(hl), MR_E_INVALIDOP, "The high level event loop has exited");
 
-	void* wh = hl->config->create_wait_handle(hl->config->user);
+	void* wh = hl_waithandle_get(hl);
 	hl->initialize_notify = wh;
 
 	TRACEMSGCTX(ctx, "####enqueueing INITIALIZE action");
 	mr_result result = hl_action_add(_ctx, HL_ACTION_INITIALIZE, 0, 0, 0);
 	if (result == MR_E_ACTION_ENQUEUED)
 	{
-		if (hl->config->wait(hl->config->user, wh, timeout))
+		bool notified = hl->config->wait(hl->config->user, wh, timeout);
+		if (notified)
 		{
 			result = MR_E_SUCCESS;
 		}
@@ -677,11 +2938,12 @@ mr_result mr_hl_initialize(mr_ctx _ctx, uint32_t timeout)
 		}
 
 		hl->initialize_notify = 0;
-		hl->config->destroy_wait_handle(hl->config->user, wh);
+		hl_waithandle_put(hl, wh, notified);
 	}
 	else
 	{
-		hl->config->destroy_wait_handle(hl->config->user, wh);
+		hl->initialize_notify = 0;
+		hl_waithandle_put(hl, wh, true);
 		FAILMSGNOEXIT("Failed to enqueue initialize action");
 	}
 
@@ -711,6 +2973,82 @@ mr_result mr_hl_receive_data(mr_ctx ctx, const uint8_t* data, uint32_t size, uin
 	return hl_action_add(ctx, HL_ACTION_RECEIVE_DATA, data, size, timeout);
 }
 
+mr_result mr_hl_receive_buffer(mr_ctx _ctx, uint8_t* data, uint32_t size, uint32_t spaceavailable, release_fn release, void* release_user, uint32_t timeout)
+{
+	TRACEMSGCTX(_ctx, "####enqueueing RECEIVE_DATA action with caller buffer");
+	FAILIF(!release, MR_E_INVALIDARG, "release must be provided");
+
+	// the buffer belongs to us from here on, so it is
+	// given back even if the action can not be queued.
+	_mr_ctx* ctx = (_mr_ctx*)_ctx;
+	hlctx* hl = ctx ? (hlctx*)ctx->highlevel : 0;
+	mr_result result = MR_E_SUCCESS;
+	if (!ctx || !data || !size || spaceavailable < size)
+	{
+		result = MR_E_INVALIDARG;
+	}
+	else if (!hl || !ref_acquire(hl))
+	{
+		result = MR_E_INVALIDOP;
+	}
+
+	if (result != MR_E_SUCCESS)
+	{
+		if (data)
+		{
+			release(release_user, data);
+		}
+		FAILMSG(result, "Could not take the buffer");
+	}
+
+	// during initialization response messages are written into
+	// the buffer, so a buffer that is too small is copied instead.
+	bool copy = !ctx->init.initialized && spaceavailable < 256;
+
+	action* newact;
+	result = hl_action_get(ctx, hl, copy ? 256 : 0, &newact);
+	if (result != MR_E_SUCCESS)
+	{
+		release(release_user, data);
+		mr_hl_release(ctx, hl);
+		return result;
+	}
+
+	if (copy)
+	{
+		mr_memcpy(newact->data, data, size);
+		newact->space_available = 256;
+		release(release_user, data);
+	}
+	else
+	{
+		// the message is decrypted in place in the caller's buffer
+		newact->data = data;
+		newact->space_available = spaceavailable;
+		newact->release = release;
+		newact->release_user = release_user;
+	}
+
+	newact->size = size;
+	newact->naction = HL_ACTION_RECEIVE_DATA;
+	return hl_action_submit(ctx, hl, newact, timeout);
+}
+
+mr_result mr_hl_get_stats(mr_ctx _ctx, mr_hl_stats* stats)
+{
+	_mr_ctx* ctx = (_mr_ctx*)_ctx;
+	FAILIF(!ctx || !stats, MR_E_INVALIDARG, "ctx and stats must be provided");
+	hlctx* hl = (hlctx*)ctx->highlevel;
+	FAILIF(!hl || !ref_acquire(hl), MR_E_INVALIDOP, "The high level event loop is not running");
+
+	spin_lock(&hl->stats_lock);
+	*stats = hl->stats;
+	spin_unlock(&hl->stats_lock);
+
+	mr_hl_release(ctx, hl);
+	return MR_E_SUCCESS;
+}
+
 mr_result mr_hl_deactivate(mr_ctx ctx, uint32_t timeout)
 {
 	TRACEMSGCTX(ctx, "####enqueueing TERMINATE action");
@@ -46,13 +46,13 @@
 // atomic compare exchange
 #include <intrin.h>
 #ifdef MR_X64
-#define ATOMIC_COMPARE_EXCHANGE(a, b, c) _InterlockedCompareExchange64((__int64 volatile *)&(a), (__int64)(b), (__int64)(c)) == c
+#define ATOMIC_COMPARE_EXCHANGE(a, b, c) (_InterlockedCompareExchange64((__int64 volatile *)&(a), (__int64)(b), (__int64)(c)) == (__int64)(c))
 #define ATOMIC_INCREMENT(a) _InterlockedIncrement64((__int64 volatile *)&(a))
 #define ATOMIC_DECREMENT(a) _InterlockedDecrement64((__int64 volatile *)&(a))
 #else
-#define ATOMIC_COMPARE_EXCHANGE(a, b, c) _InterlockedCompareExchange((__int32 volatile *)&(a), (__int32)(b), (__int32)(c)) == c
+#define ATOMIC_COMPARE_EXCHANGE(a, b, c) (_InterlockedCompareExchange((__int32 volatile *)&(a), (__int32)(b), (__int32)(c)) == (__int32)(c))
 #define ATOMIC_INCREMENT(a) _InterlockedIncrement((__int32 volatile *)&(a))
-#define ATOMIC_DECREMENT(a) _InterlockedIncrement((__int32 volatile *)&(a))
+#define ATOMIC_DECREMENT(a) _InterlockedDecrement((__int32 volatile *)&(a))
 #endif
 
 #define STATIC_ASSERT(e, r) static_assert(e, r)
@@ -81,9 +81,9 @@ static inline size_t _mr_nonatomic_compare_exchange(volatile size_t* a, size_t b
 	return r;
 }
 
-#define ATOMIC_COMPARE_EXCHANGE(a, b, c) _mr_nonatomic_compare_exchange((size_t*)&(a),(b),(c))
-#define ATOMIC_INCREMENT(a) (a)++
-#define ATOMIC_DECREMENT(a) (a)++
+#define ATOMIC_COMPARE_EXCHANGE(a, b, c) (_mr_nonatomic_compare_exchange((size_t*)&(a),(size_t)(b),(size_t)(c)) == (size_t)(c))
+#define ATOMIC_INCREMENT(a) (++(a))
+#define ATOMIC_DECREMENT(a) (--(a))
 #define STATIC_ASSERT(e, r)
 #define MR_ALIGN(n)
 #define MR_HTON(x) (uint32_t)(\
@@ -94,6 +94,26 @@ static inline size_t _mr_nonatomic_compare_exchange(volatile size_t* a, size_t b
 
 #endif
 
+// a minimal spin lock for short critical sections
+// that can be entered from multiple threads
+static inline void spin_lock(ptrdiff_t* lock)
+{
+	for (;;)
+	{
+		ptrdiff_t unlocked = 0;
+		if (ATOMIC_COMPARE_EXCHANGE(*lock, 1, unlocked))
+		{
+			return;
+		}
+	}
+}
+
+static inline void spin_unlock(ptrdiff_t* lock)
+{
+	ptrdiff_t locked = 1;
+	ATOMIC_COMPARE_EXCHANGE(*lock, 0, locked);
+}
+
 #define KEY_SIZE 32
 #define MSG_KEY_SIZE 16
 #define INITIALIZATION_NONCE_SIZE 16
@@ -102,6 +122,17 @@ static inline size_t _mr_nonatomic_compare_exchange(volatile size_t* a, size_t b
 #define ECNUM_SIZE 32
 #define SIGNATURE_SIZE (ECNUM_SIZE  +ECNUM_SIZE)
 #define HEADERIV_SIZE 16
+
+// cookies carry the server initialization state through the client:
+// marker(4), iv(16), issued(4), <nonce(16), root and header keys(96),
+// client public key(32), ratchet ECDH keys(64)>, mac(12)
+// the mac also covers the peer the cookie was given to.
+#define COOKIE_IV_SIZE 16
+#define COOKIE_TIME_SIZE 4
+#define COOKIE_STATE_SIZE (INITIALIZATION_NONCE_SIZE + KEY_SIZE * 3 + ECNUM_SIZE * 3)
+#define COOKIE_SIZE (4 + COOKIE_IV_SIZE + COOKIE_TIME_SIZE + COOKIE_STATE_SIZE + MAC_SIZE)
+#define COOKIE_LIFETIME 30
+#define COOKIE_MARKER (0x4d430000 | COOKIE_SIZE)
 #define DIGEST_SIZE 32
 #define MACIV_SIZE 16
 #define MIN_PAYLOAD_SIZE (HEADERIV_SIZE)
@@ -113,6 +144,35 @@ static inline size_t _mr_nonatomic_compare_exchange(volatile size_t* a, size_t b
 #define MIN_MESSAGE_SIZE_WITH_ECDH (OVERHEAD_WITH_ECDH + MIN_PAYLOAD_SIZE)
 #define DEFAULT_MAX_RATCHETS 3
 
+// the number of generations up to and including the newest one received
+// in a chain that are remembered so replayed messages can be rejected.
+// Anything older is rejected too, with MR_E_REPLAY, even if it was never
+// received, so messages that arrive more than this many generations late
+// are lost. Must be a multiple of 32.
+#ifndef MR_REPLAY_WINDOW
+#define MR_REPLAY_WINDOW 128
+#endif
+#define REPLAY_WINDOW_WORDS (MR_REPLAY_WINDOW / 32)
+
+// receiving chains keep a copy of the chain key every MR_CHECKPOINT_INTERVAL
+// generations inside the replay window when messages are skipped, so a late
+// message is at most that many KDF steps away. Up to MR_CHAIN_CHECKPOINTS are
+// kept per chain and each is erased once every generation after it has been
+// received. More checkpoints cost memory and keep keys around for longer.
+// Set MR_CHAIN_CHECKPOINTS to 0 to only keep the single old chain key.
+#ifndef MR_CHECKPOINT_INTERVAL
+#define MR_CHECKPOINT_INTERVAL 32
+#endif
+#ifndef MR_CHAIN_CHECKPOINTS
+#define MR_CHAIN_CHECKPOINTS (MR_REPLAY_WINDOW / MR_CHECKPOINT_INTERVAL)
+#endif
+
+// the number of ratchet steps a transaction can change and the number of
+// ECDH ratchets it can take.
+#ifndef MR_TXN_STEPS
+#define MR_TXN_STEPS 8
+#endif
+
 #ifdef _C
 #undef _C
 #endif
@@ -142,6 +202,10 @@ typedef struct _mr_initialization_state_server {
 typedef struct _mr_initialization_state_client {
 	uint8_t initializationnonce[INITIALIZATION_NONCE_SIZE];
 	mr_ecdh_ctx localecdhforinit;
+
+	// the cookie to send back with the first message. All zeroes if
+	// the server did not send one.
+	uint8_t cookie[COOKIE_SIZE];
 } _mr_initialization_state_client;
 
 typedef struct _mr_initialization_state {
@@ -159,6 +223,30 @@ typedef struct _mr_chain_state {
 	uint8_t oldchainkey[KEY_SIZE];
 } _mr_chain_state;
 
+// a receiving chain starts out like any chain and also keeps track of
+// what has been received so far. Sending chains don't need any of it.
+typedef struct _mr_receiving_chain_state {
+	uint32_t generation;
+	uint8_t chainkey[KEY_SIZE];
+	uint32_t oldgeneration;
+	uint8_t oldchainkey[KEY_SIZE];
+
+	// bit n is set if generation - n has been received.
+	uint32_t replay[REPLAY_WINDOW_WORDS];
+
+	// the generation of a message that was too far ahead to receive in one
+	// go. The chain is moved towards it bit by bit. 0 if there is none.
+	uint32_t catchuptarget;
+
+#if MR_CHAIN_CHECKPOINTS > 0
+	// chain keys kept for skipped generations. Unused ones are all zeroes.
+	struct {
+		uint32_t generation;
+		uint8_t chainkey[KEY_SIZE];
+	} checkpoints[MR_CHAIN_CHECKPOINTS];
+#endif
+} _mr_receiving_chain_state;
+
 typedef struct _mr_ratchet_state {
 	mr_ecdh_ctx ecdhkey;
 	uint8_t nextrootkey[KEY_SIZE];
@@ -167,11 +255,92 @@ typedef struct _mr_ratchet_state {
 	uint8_t receiveheaderkey[KEY_SIZE];
 	uint8_t nextreceiveheaderkey[KEY_SIZE];
 	_mr_chain_state sendingchain;
-	_mr_chain_state receivingchain;
+	_mr_receiving_chain_state receivingchain;
+
+	// set if the sending chain has not been derived yet. Until it is,
+	// nextrootkey holds the root key between the receiving and sending
+	// chains and remotepublickey the key to derive the sending chain with.
+	bool sendingpending;
+	uint8_t remotepublickey[ECNUM_SIZE];
 
 	struct _mr_ratchet_state* next;
 } _mr_ratchet_state;
 
+// a receiving chain saved by a transaction before it was first changed.
+typedef struct _mr_txn_chain {
+	_mr_ratchet_state* step;
+	_mr_receiving_chain_state receivingchain;
+} _mr_txn_chain;
+
+// the parts of a ratchet step that an ECDH ratchet or deriving the sending
+// chain change, saved by a transaction before they were first changed.
+typedef struct _mr_txn_step {
+	_mr_ratchet_state* step;
+	mr_ecdh_ctx ecdhkey;
+	uint8_t nextrootkey[KEY_SIZE];
+	uint8_t nextsendheaderkey[KEY_SIZE];
+	uint8_t nextreceiveheaderkey[KEY_SIZE];
+	_mr_chain_state sendingchain;
+	bool sendingpending;
+	uint8_t remotepublickey[ECNUM_SIZE];
+} _mr_txn_step;
+
+// the undo log of a transaction started with mr_ctx_begin. The parts of
+// ratchet steps that change are saved before they are first changed and
+// anything that would be freed is kept until the transaction is committed.
+// Saved parts are allocated as they are needed so starting a transaction
+// is cheap.
+typedef struct _mr_txn {
+	_mr_ratchet_state* ratchet;
+
+	uint32_t numchains;
+	_mr_txn_chain* chains[MR_TXN_STEPS];
+
+	uint32_t numsteps;
+	_mr_txn_step* steps[MR_TXN_STEPS];
+
+	uint32_t numadded;
+	_mr_ratchet_state* added[MR_TXN_STEPS];
+
+	// steps cut off the end of the list, after parent
+	uint32_t numdropped;
+	struct {
+		_mr_ratchet_state* parent;
+		_mr_ratchet_state* chain;
+	} dropped[MR_TXN_STEPS];
+
+	uint32_t numretired;
+	mr_ecdh_ctx retired[MR_TXN_STEPS];
+
+	// set if the server initialization state is to be freed on commit.
+	bool releaseserver;
+} _mr_txn;
+
+// a verifier kept in a verifier cache. Entries are found through the hash
+// table and kept in order of use from newest to oldest. An entry evicted
+// while a verification is using it is freed once that is done.
+typedef struct _mr_verifier_entry {
+	uint8_t publickey[ECNUM_SIZE];
+	mr_ecdsa_verifier verifier;
+	uint32_t ref;
+	bool evicted;
+	struct _mr_verifier_entry* hashnext;
+	struct _mr_verifier_entry* newer;
+	struct _mr_verifier_entry* older;
+} _mr_verifier_entry;
+
+typedef struct _mr_verifier_cache {
+	ptrdiff_t lock;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t numbuckets;
+	_mr_verifier_entry** buckets;
+	_mr_verifier_entry* newest;
+	_mr_verifier_entry* oldest;
+	uint64_t hits;
+	uint64_t misses;
+} _mr_verifier_cache;
+
 typedef struct s_mr_ctx {
 	mr_config config;
 	mr_sha_ctx sha_ctx;
@@ -181,14 +350,58 @@ typedef struct s_mr_ctx {
 	mr_ecdsa_ctx identity;
 	bool owns_identity;
 	void* highlevel;
+	_mr_txn* txn;
 } _mr_ctx;
 
+// the signature, digest and public key of an initialization request
+// found valid ahead of time, along with others in a batch.
+typedef struct _mr_checked_signature {
+	uint8_t signature[SIGNATURE_SIZE];
+	uint8_t digest[DIGEST_SIZE];
+	uint8_t publickey[ECNUM_SIZE];
+} _mr_checked_signature;
+
 typedef struct _mr_aesctr_ctx {
 	mr_aes_ctx aes_ctx;
 	uint8_t ctr[16];
 	uint32_t ctrix;
 } _mr_aesctr_ctx;
 
+// the state of a message being sent or received in pieces.
+typedef struct _mr_stream_ctx {
+	_mr_ctx* ctx;
+	mr_aes_ctx aes;
+	_mr_aesctr_ctx cipher;
+	mr_poly_ctx mac;
+	uint64_t length;
+	bool receiving;
+} _mr_stream_ctx;
+
+// the stream header carries a cipher key and a MAC key
+#define STREAM_KEYS_SIZE (KEY_SIZE * 2)
+
+// the timer wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+// slots each and can schedule timers up to 2^30 ticks out.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 5
+
+// a timer is embedded in whatever it belongs to so
+// scheduling and cancelling never allocates.
+typedef struct _mr_timer {
+	struct _mr_timer* next;
+	struct _mr_timer** pprev;
+	uint32_t expires;
+	void* owner;
+	uint32_t id;
+} _mr_timer;
+
+typedef struct _mr_timer_wheel {
+	uint32_t now;
+	uint32_t count;
+	_mr_timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} _mr_timer_wheel;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -200,6 +413,13 @@ extern "C" {
 	mr_result aesctr_init(_mr_aesctr_ctx* ctx, mr_aes_ctx aes, const uint8_t* iv, uint32_t ivsize);
 	mr_result aesctr_process(_mr_aesctr_ctx* ctx, const uint8_t* data, uint32_t amount, uint8_t* output, uint32_t spaceavail);
 
+	// timers
+	void timer_wheel_init(_mr_timer_wheel* wheel, uint32_t now);
+	void timer_schedule(_mr_timer_wheel* wheel, _mr_timer* timer, uint32_t expires);
+	void timer_cancel(_mr_timer_wheel* wheel, _mr_timer* timer);
+	_mr_timer* timer_wheel_advance(_mr_timer_wheel* wheel, uint32_t now);
+	uint32_t timer_wheel_next(const _mr_timer_wheel* wheel, uint32_t now);
+
 	// ratchetings
 	void ratchet_getsecondtolast(mr_ctx mr_ctx, _mr_ratchet_state** ratchet);
 	void ratchet_getlast(mr_ctx mr_ctx, _mr_ratchet_state** ratchet);
@@ -238,9 +458,27 @@ extern "C" {
 		const uint8_t* sendingnextheaderkey, uint32_t sendingnextheaderkeysize,
 		const uint8_t* sendingchainkey, uint32_t sendingchainkeysize);
 	mr_result ratchet_ratchet(mr_ctx mr_ctx, _mr_ratchet_state* ratchet, _mr_ratchet_state* nextratchet, const uint8_t* remotepublickey, uint32_t remotepublickeysize, mr_ecdh_ctx keypair);
+	mr_result ratchet_ratchet_receiving(mr_ctx mr_ctx, _mr_ratchet_state* ratchet, _mr_ratchet_state* nextratchet, const uint8_t* remotepublickey, uint32_t remotepublickeysize, mr_ecdh_ctx keypair);
+	mr_result ratchet_derivesending(mr_ctx mr_ctx, _mr_ratchet_state* ratchet);
 	mr_result chain_initialize(mr_ctx mr_ctx, _mr_chain_state* chain_state, const uint8_t* chainkey, uint32_t chainkeysize);
+	mr_result chain_initialize_receiving(_mr_receiving_chain_state* chain_state, const uint8_t* chainkey, uint32_t chainkeysize);
 	mr_result chain_ratchetforsending(mr_ctx mr_ctx, _mr_chain_state* chain, uint8_t* key, uint32_t keysize, uint32_t* generation);
-	mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_chain_state* chain, uint32_t generation, uint8_t* key, uint32_t keysize);
+	mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_receiving_chain_state* chain, uint32_t generation, uint8_t* key, uint32_t keysize);
+	bool chain_replayed(const _mr_receiving_chain_state* chain, uint32_t generation);
+	bool chain_haskey(const _mr_receiving_chain_state* chain, uint32_t generation);
+	mr_result chain_catchup(mr_ctx mr_ctx, _mr_receiving_chain_state* chain, uint32_t budget, uint32_t* taken);
+	uint32_t chain_catchup_outstanding(const _mr_receiving_chain_state* chain);
+	mr_result txn_touch_chain(_mr_ctx* ctx, _mr_ratchet_state* step);
+	mr_result txn_touch_step(_mr_ctx* ctx, _mr_ratchet_state* step);
+	mr_result txn_reserve(_mr_ctx* ctx);
+	void txn_added(_mr_ctx* ctx, _mr_ratchet_state* step);
+	void txn_dropped(_mr_ctx* ctx, _mr_ratchet_state* parent, _mr_ratchet_state* chain);
+	void txn_retire(_mr_ctx* ctx, mr_ecdh_ctx key);
+	void ctx_free_server_initialization(_mr_ctx* ctx);
+	mr_result ctx_is_initialization(_mr_ctx* ctx, const uint8_t* message, uint32_t messagesize, bool* initialization);
+	mr_result ctx_initialization_signature(_mr_ctx* ctx, const uint8_t* message, uint32_t messagesize, _mr_checked_signature* signature);
+	mr_result ctx_receive_checked(_mr_ctx* ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable, const _mr_checked_signature* checked, uint8_t** payload, uint32_t* payloadsize);
+	mr_result verifier_cache_verify(_mr_verifier_cache* cache, const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, const uint8_t* publickey, uint32_t publickeysize, uint32_t* result);
 
 	void mr_memcpy(void* dst, const void* src, size_t amt);
 	void mr_memzero(void* dst, size_t amt);
@@ -281,7 +519,7 @@ extern "C" {
 #define DEBUGMSG(message)
 #define DEBUGMSGCTX(ctx, message)
 #define FAILIF(condition, error, messageonfailure) if (condition) { return (error); }
-#define FAILMSGNOEXIT(error, messageonfailure) 
+#define FAILMSGNOEXIT(messageonfailure)
 #define FAILMSG(error, messageonfailure) return (error);
 #endif
 
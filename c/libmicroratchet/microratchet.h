@@ -17,9 +17,13 @@ typedef void* mr_ctx;
 typedef void* mr_sha_ctx;
 typedef void* mr_aes_ctx;
 typedef void* mr_poly_ctx;
+typedef void* mr_stream_ctx;
 typedef void* mr_ecdh_ctx;
 typedef void* mr_ecdsa_ctx;
+typedef void* mr_ecdsa_verifier;
+typedef void* mr_verifier_cache;
 typedef void* mr_rng_ctx;
+typedef void* mr_hl_loop;
 
 // high-level callback definitions
 typedef void (*data_callback_fn)(void* user, const uint8_t* data, uint32_t amount);
@@ -30,6 +34,58 @@ typedef void (*waithandledestroy_fn)(void* user, void* waithandle);
 typedef bool (*wait_fn)(void* user, void* handle, uint32_t timeout);
 typedef void (*notify_fn)(void* user, void* handle);
 typedef bool (*checkkey_fn)(void* user, const uint8_t* pubkey, uint32_t len);
+typedef uint32_t(*now_fn)(void* user);
+typedef void (*parallel_work_fn)(void* arg, uint32_t index);
+typedef void (*parallel_fn)(void* user, parallel_work_fn work, void* arg, uint32_t count);
+typedef void (*watermark_fn)(void* user, bool high);
+typedef void (*release_fn)(void* user, uint8_t* data);
+
+// what mr_ctx_peek found out about a message.
+typedef struct t_mr_peek_info {
+	// true if the message is part of initialization. Nothing else is filled in.
+	bool initialization;
+
+	// the ratchet step the message belongs to, 0 being the newest one.
+	uint32_t step;
+
+	// the generation of the message in its chain and how far ahead of the last
+	// generation received it is. 1 is the next message, more means messages were
+	// skipped and 0 or less means the message is older than the last one received.
+	uint32_t generation;
+	int64_t gap;
+
+	// whether the message carries ECDH parameters and whether receiving it
+	// would perform an ECDH ratchet step, starting a new chain.
+	bool has_ecdh;
+	bool ecdh_ratchet;
+
+	// true if the key for the message is gone. Receiving it would fail.
+	bool lost;
+
+	// true if the message was received before or is too old to tell.
+	// Receiving it would fail with MR_E_REPLAY.
+	bool replay;
+} mr_peek_info;
+
+// a single message in a batch passed to transmit_batch or receive_batch.
+typedef struct t_mr_iovec {
+	uint8_t* data;
+	uint32_t size;
+} mr_iovec;
+
+typedef uint32_t(*transmit_batch_fn)(void* user, const mr_iovec* messages, uint32_t count);
+typedef uint32_t(*receive_batch_fn)(void* user, mr_iovec* messages, uint32_t count);
+
+// what happens when an action is added while the high-level queue is full.
+typedef enum mr_hl_queue_policy_e {
+	// wait for space to become available.
+	MR_HL_QUEUE_BLOCK = 0,
+	// fail with MR_E_QUEUEFULL.
+	MR_HL_QUEUE_FAIL = 1,
+	// drop the oldest queued message to send, which fails with
+	// MR_E_QUEUEFULL. If there is none, fail with MR_E_QUEUEFULL.
+	MR_HL_QUEUE_DROP = 2
+} mr_hl_queue_policy;
 
 // main configuration
 typedef struct t_mr_config {
@@ -41,6 +97,46 @@ typedef struct t_mr_config {
 	uint8_t applicationKey[32];
 
 	int max_ratchets;
+
+	// the most KDF steps taken to receive a single message that is ahead in
+	// its chain. When a message is further ahead, the chain is moved this
+	// many steps closer and MR_E_PENDING is returned. The rest can be done
+	// with mr_ctx_catchup. 0 for no limit.
+	uint32_t kdf_budget;
+
+	// messages further ahead in their chain than this are rejected
+	// with MR_E_INVALIDOP without any work being done. 0 for no limit.
+	uint32_t max_gap;
+
+	// servers only. If set, the server keeps no state after answering an
+	// initialization request. Instead the state is encrypted with this 32
+	// byte key into a cookie sent with the response, and the client returns
+	// it with its first message. Initialization messages then need to be
+	// MR_COOKIE_SIZE bytes larger. Change the key regularly and move the old
+	// one to previous_cookie_key so handshakes in progress can finish. Both
+	// must stay valid while the context is used and can be shared.
+	const uint8_t* cookie_key;
+	const uint8_t* previous_cookie_key;
+
+	// servers only, used with cookie_key. Identifies the peer, for example
+	// by its address, so a cookie is only accepted from the peer it was sent
+	// to. Optional. Must stay valid while the context is used.
+	const uint8_t* cookie_peer;
+	uint32_t cookie_peer_size;
+
+	// servers only, used with cookie_key. Returns the time in seconds, which
+	// must agree between servers sharing the cookie key. Cookies older than
+	// cookie_lifetime seconds, or 30 seconds if it is 0, are rejected. Without
+	// a clock cookies only expire when the cookie key is changed.
+	now_fn cookie_clock;
+	void* cookie_clock_user;
+	uint32_t cookie_lifetime;
+
+	// optional. A cache of verifiers created with mr_verifier_cache_create
+	// used to check the signatures of peers, so keys that are seen over and
+	// over are only prepared once. Must stay valid while the context is used
+	// and can be shared.
+	mr_verifier_cache verifier_cache;
 } mr_config;
 
 // high-level configuration
@@ -75,6 +171,9 @@ typedef struct t_mr_hlconfig {
 	receive_fn receive;
 
 	// data callback function called when a mesage has been received.
+	// Not called for empty messages. If keepalive_interval or
+	// keepalive_messages is set, also not called for messages that
+	// contain only zeroes such as keepalives.
 	data_callback_fn data_callback;
 
 	// check key callback called when establishing session to verify
@@ -89,8 +188,215 @@ typedef struct t_mr_hlconfig {
 	// how often to send new ECDH paramters. if 0 or 1, ECDH parameters will
 	// be sent every message.
 	uint32_t ecdh_frequency;
+
+	// the maximum number of idle action buffers kept for reuse in each size
+	// class, and the maximum number of idle wait handles kept for reuse.
+	// Once the pools are warmed up sending and receiving do not allocate.
+	// If 0, a default of 8 is used.
+	uint32_t pool_size;
+
+	// optional. If provided, queued messages are encrypted back to back and
+	// transmitted with a single call instead of one call to transmit each.
+	// The function should return the number of messages (from the start of
+	// the array) that were transmitted. transmit is still used during
+	// initialization.
+	transmit_batch_fn transmit_batch;
+
+	// optional. If provided, pending mr_hl_receive calls are collected and
+	// their data retrieved with a single call instead of one call to receive
+	// each. Each message is given a buffer and the size passed to
+	// mr_hl_receive. The function should fill in the data, update the size
+	// if less was received and return the number of messages (from the start
+	// of the array) that were received.
+	receive_batch_fn receive_batch;
+
+	// the maximum number of messages in a batch passed to transmit_batch or
+	// receive_batch. If 0, a default of 16 is used.
+	uint32_t batch_size;
+
+	// optional. Returns a monotonically increasing time in milliseconds.
+	// Required if coalesce_delay, initialize_retry or keepalive_interval
+	// are set. When attached to a loop, the clock of the loop is used for
+	// timers instead.
+	now_fn now;
+
+	// if set, payloads passed to mr_hl_send are coalesced into a single
+	// message until at least this many bytes are buffered. Each payload is
+	// framed with a 2 byte length so payloads are limited to 65535 bytes
+	// and are split up again on receipt, resulting in one call to
+	// data_callback each. Both sides of a session must enable this. When
+	// coalescing, mr_hl_send completes as soon as the payload is buffered.
+	uint32_t coalesce_threshold;
+
+	// the maximum amount of time in milliseconds a coalesced payload is
+	// buffered before being sent. If 0, only payloads that are already
+	// queued are coalesced.
+	uint32_t coalesce_delay;
+
+	// if set, the initialization request is sent again if no response was
+	// received after this many milliseconds, doubling the wait each time.
+	// Initialization fails with MR_E_TIMEOUT if it has not completed after
+	// 30 seconds.
+	uint32_t initialize_retry;
+
+	// if set, an empty message carrying ECDH parameters is sent if none
+	// has been sent for this many milliseconds so that keys keep being
+	// exchanged on idle sessions. The receiving side ignores the message,
+	// and with it any payload that is all zeroes. Both sides of a session
+	// must enable this or keepalive_messages.
+	uint32_t keepalive_interval;
+
+	// if set, an empty message carrying ECDH parameters is sent after this
+	// many messages were sent without them (see ecdh_frequency). Both
+	// sides of a session must enable this or keepalive_interval.
+	uint32_t keepalive_messages;
+
+	// the maximum number of send and receive actions queued at once. If 0,
+	// the queue is unbounded. Initialization and deactivation are always
+	// queued and, like receives, are processed ahead of queued sends.
+	uint32_t queue_capacity;
+
+	// what happens when sending or receiving while the queue is full. When
+	// blocking, the call waits up to its timeout for space, or indefinitely
+	// if the timeout is 0, so do not block from within callbacks. The time
+	// spent waiting for space counts towards the timeout of the call, which
+	// needs a clock (now, or the clock of the loop) to be measured. Without
+	// one, each wait is bounded by the timeout on its own.
+	mr_hl_queue_policy queue_policy;
+
+	// optional. Called with true when the number of queued send and
+	// receive actions rises to queue_high_watermark and with false when
+	// it falls back to queue_low_watermark. Called on the thread that
+	// caused the change.
+	watermark_fn queue_watermark;
+	uint32_t queue_high_watermark;
+	uint32_t queue_low_watermark;
+
+	// if set, messages are encrypted ahead into a pipeline of this many
+	// messages and transmitted by mr_hl_transmitloop, which must be run on
+	// another thread. Messages are transmitted in the order they were
+	// encrypted and mr_hl_send completes once its message is transmitted.
+	// Cannot be combined with transmit_batch or coalesce_threshold.
+	uint32_t pipeline_depth;
+
+	// optional. Calls work(arg, i) for every i from 0 to count - 1, spreading the calls
+	// over worker threads, and returns once all have completed. If provided, the message
+	// authentication codes of queued mr_hl_receive_data messages (or messages received
+	// together by receive_batch) are checked in parallel and the messages then decrypted
+	// one after the other in the order they were received.
+	parallel_fn parallel;
+
+	// if set, no message transmitted is larger than this many bytes (rounded down to
+	// message_quantization). Payloads passed to mr_hl_send that do not fit in one message
+	// are split into fragments that are reassembled by the receiver before data_callback is
+	// called. Each fragment takes 6 bytes for its header and a payload may be split into at
+	// most 255 fragments. Both sides of a session must use the same mtu and quantization.
+	// Must allow messages of at least 64 bytes so ECDH parameters can be exchanged.
+	// Initialization messages are not fragmented. Cannot be combined with transmit_batch,
+	// coalesce_threshold or pipeline_depth.
+	uint32_t mtu;
+
+	// the number of fragmented messages reassembled at once. When a fragment of another
+	// message arrives while all are in use, the oldest incomplete message is dropped.
+	// If 0, a default of 4 is used.
+	uint32_t reassembly_slots;
 } mr_hl_config;
 
+// counters kept by the high-level API. Comparing payload bytes to message
+// bytes gives the overhead of the link.
+typedef struct t_mr_hl_stats {
+	// payloads sent successfully with mr_hl_send and their total size.
+	uint64_t messages_sent;
+	uint64_t payload_bytes_sent;
+
+	// messages (including fragments and keepalives) encrypted for
+	// transmission and their total size.
+	uint64_t messages_transmitted;
+	uint64_t bytes_transmitted;
+
+	// messages received and processed successfully and their total size.
+	uint64_t messages_arrived;
+	uint64_t bytes_arrived;
+
+	// payloads passed to data_callback and their total size.
+	uint64_t messages_received;
+	uint64_t payload_bytes_received;
+
+	// fragmented messages dropped before all fragments arrived.
+	uint64_t messages_dropped;
+
+	// the total and the largest time in milliseconds from mr_hl_send until
+	// the payload was sent. Only kept if there is a clock.
+	uint64_t send_latency_total;
+	uint32_t send_latency_max;
+
+	// received messages waiting for their chain to catch up because they
+	// were too far ahead for the KDF budget and the number of KDF steps
+	// still to be taken before they can be received.
+	uint32_t messages_parked;
+	uint32_t catchup_outstanding;
+
+	// for a server attached to a loop with a handshake queue, the received
+	// initialization messages held back until established sessions have
+	// nothing to do and the number dropped because the peer sent too many
+	// or the queue was full.
+	uint32_t handshakes_queued;
+	uint64_t handshakes_shed;
+} mr_hl_stats;
+
+// counters kept by a loop.
+typedef struct t_mr_hl_loop_stats {
+	// initialization messages held back across all attached
+	// contexts and the number dropped.
+	uint32_t handshakes_queued;
+	uint64_t handshakes_shed;
+} mr_hl_loop_stats;
+
+// configuration for a loop that services many contexts.
+typedef struct t_mr_hlloopconfig {
+	// user defined data used in callbacks.
+	void* user;
+
+	// create and destroy the single wait handle used by the loop. All
+	// contexts attached to the loop notify this one handle.
+	waithandle_fn create_wait_handle;
+	waithandledestroy_fn destroy_wait_handle;
+
+	// wait for the loop wait handle to be notified. Only needed for
+	// mr_hl_loop_run. When integrating with an external event loop (e.g.
+	// epoll with an eventfd signalled by notify) this can be left out and
+	// mr_hl_loop_poll called instead.
+	wait_fn wait;
+
+	// notify the loop wait handle. Called whenever an action is enqueued
+	// for any of the attached contexts.
+	notify_fn notify;
+
+	// the maximum number of actions processed for a context before moving
+	// on to the next one. If 0, a default of 8 is used.
+	uint32_t quantum;
+
+	// optional. Returns a monotonically increasing time in milliseconds.
+	// Required for attached contexts to use initialize_retry or
+	// keepalive_interval.
+	now_fn now;
+
+	// the maximum number of initialization messages received by attached
+	// servers held back at a time. If set, these are recognized by their
+	// MAC and only processed once no attached context has anything else to
+	// do, so new peers do not hold up established sessions. Messages
+	// arriving when the queue is full fail with MR_E_QUEUEFULL. If 0,
+	// initialization messages are processed in turn like everything else.
+	uint32_t handshake_queue;
+
+	// optional. The number of initialization messages each attached server
+	// accepts per second and at once. Those above fail with MR_E_QUEUEFULL.
+	// Requires a clock and a handshake queue. If the burst is 0 it is the
+	// same as the rate.
+	uint32_t handshake_rate;
+	uint32_t handshake_burst;
+} mr_hl_loop_config;
+
 // The result of an operation. Note: when an error is returned and MR_DEBUG
 // is set, MR_WRITE will be called with the reason for the failure.
 typedef enum mr_result_e {
@@ -105,6 +411,10 @@ typedef enum mr_result_e {
 	// was enqueued but does not indicate whether or not the
 	// action succeeded.
 	MR_E_ACTION_ENQUEUED = 2,
+	// returned by mr_ctx_receive when a message is further ahead in its
+	// chain than the KDF budget allows. The chain was moved closer to it
+	// and the same message should be received again later.
+	MR_E_PENDING = 3,
 	// one of the arguments passed was invalid.
 	MR_E_INVALIDARG = -1,
 	// one of the sizes passed was invalid or too small.
@@ -124,7 +434,13 @@ typedef enum mr_result_e {
 	// a call to an external library function failed (i.e. a call to wolfssl or openssl failed).
 	MR_E_FAIL = -9,
 	// a high-level function has timed out.
-	MR_E_TIMEOUT = -10
+	MR_E_TIMEOUT = -10,
+	// the high-level queue is full.
+	MR_E_QUEUEFULL = -11,
+	// the message has been received before or is too old to tell. Messages more than
+	// MR_REPLAY_WINDOW (128 by default) generations behind the newest one received in
+	// their chain are rejected with this even if they were never received.
+	MR_E_REPLAY = -12
 } mr_result;
 
 // the minimum amount of overhead. The message space
@@ -154,9 +470,21 @@ typedef enum mr_result_e {
 // called will return MR_E_INVALIDSIZE.
 #define MR_MAX_INITIALIZATION_MESSAGE_SIZE 256
 
+// the extra space initialization messages need when the server
+// is configured with a cookie key.
+#define MR_COOKIE_SIZE 244
+
 // The size of an ECDSA or ECDH public key in bytes.
 #define MR_PUBLIC_KEY_SIZE 32
 
+// the minimum size of the header message that starts a stream.
+// If it is MR_OVERHEAD_WITH_ECDH - MR_OVERHEAD_WITHOUT_ECDH bytes
+// larger, ECDH parameters will be included.
+#define MR_STREAM_HEADER_SIZE 80
+
+// the size of the message authentication code that ends a stream.
+#define MR_STREAM_MAC_SIZE 16
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -282,6 +610,11 @@ extern "C" {
 	uint32_t mr_ecdsa_load(mr_ecdsa_ctx ctx, const uint8_t* data, uint32_t spaceavail);
 	// compute an ECDSA signature given a 256 bit message digest.
 	mr_result mr_ecdsa_sign(mr_ecdsa_ctx ctx, const uint8_t* digest, uint32_t digestsize, uint8_t* signature, uint32_t signaturespaceavail);
+	// precompute up to count signing nonces (k^-1 and r) so the next signatures are cheap. The
+	// number kept is bounded by the implementation. They are only kept in memory, are never stored
+	// and each is used for one signature only. Safe to call while another thread signs. May
+	// return MR_E_NOTIMPL, in which case signing works as usual.
+	mr_result mr_ecdsa_precompute(mr_ecdsa_ctx ctx, uint32_t count);
 	// return the size needed to store an ECDSA context.
 	uint32_t mr_ecdsa_store_size_needed(mr_ecdsa_ctx ctx);
 	// store an ECDSA ontext.
@@ -290,6 +623,20 @@ extern "C" {
 	void mr_ecdsa_destroy(mr_ecdsa_ctx ctx);
 	// verify an ECDSA signed message given a public key and a message digest.
 	mr_result mr_ecdsa_verify_other(const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, const uint8_t* publickey, uint32_t publickeysize, uint32_t* result);
+	// verify count ECDSA signatures, each with its own 32 byte digest and public key, putting 1 in
+	// results for each valid signature and 0 for each invalid one. An invalid signature does not affect
+	// the others. Implementations share work between the signatures where they can, so this is cheaper
+	// than calling mr_ecdsa_verify_other for each one.
+	mr_result mr_ecdsa_verify_batch(const uint8_t* const* signatures, const uint8_t* const* digests, const uint8_t* const* publickeys, uint32_t count, uint32_t* results);
+	// create a verifier for a public key. The key is decoded and prepared once so verifying many
+	// signatures made with it costs less than calling mr_ecdsa_verify_other each time. Implementations
+	// may also build a table of multiples of the key once it has verified many signatures, which makes
+	// verifying faster still but takes more memory. mr_ctx may be null.
+	mr_ecdsa_verifier mr_ecdsa_verifier_create(mr_ctx mr_ctx, const uint8_t* publickey, uint32_t publickeysize);
+	// verify an ECDSA signed message digest with a verifier. May be called from several threads at once.
+	mr_result mr_ecdsa_verifier_verify(mr_ecdsa_verifier ctx, const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, uint32_t* result);
+	// free a verifier.
+	void mr_ecdsa_verifier_destroy(mr_ecdsa_verifier ctx);
 
 
 	///// RNG
@@ -393,6 +740,15 @@ extern "C" {
 	// will be freed along with the context when the context is destroyed.
 	mr_result mr_ctx_set_identity(mr_ctx ctx, mr_ecdsa_ctx identity, bool destroy_with_context);
 
+	// creates a cache keeping verifiers for the capacity public keys used most recently. Set it
+	// as verifier_cache in the configuration of contexts that see the same keys again and again,
+	// like the clients of one server or a server that its peers keep initializing with. It can
+	// be shared by contexts on any thread. Returns null if allocation failed.
+	mr_verifier_cache mr_verifier_cache_create(uint32_t capacity);
+
+	// destroys a verifier cache. No context may be using it anymore.
+	void mr_verifier_cache_destroy(mr_verifier_cache cache);
+
 	// initiate initialization. If the context is a client, this will create the first initialization message to
 	// be sent to a server. The message will be created in message, which must provide at least
 	// This call will fail if the context is already initialized. To force it to re-initialize, set the force argument to true.
@@ -407,12 +763,94 @@ extern "C" {
 	// no payload.
 	mr_result mr_ctx_receive(mr_ctx ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable, uint8_t** payload, uint32_t* paylodsize);
 
+	// checks the message authentication code of a received message and copies the header key
+	// it was made with into headerkey, which must have space for 32 bytes. This does not modify
+	// the context, so several messages can be checked on different threads at the same time as
+	// long as nothing else uses the context meanwhile. Returns MR_E_NOTFOUND if the message is
+	// not recognized.
+	mr_result mr_ctx_receive_verify(mr_ctx ctx, const uint8_t* message, uint32_t messagesize, uint8_t* headerkey, uint32_t headerkeysize);
+
+	// checks the message authentication code of a received message and decrypts only its header
+	// to find out where it fits in the session, without receiving it or modifying the context.
+	// Returns MR_E_NOTFOUND if the message is not recognized.
+	mr_result mr_ctx_peek(mr_ctx ctx, const uint8_t* message, uint32_t messagesize, mr_peek_info* info);
+
+	// the same as mr_ctx_receive for a message already checked with mr_ctx_receive_verify,
+	// given the header key it returned. Messages must still be passed in order. The message
+	// authentication code is checked again under that header key only, instead of under every
+	// key of the session. If messages received since the check changed the keys of the context
+	// or the code does not match, all keys are tried as with mr_ctx_receive.
+	mr_result mr_ctx_receive_verified(mr_ctx ctx, uint8_t* message, uint32_t messagesize, uint32_t spaceavailable,
+		const uint8_t* headerkey, uint32_t headerkeysize, uint8_t** payload, uint32_t* paylodsize);
+
+	// moves receiving chains towards messages that returned MR_E_PENDING, taking at most budget
+	// KDF steps in total. Outstanding is set to the number of steps left to take, if given. A
+	// budget of 0 only counts them. Call this when idle or on a worker while nothing else uses
+	// the context.
+	mr_result mr_ctx_catchup(mr_ctx ctx, uint32_t budget, uint32_t* outstanding);
+
+	// receiving a message with new ECDH parameters only derives the new receiving chain. The
+	// sending chain is derived when the next message is sent or when this is called. Call this
+	// when idle so the next send does not have to. Does nothing if there is nothing to derive.
+	mr_result mr_ctx_precompute(mr_ctx ctx);
+
+	// starts a transaction. Changes made by receiving messages after this can be undone with
+	// mr_ctx_rollback or kept with mr_ctx_commit, without storing the whole state. Only the parts of
+	// ratchet steps that change are copied. Messages cannot be sent during a transaction, and it fails
+	// with MR_E_INVALIDOP if it touches more than MR_TXN_STEPS steps.
+	mr_result mr_ctx_begin(mr_ctx ctx);
+
+	// keeps the changes made since mr_ctx_begin.
+	mr_result mr_ctx_commit(mr_ctx ctx);
+
+	// undoes the changes made since mr_ctx_begin.
+	mr_result mr_ctx_rollback(mr_ctx ctx);
+
 	// encrypt a payload for sending. The payload will be encrypted in place to fill up to messagesize.
 	// messagesize must be at least MR_OVERHEAD_WITHOUT_ECDH bytes larger than payloadsize and be at least
 	// MR_MIN_MESSAGE_SIZE. If the message size is MR_OVERHEAD_WITH_ECDH bytes larger than the payload and
 	// at least 64 bytes total, ECDH parameters for key exchange will be included.
 	mr_result mr_ctx_send(mr_ctx ctx, uint8_t* payload, uint32_t payloadsize, uint32_t messagesize);
 
+	// encrypt a payload for sending into a separate message buffer. The payload is not modified
+	// and must not overlap the message. The same size requirements as mr_ctx_send apply.
+	mr_result mr_ctx_send_to(mr_ctx ctx, const uint8_t* payload, uint32_t payloadsize, uint8_t* message, uint32_t messagesize);
+
+	// like mr_ctx_send_to but the payload is made up of the given fragments in order. The
+	// fragment data is only read.
+	mr_result mr_ctx_send_gather(mr_ctx ctx, const mr_iovec* fragments, uint32_t fragmentcount, uint8_t* message, uint32_t messagesize);
+
+	// a convenience for sending the same payload to many sessions. Calls mr_ctx_send_to for each
+	// of ctxs[i] with messages[i] and places the result in results[i]. Every session has its own
+	// keys, so each message is encrypted and authenticated on its own and no work is shared
+	// between them. If parallel is given, sessions are encrypted from several threads by calling
+	// it with user (see mr_hl_config.parallel) so the contexts must all be different. Returns the
+	// first error in results or MR_E_SUCCESS.
+	mr_result mr_ctx_send_multi(mr_ctx* ctxs, uint32_t count, const uint8_t* payload, uint32_t payloadsize,
+		uint8_t** messages, uint32_t messagesize, mr_result* results, parallel_fn parallel, void* user);
+
+	// Streams are for payloads too large to hold in memory at once. A stream is sent as a header
+	// message, any number of pieces of data and a MAC:
+	// - mr_ctx_send_begin constructs the header in header, which must be at least
+	//   MR_STREAM_HEADER_SIZE bytes. The header is an ordinary message, sent and dropped
+	//   like any other, that carries fresh keys for the stream.
+	// - mr_ctx_send_update encrypts each piece of data into output, which may be the same as payload.
+	//   The output is exactly as large as the payload.
+	// - mr_ctx_send_final writes the MR_STREAM_MAC_SIZE byte MAC and frees the stream.
+	// The receiving side passes the header to mr_ctx_receive_begin instead of mr_ctx_receive
+	// and the pieces to mr_ctx_receive_update in the same order. Decrypted data must not be
+	// trusted until mr_ctx_receive_final has verified the MAC. The pieces on each side need not
+	// be the same sizes. A stream must be finished or destroyed before its context is destroyed.
+	mr_result mr_ctx_send_begin(mr_ctx ctx, mr_stream_ctx* stream, uint8_t* header, uint32_t headersize);
+	mr_result mr_ctx_send_update(mr_stream_ctx stream, const uint8_t* payload, uint32_t payloadsize, uint8_t* output, uint32_t spaceavailable);
+	mr_result mr_ctx_send_final(mr_stream_ctx stream, uint8_t* mac, uint32_t macsize);
+	mr_result mr_ctx_receive_begin(mr_ctx ctx, mr_stream_ctx* stream, uint8_t* header, uint32_t headersize);
+	mr_result mr_ctx_receive_update(mr_stream_ctx stream, const uint8_t* message, uint32_t messagesize, uint8_t* output, uint32_t spaceavailable);
+	// returns MR_E_VERIFYFAIL if the stream was tampered with.
+	mr_result mr_ctx_receive_final(mr_stream_ctx stream, const uint8_t* mac, uint32_t macsize);
+	// frees a stream that will not be finished.
+	void mr_stream_destroy(mr_stream_ctx stream);
+
 	// reports the amount of space needed to store the context.
 	uint32_t mr_ctx_state_size_needed(mr_ctx ctx);
 
@@ -438,6 +876,12 @@ extern "C" {
 	// from another thread.
 	mr_result mr_hl_mainloop(mr_ctx ctx, const mr_hl_config* config);
 
+	// transmits the messages encrypted by the main loop when pipeline_depth is set.
+	// Call this on its own thread once the main loop is running (or the context is
+	// attached to a loop). Returns after the main loop exits and everything in the
+	// pipeline has been transmitted.
+	mr_result mr_hl_transmitloop(mr_ctx ctx);
+
 	// performs initialization.
 	// If timeout is 0, the action will execute asynchronously and MR_E_ACTION_ENQUEUED will be returned.
 	mr_result mr_hl_initialize(mr_ctx ctx, uint32_t timeout);
@@ -457,10 +901,60 @@ extern "C" {
 	// If timeout is 0, the action will execute asynchronously and MR_E_ACTION_ENQUEUED will be returned.
 	mr_result mr_hl_receive_data(mr_ctx ctx, const uint8_t* data, uint32_t size, uint32_t timeout);
 
-	// Causes the main loop to exit.
+	// notifies the main loop that data is available without copying it.
+	// The main loop takes ownership of the buffer and decrypts the message in place, so the
+	// payload passed to data_callback points into it. spaceavailable is the size of the buffer,
+	// which must be at least size. release is called exactly once with release_user and data
+	// when the buffer is no longer used, also when an error is returned.
+	// If timeout is 0, the action will execute asynchronously and MR_E_ACTION_ENQUEUED will be returned.
+	mr_result mr_hl_receive_buffer(mr_ctx ctx, uint8_t* data, uint32_t size, uint32_t spaceavailable, release_fn release, void* release_user, uint32_t timeout);
+
+	// copies the counters kept for a context running the main loop or attached to a loop.
+	mr_result mr_hl_get_stats(mr_ctx ctx, mr_hl_stats* stats);
+
+	// Causes the main loop to exit. This is processed ahead of messages
+	// that are queued to be sent, which then fail.
 	// If timeout is 0, the action will execute asynchronously and MR_E_ACTION_ENQUEUED will be returned.
 	mr_result mr_hl_deactivate(mr_ctx ctx, uint32_t timeout);
 
+	// creates a loop that services the actions of many contexts from one or more
+	// threads instead of each context needing a thread running mr_hl_mainloop.
+	// Returns null if the configuration is invalid or allocation failed.
+	mr_hl_loop mr_hl_loop_create(const mr_hl_loop_config* config);
+
+	// attaches a context to a loop. The high-level functions can then be used with the context
+	// as if mr_hl_mainloop was running for it. A context is only ever processed by one thread at
+	// a time. Use mr_hl_deactivate to detach the context again.
+	mr_result mr_hl_loop_attach(mr_hl_loop loop, mr_ctx ctx, const mr_hl_config* config);
+
+	// runs the loop, servicing attached contexts in turn, until mr_hl_loop_stop is called.
+	// May be called from several threads at once.
+	mr_result mr_hl_loop_run(mr_hl_loop loop);
+
+	// services attached contexts until none have work left and returns without blocking.
+	// timeout receives the number of milliseconds after which the loop should be polled
+	// again if it is not notified before then, or 0xffffffff if there is no such time.
+	mr_result mr_hl_loop_poll(mr_hl_loop loop, uint32_t* timeout);
+
+	// copies the counters kept for a loop.
+	mr_result mr_hl_loop_get_stats(mr_hl_loop loop, mr_hl_loop_stats* stats);
+
+	// causes mr_hl_loop_run to return on all threads.
+	void mr_hl_loop_stop(mr_hl_loop loop);
+
+	// destroys a loop. Any contexts still attached are detached and their pending
+	// actions fail. No threads may be running the loop.
+	void mr_hl_loop_destroy(mr_hl_loop loop);
+
+	// fills in create_wait_handle, destroy_wait_handle, wait and notify with a built-in
+	// implementation based on futexes. Waiting spins briefly before sleeping so actions
+	// enqueued back to back are picked up without the main loop going to sleep. Only
+	// available on Linux. Elsewhere MR_E_NOTIMPL is returned.
+	mr_result mr_hl_set_default_wait_handles(mr_hl_config* config);
+
+	// the same as mr_hl_set_default_wait_handles but for a loop configuration.
+	mr_result mr_hl_loop_set_default_wait_handles(mr_hl_loop_config* config);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -30,15 +30,10 @@ static void ratchet_trim(_mr_ctx* ctx, uint32_t max)
 		{
 			_mr_ratchet_state* trim = ratchet->next;
 			ratchet->next = 0;
-			while (trim)
+			if (trim)
 			{
-				_mr_ratchet_state* next = trim->next;
-				if (trim->ecdhkey)
-				{
-					mr_ecdh_destroy(trim->ecdhkey);
-				}
-				mr_free(ctx, trim);
-				trim = next;
+				// freed now or when the transaction is committed
+				txn_dropped(ctx, ratchet, trim);
 			}
 		}
 		ratchet = ratchet->next;
@@ -130,7 +125,10 @@ void ratchet_destroy(_mr_ctx* ctx, _mr_ratchet_state* ratchet)
 	}
 }
 
-mr_result ratchet_initialize_server(mr_ctx mr_ctx,
+// derives the receiving chain of a new ratchet step. The sending chain
+// is left for ratchet_derivesending, with the root key in between the
+// two kept in nextrootkey until then.
+static mr_result ratchet_initialize_receiving(mr_ctx mr_ctx,
 	_mr_ratchet_state* ratchet,
 	mr_ecdh_ctx previouskeypair,
 	const uint8_t* rootkey, uint32_t rootkeysize,
@@ -161,7 +159,6 @@ mr_result ratchet_initialize_server(mr_ctx mr_ctx,
 	else mr_memzero(ratchet->sendheaderkey, KEY_SIZE);
 
 	uint8_t tmp[KEY_SIZE * 3];
-	uint8_t tmp_root[KEY_SIZE];
 
 	// receiving chain
 	TRACEMSG("--Receiving Chain");
@@ -175,32 +172,73 @@ mr_result ratchet_initialize_server(mr_ctx mr_ctx,
 	TRACEDATA("  C Key Out 0 rk:   ", tmp, KEY_SIZE);
 	TRACEDATA("  C Key Out 1 rck:  ", tmp + KEY_SIZE, KEY_SIZE);
 	TRACEDATA("  C Key Out 2 nrhk: ", tmp + KEY_SIZE * 2, KEY_SIZE);
-	mr_memcpy(tmp_root, tmp, KEY_SIZE);
-	_C(chain_initialize(mr_ctx, &ratchet->receivingchain, tmp + KEY_SIZE, KEY_SIZE));
+	mr_memcpy(ratchet->nextrootkey, tmp, KEY_SIZE);
+	_C(chain_initialize_receiving(&ratchet->receivingchain, tmp + KEY_SIZE, KEY_SIZE));
 	mr_memcpy(ratchet->nextreceiveheaderkey, tmp + KEY_SIZE * 2, KEY_SIZE);
 
+	// the sending chain comes later
+	mr_memcpy(ratchet->remotepublickey, remotepubickey, ECNUM_SIZE);
+	ratchet->sendingpending = true;
+
+	return MR_E_SUCCESS;
+}
+
+mr_result ratchet_derivesending(mr_ctx mr_ctx, _mr_ratchet_state* ratchet)
+{
+	FAILIF(!mr_ctx || !ratchet, MR_E_INVALIDARG, "Some of the required arguments were null");
+	_mr_ctx* ctx = (_mr_ctx*)mr_ctx;
+	if (!ratchet->sendingpending)
+	{
+		return MR_E_SUCCESS;
+	}
+	FAILIF(!ratchet->ecdhkey, MR_E_INVALIDOP, "The ratchet step has no key pair to derive the sending chain with");
+
+	uint8_t tmp[KEY_SIZE * 3];
+
 	// sending chain
 	TRACEMSG("--Sending Chain");
-	_C(mr_ecdh_derivekey(keypair, remotepubickey, remotepubickeysize, tmp, KEY_SIZE));
+	_C(mr_ecdh_derivekey(ratchet->ecdhkey, ratchet->remotepublickey, ECNUM_SIZE, tmp, KEY_SIZE));
 	_C(mr_sha_init(ctx->sha_ctx));
 	_C(mr_sha_process(ctx->sha_ctx, tmp, KEY_SIZE));
 	_C(mr_sha_compute(ctx->sha_ctx, tmp, sizeof(tmp)));
-	TRACEDATA("  C Input Key:      ", tmp_root, KEY_SIZE);
+	TRACEDATA("  C Input Key:      ", ratchet->nextrootkey, KEY_SIZE);
 	TRACEDATA("  C Key Info:       ", tmp, KEY_SIZE);
-	_C(kdf_compute(mr_ctx, tmp, KEY_SIZE, tmp_root, KEY_SIZE, tmp, sizeof(tmp)));
+	_C(kdf_compute(mr_ctx, tmp, KEY_SIZE, ratchet->nextrootkey, KEY_SIZE, tmp, sizeof(tmp)));
 	TRACEDATA("  C Key Out 0 nrk:  ", tmp, KEY_SIZE);
 	TRACEDATA("  C Key Out 1 sck:  ", tmp + KEY_SIZE, KEY_SIZE);
 	TRACEDATA("  C Key Out 2 nshk: ", tmp + KEY_SIZE * 2, KEY_SIZE);
-	rootkey = tmp;
 	_C(chain_initialize(mr_ctx, &ratchet->sendingchain, tmp + KEY_SIZE, KEY_SIZE));
 	mr_memcpy(ratchet->nextsendheaderkey, tmp + KEY_SIZE * 2, KEY_SIZE);
 
 	// next root key
-	mr_memcpy(ratchet->nextrootkey, rootkey, KEY_SIZE);
+	mr_memcpy(ratchet->nextrootkey, tmp, KEY_SIZE);
+	mr_memzero(tmp, sizeof(tmp));
+
+	mr_memzero(ratchet->remotepublickey, ECNUM_SIZE);
+	ratchet->sendingpending = false;
 
 	return MR_E_SUCCESS;
 }
 
+mr_result ratchet_initialize_server(mr_ctx mr_ctx,
+	_mr_ratchet_state* ratchet,
+	mr_ecdh_ctx previouskeypair,
+	const uint8_t* rootkey, uint32_t rootkeysize,
+	const uint8_t* remotepubickey, uint32_t remotepubickeysize,
+	mr_ecdh_ctx keypair,
+	const uint8_t* receiveheaderkey, uint32_t receiveheaderkeysize,
+	const uint8_t* sendheaderkey, uint32_t sendheaderkeysize)
+{
+	_C(ratchet_initialize_receiving(mr_ctx, ratchet,
+		previouskeypair,
+		rootkey, rootkeysize,
+		remotepubickey, remotepubickeysize,
+		keypair,
+		receiveheaderkey, receiveheaderkeysize,
+		sendheaderkey, sendheaderkeysize));
+	return ratchet_derivesending(mr_ctx, ratchet);
+}
+
 mr_result ratchet_initialize_client(mr_ctx mr_ctx,
 	_mr_ratchet_state* ratchet1,
 	_mr_ratchet_state* ratchet2,
@@ -298,20 +336,23 @@ mr_result ratchet_initialize(
 	if (sendingnextheaderkey) mr_memcpy(ratchet->nextsendheaderkey, sendingnextheaderkey, KEY_SIZE);
 	else mr_memzero(ratchet->receiveheaderkey, KEY_SIZE);
 
-	_C(chain_initialize(mr_ctx, &ratchet->receivingchain, receivingchainkey, receivingchainkeysize));
+	_C(chain_initialize_receiving(&ratchet->receivingchain, receivingchainkey, receivingchainkeysize));
 	ratchet->receivingchain.generation = receivinggeneration;
 	_C(chain_initialize(mr_ctx, &ratchet->sendingchain, sendingchainkey, sendingchainkeysize));
 
 	return MR_E_SUCCESS;
 }
 
-mr_result ratchet_ratchet(mr_ctx mr_ctx, _mr_ratchet_state* ratchet, _mr_ratchet_state* nextratchet, const uint8_t* remotepublickey, uint32_t remotepublickeysize, mr_ecdh_ctx keypair)
+mr_result ratchet_ratchet_receiving(mr_ctx mr_ctx, _mr_ratchet_state* ratchet, _mr_ratchet_state* nextratchet, const uint8_t* remotepublickey, uint32_t remotepublickeysize, mr_ecdh_ctx keypair)
 {
 	FAILIF(!ratchet || !nextratchet || !remotepublickey || !keypair, MR_E_INVALIDARG, "Some of the required arguments were null");
 	FAILIF(keypair == ratchet->ecdhkey, MR_E_INVALIDARG, "The key pair cannot be equal to the ratchet ECDH key");
 	FAILIF(remotepublickeysize != KEY_SIZE, MR_E_INVALIDSIZE, "The remote public key size was invalid");
 
-	_C(ratchet_initialize_server(mr_ctx, nextratchet,
+	// the next root key is only final once the sending chain is there
+	_C(ratchet_derivesending(mr_ctx, ratchet));
+
+	_C(ratchet_initialize_receiving(mr_ctx, nextratchet,
 		ratchet->ecdhkey,
 		ratchet->nextrootkey, KEY_SIZE,
 		remotepublickey, remotepublickeysize,
@@ -319,7 +360,7 @@ mr_result ratchet_ratchet(mr_ctx mr_ctx, _mr_ratchet_state* ratchet, _mr_ratchet
 		ratchet->nextreceiveheaderkey, KEY_SIZE,
 		ratchet->nextsendheaderkey, KEY_SIZE));
 
-	if (ratchet->ecdhkey) mr_ecdh_destroy(ratchet->ecdhkey);
+	if (ratchet->ecdhkey) txn_retire((_mr_ctx*)mr_ctx, ratchet->ecdhkey);
 	ratchet->ecdhkey = 0;
 	mr_memzero(ratchet->nextrootkey, KEY_SIZE);
 	mr_memzero(ratchet->nextreceiveheaderkey, KEY_SIZE);
@@ -344,6 +385,75 @@ mr_result chain_initialize(mr_ctx mr_ctx, _mr_chain_state* chain_state, const ui
 	return MR_E_SUCCESS;
 }
 
+mr_result chain_initialize_receiving(_mr_receiving_chain_state* chain_state, const uint8_t* chainkey, uint32_t chainkeysize)
+{
+	FAILIF(!chain_state, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(chainkey && chainkeysize != KEY_SIZE, MR_E_INVALIDSIZE, "The key size was invalid");
+
+	mr_memzero(chain_state, sizeof(_mr_receiving_chain_state));
+	if (chainkey) mr_memcpy(chain_state->chainkey, chainkey, KEY_SIZE);
+
+	return MR_E_SUCCESS;
+}
+
+bool chain_replayed(const _mr_receiving_chain_state* chain, uint32_t generation)
+{
+	if (generation > chain->generation)
+	{
+		return false;
+	}
+
+	uint32_t behind = chain->generation - generation;
+	if (behind >= MR_REPLAY_WINDOW)
+	{
+		return true;
+	}
+
+	return (chain->replay[behind / 32] >> (behind % 32)) & 1;
+}
+
+// slide the replay window forward for a chain that is moving ahead
+static void chain_slidewindow(_mr_receiving_chain_state* chain, uint32_t shift)
+{
+	if (shift >= MR_REPLAY_WINDOW)
+	{
+		mr_memzero(chain->replay, sizeof(chain->replay));
+	}
+	else
+	{
+		uint32_t words = shift / 32;
+		uint32_t bits = shift % 32;
+		for (int i = REPLAY_WINDOW_WORDS - 1; i >= 0; i--)
+		{
+			uint32_t w = 0;
+			if (i >= (int)words)
+			{
+				w = chain->replay[i - words] << bits;
+				if (bits && i > (int)words)
+				{
+					w |= chain->replay[i - words - 1] >> (32 - bits);
+				}
+			}
+			chain->replay[i] = w;
+		}
+	}
+}
+
+static void chain_markreceived(_mr_receiving_chain_state* chain, uint32_t generation)
+{
+	if (generation > chain->generation)
+	{
+		// slide the window forward so bit 0 is the new generation
+		chain_slidewindow(chain, generation - chain->generation);
+		chain->replay[0] |= 1;
+	}
+	else
+	{
+		uint32_t behind = chain->generation - generation;
+		chain->replay[behind / 32] |= 1u << (behind % 32);
+	}
+}
+
 mr_result chain_ratchetforsending(mr_ctx mr_ctx, _mr_chain_state* chain, uint8_t* key, uint32_t keysize, uint32_t* generation)
 {
 	FAILIF(!mr_ctx || !chain || !key || !generation, MR_E_INVALIDARG, "Some of the required arguments were null");
@@ -362,16 +472,231 @@ mr_result chain_ratchetforsending(mr_ctx mr_ctx, _mr_chain_state* chain, uint8_t
 	return MR_E_SUCCESS;
 }
 
-mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_chain_state* chain, uint32_t generation, uint8_t* key, uint32_t keysize)
+#if MR_CHAIN_CHECKPOINTS > 0
+// keep the chain key at a generation, replacing the oldest checkpoint if
+// there is no room. Nothing is kept if all checkpoints are newer.
+static void chain_checkpoint(_mr_receiving_chain_state* chain, uint32_t generation, const uint8_t* chainkey)
+{
+	int slot = -1;
+	for (int i = 0; i < MR_CHAIN_CHECKPOINTS; i++)
+	{
+		if (keyallzeroes(chain->checkpoints[i].chainkey))
+		{
+			slot = i;
+			break;
+		}
+
+		if (chain->checkpoints[i].generation < generation &&
+			(slot < 0 || chain->checkpoints[i].generation < chain->checkpoints[slot].generation))
+		{
+			slot = i;
+		}
+	}
+
+	if (slot >= 0)
+	{
+		chain->checkpoints[slot].generation = generation;
+		mr_memcpy(chain->checkpoints[slot].chainkey, chainkey, KEY_SIZE);
+	}
+}
+
+#endif
+
+// the generation of the closest key kept after the one at the given
+// generation, or the generation of the chain if there is none.
+static uint32_t chain_nextkept(const _mr_receiving_chain_state* chain, uint32_t generation)
+{
+	uint32_t next = chain->generation;
+	if (chain->oldgeneration > generation && chain->oldgeneration < next && !keyallzeroes(chain->oldchainkey))
+	{
+		next = chain->oldgeneration;
+	}
+
+#if MR_CHAIN_CHECKPOINTS > 0
+	for (int i = 0; i < MR_CHAIN_CHECKPOINTS; i++)
+	{
+		if (chain->checkpoints[i].generation > generation && chain->checkpoints[i].generation < next &&
+			!keyallzeroes(chain->checkpoints[i].chainkey))
+		{
+			next = chain->checkpoints[i].generation;
+		}
+	}
+#endif
+
+	return next;
+}
+
+// whether a key kept at a generation is still needed. Late messages are
+// derived from the closest key below them, so the key is only used for
+// the generations up to the next key kept. It is not needed once all of
+// them have been received or have fallen out of the replay window.
+static bool chain_keyneeded(const _mr_receiving_chain_state* chain, uint32_t generation)
+{
+	uint32_t from = generation + 1;
+	uint32_t to = chain_nextkept(chain, generation);
+	if (chain->generation >= MR_REPLAY_WINDOW && from <= chain->generation - MR_REPLAY_WINDOW)
+	{
+		from = chain->generation - MR_REPLAY_WINDOW + 1;
+	}
+
+	for (uint32_t g = from; g <= to; g++)
+	{
+		if (!chain_replayed(chain, g))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// erase the old chain key and the checkpoints that are no longer needed,
+// looking at the keys that are actually kept.
+static void chain_prunekeys(_mr_receiving_chain_state* chain)
+{
+#if MR_CHAIN_CHECKPOINTS > 0
+	for (int i = 0; i < MR_CHAIN_CHECKPOINTS; i++)
+	{
+		if (!keyallzeroes(chain->checkpoints[i].chainkey) && !chain_keyneeded(chain, chain->checkpoints[i].generation))
+		{
+			chain->checkpoints[i].generation = 0;
+			mr_memzero(chain->checkpoints[i].chainkey, KEY_SIZE);
+		}
+	}
+#endif
+
+	if (!keyallzeroes(chain->oldchainkey) && !chain_keyneeded(chain, chain->oldgeneration))
+	{
+		chain->oldgeneration = 0;
+		mr_memzero(chain->oldchainkey, KEY_SIZE);
+	}
+}
+
+// move a chain ahead towards the generation it is catching up to as
+// if the generations in between were skipped, taking at most the given
+// number of steps. The generation itself is left to be received.
+static mr_result chain_advance(mr_ctx mr_ctx, _mr_receiving_chain_state* chain, uint32_t steps, uint32_t* taken)
+{
+	uint32_t remaining = chain->catchuptarget > chain->generation + 1
+		? chain->catchuptarget - chain->generation - 1
+		: 0;
+	if (steps > remaining)
+	{
+		steps = remaining;
+	}
+
+	int oldkeyallzeroes = keyallzeroes(chain->oldchainkey);
+	if (steps && oldkeyallzeroes)
+	{
+		mr_memcpy(chain->oldchainkey, chain->chainkey, KEY_SIZE);
+		chain->oldgeneration = chain->generation;
+	}
+
+	struct {
+		uint8_t nck[KEY_SIZE];
+		uint8_t key[MSG_KEY_SIZE];
+	} keys;
+	uint32_t gen = chain->generation;
+	for (uint32_t i = 0; i < steps; i++, gen++)
+	{
+#if MR_CHAIN_CHECKPOINTS > 0
+		if (chain->catchuptarget - gen <= MR_REPLAY_WINDOW &&
+			(i == 0 ? !oldkeyallzeroes : gen % MR_CHECKPOINT_INTERVAL == 0))
+		{
+			chain_checkpoint(chain, gen, chain->chainkey);
+		}
+#endif
+
+		_C(kdf_compute(mr_ctx, chain->chainkey, KEY_SIZE, _chain_context, sizeof(_chain_context), keys.nck, sizeof(keys)));
+		mr_memcpy(chain->chainkey, keys.nck, KEY_SIZE);
+	}
+	mr_memzero(&keys, sizeof(keys));
+
+	chain_slidewindow(chain, steps);
+	chain->generation = gen;
+	if (chain->generation + 1 >= chain->catchuptarget)
+	{
+		chain->catchuptarget = 0;
+	}
+
+	chain_prunekeys(chain);
+
+	if (taken)
+	{
+		*taken = steps;
+	}
+
+	return MR_E_SUCCESS;
+}
+
+uint32_t chain_catchup_outstanding(const _mr_receiving_chain_state* chain)
+{
+	return chain->catchuptarget > chain->generation + 1
+		? chain->catchuptarget - chain->generation - 1
+		: 0;
+}
+
+mr_result chain_catchup(mr_ctx mr_ctx, _mr_receiving_chain_state* chain, uint32_t budget, uint32_t* taken)
+{
+	FAILIF(!mr_ctx || !chain, MR_E_INVALIDARG, "Some of the required arguments were null");
+	return chain_advance(mr_ctx, chain, budget, taken);
+}
+
+bool chain_haskey(const _mr_receiving_chain_state* chain, uint32_t generation)
+{
+	if (generation > chain->generation)
+	{
+		return true;
+	}
+
+	if (generation > chain->oldgeneration && !keyallzeroes(chain->oldchainkey))
+	{
+		return true;
+	}
+
+#if MR_CHAIN_CHECKPOINTS > 0
+	for (int i = 0; i < MR_CHAIN_CHECKPOINTS; i++)
+	{
+		if (chain->checkpoints[i].generation < generation && !keyallzeroes(chain->checkpoints[i].chainkey))
+		{
+			return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_receiving_chain_state* chain, uint32_t generation, uint8_t* key, uint32_t keysize)
 {
 	FAILIF(!mr_ctx || !chain || !key, MR_E_INVALIDARG, "Some of the required arguments were null");
 	FAILIF(keysize != MSG_KEY_SIZE, MR_E_INVALIDSIZE, "The key size was invalid");
+	FAILIF(chain_replayed(chain, generation), MR_E_REPLAY, "The key for the generation has been used or is too old");
+
+	if (generation > chain->generation)
+	{
+		const mr_config* config = &((_mr_ctx*)mr_ctx)->config;
+		uint32_t gap = generation - chain->generation;
+		FAILIF(config->max_gap && gap > config->max_gap, MR_E_INVALIDOP, "The generation is too far ahead of the chain");
+
+		// too far to go now. Move closer and have the message tried again.
+		if (config->kdf_budget && gap > config->kdf_budget)
+		{
+			if (chain->catchuptarget < generation)
+			{
+				chain->catchuptarget = generation;
+			}
+			_C(chain_advance(mr_ctx, chain, config->kdf_budget, 0));
+			return MR_E_PENDING;
+		}
+	}
 
 	uint32_t gen = 0;
 	uint8_t* ck = 0;
 	int oldkeyallzeroes = keyallzeroes(chain->oldchainkey);
+	int checkpoint = -1;
 
-	// figure out if we're starting to ratchet from the chain key or the "old chain key"
+	// figure out if we're starting to ratchet from the chain key, the "old chain key" or a checkpoint
 	if (generation > chain->generation)
 	{
 		// generation is bigger than the chain gen so we start at the chain key
@@ -386,15 +711,27 @@ mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_chain_state* chain, uint3
 			gen = chain->oldgeneration;
 			ck = chain->oldchainkey;
 		}
-		else
+
+#if MR_CHAIN_CHECKPOINTS > 0
+		// a checkpoint closer to the generation is better
+		for (int i = 0; i < MR_CHAIN_CHECKPOINTS; i++)
 		{
-			FAILIF(true, MR_E_NOTFOUND, "The requested ratchet key has been lost");
+			if (chain->checkpoints[i].generation < generation && (!ck || chain->checkpoints[i].generation > gen) &&
+				!keyallzeroes(chain->checkpoints[i].chainkey))
+			{
+				gen = chain->checkpoints[i].generation;
+				ck = chain->checkpoints[i].chainkey;
+				checkpoint = i;
+			}
 		}
+#endif
+
+		FAILIF(!ck, MR_E_NOTFOUND, "The requested ratchet key has been lost");
 	}
 
+	uint32_t start = gen;
 	int mustSkip = generation > chain->generation && (generation - chain->generation) > 1;
-	int incrementOld = generation > chain->oldgeneration && generation <= chain->generation &&
-		!oldkeyallzeroes && (generation == chain->oldgeneration + 1);
+	int incrementOld = ck == chain->oldchainkey && (generation == chain->oldgeneration + 1);
 
 	// ratchet until ++gen == generation
 	uint8_t* cku = ck;
@@ -404,6 +741,16 @@ mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_chain_state* chain, uint3
 	} keys = { 0 };
 	for (; gen < generation; gen++)
 	{
+#if MR_CHAIN_CHECKPOINTS > 0
+		// keep checkpoints in the window for the generations being skipped.
+		// The start of the gap is kept in the old chain key if that is free.
+		if (mustSkip && gen + 1 < generation && generation - gen <= MR_REPLAY_WINDOW &&
+			(gen == start ? !oldkeyallzeroes : gen % MR_CHECKPOINT_INTERVAL == 0))
+		{
+			chain_checkpoint(chain, gen, cku);
+		}
+#endif
+
 		_C(kdf_compute(mr_ctx, cku, KEY_SIZE, _chain_context, sizeof(_chain_context), keys.nck, sizeof(keys)));
 		cku = keys.nck;
 	}
@@ -425,6 +772,17 @@ mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_chain_state* chain, uint3
 		chain->oldgeneration++;
 	}
 
+#if MR_CHAIN_CHECKPOINTS > 0
+	// the same goes for a checkpoint
+	if (checkpoint >= 0 && generation == start + 1)
+	{
+		mr_memcpy(chain->checkpoints[checkpoint].chainkey, keys.nck, KEY_SIZE);
+		chain->checkpoints[checkpoint].generation = generation;
+	}
+#endif
+
+	chain_markreceived(chain, generation);
+
 	// if the requested generation is greater than the chain gen, update it
 	if (generation > chain->generation)
 	{
@@ -432,5 +790,18 @@ mr_result chain_ratchetforreceiving(mr_ctx mr_ctx, _mr_chain_state* chain, uint3
 		chain->generation = gen;
 	}
 
+	if (chain->catchuptarget && chain->generation + 1 >= chain->catchuptarget)
+	{
+		chain->catchuptarget = 0;
+	}
+
+	chain_prunekeys(chain);
+
 	return MR_E_SUCCESS;
+}
+
+mr_result ratchet_ratchet(mr_ctx mr_ctx, _mr_ratchet_state* ratchet, _mr_ratchet_state* nextratchet, const uint8_t* remotepublickey, uint32_t remotepublickeysize, mr_ecdh_ctx keypair)
+{
+	_C(ratchet_ratchet_receiving(mr_ctx, ratchet, nextratchet, remotepublickey, remotepublickeysize, keypair));
+	return ratchet_derivesending(mr_ctx, nextratchet);
 }
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include "pch.h"
+#include "microratchet.h"
+#include "internal.h"
+
+// A hierarchical timer wheel. Level 0 has one slot per tick and each level
+// after that has slots covering a whole revolution of the level below it.
+// Timers are placed in the lowest level that can hold them and are moved down
+// (cascaded) as the wheel turns, so scheduling and cancelling are O(1).
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void timer_link(_mr_timer_wheel* wheel, _mr_timer* timer)
+{
+	uint32_t when = timer->expires;
+	int32_t delta = (int32_t)(when - wheel->now);
+	if (delta < 0)
+	{
+		// expired already, fire on the next tick processed
+		delta = 0;
+		when = wheel->now;
+	}
+	else if ((uint32_t)delta >= TIMER_WHEEL_RANGE)
+	{
+		// too far out. The timer will be cascaded again
+		// from the top level until it can be placed.
+		delta = TIMER_WHEEL_RANGE - 1;
+		when = wheel->now + delta;
+	}
+
+	uint32_t level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && (uint32_t)delta >= (1u << (TIMER_WHEEL_BITS * (level + 1))))
+	{
+		level++;
+	}
+
+	uint32_t slot = (when >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	_mr_timer** head = &wheel->slots[level][slot];
+
+	timer->next = *head;
+	timer->pprev = head;
+	if (*head)
+	{
+		(*head)->pprev = &timer->next;
+	}
+	*head = timer;
+}
+
+static void timer_unlink(_mr_timer* timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+	{
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = 0;
+	timer->pprev = 0;
+}
+
+// move the timers in the slots of the upper levels that are due
+// at the current time of the wheel into the levels below.
+static void timer_cascade(_mr_timer_wheel* wheel)
+{
+	for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		uint32_t slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+		_mr_timer* timer = wheel->slots[level][slot];
+		wheel->slots[level][slot] = 0;
+		while (timer)
+		{
+			_mr_timer* next = timer->next;
+			timer_link(wheel, timer);
+			timer = next;
+		}
+
+		// only cascade further if this level also turned over
+		if (slot != 0)
+		{
+			break;
+		}
+	}
+}
+
+// the tick at which the wheel next has something to do: the first slot of
+// level 0 with timers in it or the first time a slot with timers in one of
+// the upper levels is cascaded, whichever comes first. Must only be called
+// if there are timers on the wheel.
+static uint32_t timer_due(const _mr_timer_wheel* wheel)
+{
+	uint32_t due = 0xffffffff;
+	for (uint32_t i = 0; i < TIMER_WHEEL_SLOTS; i++)
+	{
+		if (wheel->slots[0][(wheel->now + i) & TIMER_WHEEL_MASK])
+		{
+			due = i;
+			break;
+		}
+	}
+
+	// a slot in an upper level is cascaded when the wheel gets to its start.
+	// The slot the wheel is in now was cascaded already, so the earliest is
+	// the one after it and the latest is that slot again a revolution later.
+	for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		uint32_t shift = TIMER_WHEEL_BITS * level;
+		uint32_t current = wheel->now >> shift;
+		for (uint32_t i = 1; i <= TIMER_WHEEL_SLOTS; i++)
+		{
+			if (wheel->slots[level][(current + i) & TIMER_WHEEL_MASK])
+			{
+				uint32_t delta = ((current + i) << shift) - wheel->now;
+				if (delta < due)
+				{
+					due = delta;
+				}
+				break;
+			}
+		}
+	}
+
+	return wheel->now + due;
+}
+
+void timer_wheel_init(_mr_timer_wheel* wheel, uint32_t now)
+{
+	mr_memzero(wheel, sizeof(_mr_timer_wheel));
+	wheel->now = now;
+}
+
+void timer_schedule(_mr_timer_wheel* wheel, _mr_timer* timer, uint32_t expires)
+{
+	if (timer->pprev)
+	{
+		timer_unlink(timer);
+		wheel->count--;
+	}
+
+	timer->expires = expires;
+	timer_link(wheel, timer);
+	wheel->count++;
+}
+
+void timer_cancel(_mr_timer_wheel* wheel, _mr_timer* timer)
+{
+	if (timer->pprev)
+	{
+		timer_unlink(timer);
+		wheel->count--;
+	}
+}
+
+_mr_timer* timer_wheel_advance(_mr_timer_wheel* wheel, uint32_t now)
+{
+	_mr_timer* expired = 0;
+
+	while (wheel->count)
+	{
+		uint32_t due = timer_due(wheel);
+		if ((int32_t)(now - due) < 0)
+		{
+			break;
+		}
+
+		// skip straight to it. Nothing is cascaded in between.
+		if (due != wheel->now)
+		{
+			wheel->now = due;
+			if ((wheel->now & TIMER_WHEEL_MASK) == 0)
+			{
+				timer_cascade(wheel);
+			}
+		}
+
+		// take everything in the current slot
+		_mr_timer** head = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+		while (*head)
+		{
+			_mr_timer* timer = *head;
+			timer_unlink(timer);
+			wheel->count--;
+			timer->next = expired;
+			expired = timer;
+		}
+
+		wheel->now++;
+		if ((wheel->now & TIMER_WHEEL_MASK) == 0)
+		{
+			timer_cascade(wheel);
+		}
+	}
+
+	// nothing left that could expire
+	if (!wheel->count && (int32_t)(now - wheel->now) >= 0)
+	{
+		wheel->now = now + 1;
+	}
+
+	return expired;
+}
+
+uint32_t timer_wheel_next(const _mr_timer_wheel* wheel, uint32_t now)
+{
+	if (!wheel->count)
+	{
+		return 0xffffffff;
+	}
+
+	// timers far out are only woken for when they are cascaded
+	// into a lower level, not at the end of every revolution.
+	int32_t remaining = (int32_t)(timer_due(wheel) - now);
+	return remaining > 0 ? (uint32_t)remaining : 0;
+}
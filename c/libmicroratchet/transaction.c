@@ -0,0 +1,243 @@
+#include "pch.h"
+#include "microratchet.h"
+#include "internal.h"
+
+// Transactions keep an undo log instead of a snapshot of the whole state.
+// The receiving chain or the ECDH ratchet part of a step is copied the first
+// time it is changed, new steps are remembered and ECDH keys and steps that
+// would be freed are held on to. Committing frees what was held on to,
+// rolling back puts the copies back and frees what was added.
+
+static bool txn_isadded(const _mr_txn* txn, const _mr_ratchet_state* step)
+{
+	for (uint32_t i = 0; i < txn->numadded; i++)
+	{
+		if (txn->added[i] == step) return true;
+	}
+
+	return false;
+}
+
+static bool txn_isreferenced(const _mr_ctx* ctx, mr_ecdh_ctx key)
+{
+	for (const _mr_ratchet_state* r = ctx->ratchet; r; r = r->next)
+	{
+		if (r->ecdhkey == key) return true;
+	}
+
+	return false;
+}
+
+static void txn_free_chain(_mr_ctx* ctx, _mr_ratchet_state* chain)
+{
+	while (chain)
+	{
+		_mr_ratchet_state* next = chain->next;
+		if (chain->ecdhkey)
+		{
+			mr_ecdh_destroy(chain->ecdhkey);
+		}
+		mr_free(ctx, chain);
+		chain = next;
+	}
+}
+
+static void txn_end(_mr_ctx* ctx)
+{
+	_mr_txn* txn = ctx->txn;
+	for (uint32_t i = 0; i < txn->numchains; i++)
+	{
+		mr_memzero(txn->chains[i], sizeof(_mr_txn_chain));
+		mr_free(ctx, txn->chains[i]);
+	}
+	for (uint32_t i = 0; i < txn->numsteps; i++)
+	{
+		mr_memzero(txn->steps[i], sizeof(_mr_txn_step));
+		mr_free(ctx, txn->steps[i]);
+	}
+
+	mr_memzero(ctx->txn, sizeof(_mr_txn));
+	mr_free(ctx, ctx->txn);
+	ctx->txn = 0;
+}
+
+mr_result txn_touch_chain(_mr_ctx* ctx, _mr_ratchet_state* step)
+{
+	_mr_txn* txn = ctx->txn;
+	if (!txn || !step || txn_isadded(txn, step))
+	{
+		return MR_E_SUCCESS;
+	}
+
+	for (uint32_t i = 0; i < txn->numchains; i++)
+	{
+		if (txn->chains[i]->step == step) return MR_E_SUCCESS;
+	}
+
+	FAILIF(txn->numchains == MR_TXN_STEPS, MR_E_INVALIDOP, "The transaction changed too many receiving chains");
+	_mr_txn_chain* saved = 0;
+	_C(mr_allocate(ctx, sizeof(_mr_txn_chain), (void**)&saved));
+	saved->step = step;
+	mr_memcpy(&saved->receivingchain, &step->receivingchain, sizeof(_mr_receiving_chain_state));
+	txn->chains[txn->numchains++] = saved;
+	return MR_E_SUCCESS;
+}
+
+mr_result txn_touch_step(_mr_ctx* ctx, _mr_ratchet_state* step)
+{
+	_mr_txn* txn = ctx->txn;
+	if (!txn || !step || txn_isadded(txn, step))
+	{
+		return MR_E_SUCCESS;
+	}
+
+	for (uint32_t i = 0; i < txn->numsteps; i++)
+	{
+		if (txn->steps[i]->step == step) return MR_E_SUCCESS;
+	}
+
+	FAILIF(txn->numsteps == MR_TXN_STEPS, MR_E_INVALIDOP, "The transaction changed too many ratchet steps");
+	_mr_txn_step* saved = 0;
+	_C(mr_allocate(ctx, sizeof(_mr_txn_step), (void**)&saved));
+	saved->step = step;
+	saved->ecdhkey = step->ecdhkey;
+	mr_memcpy(saved->nextrootkey, step->nextrootkey, KEY_SIZE);
+	mr_memcpy(saved->nextsendheaderkey, step->nextsendheaderkey, KEY_SIZE);
+	mr_memcpy(saved->nextreceiveheaderkey, step->nextreceiveheaderkey, KEY_SIZE);
+	mr_memcpy(&saved->sendingchain, &step->sendingchain, sizeof(_mr_chain_state));
+	saved->sendingpending = step->sendingpending;
+	mr_memcpy(saved->remotepublickey, step->remotepublickey, ECNUM_SIZE);
+	txn->steps[txn->numsteps++] = saved;
+	return MR_E_SUCCESS;
+}
+
+mr_result txn_reserve(_mr_ctx* ctx)
+{
+	// every step added can retire one key and drop one chain
+	// so making sure it fits makes sure those fit too.
+	FAILIF(ctx->txn && ctx->txn->numadded == MR_TXN_STEPS, MR_E_INVALIDOP, "The transaction took too many ECDH ratchets");
+	return MR_E_SUCCESS;
+}
+
+void txn_added(_mr_ctx* ctx, _mr_ratchet_state* step)
+{
+	if (ctx->txn)
+	{
+		ctx->txn->added[ctx->txn->numadded++] = step;
+	}
+}
+
+void txn_dropped(_mr_ctx* ctx, _mr_ratchet_state* parent, _mr_ratchet_state* chain)
+{
+	if (ctx->txn && ctx->txn->numdropped < MR_TXN_STEPS)
+	{
+		ctx->txn->dropped[ctx->txn->numdropped].parent = parent;
+		ctx->txn->dropped[ctx->txn->numdropped].chain = chain;
+		ctx->txn->numdropped++;
+	}
+	else
+	{
+		txn_free_chain(ctx, chain);
+	}
+}
+
+void txn_retire(_mr_ctx* ctx, mr_ecdh_ctx key)
+{
+	if (ctx->txn && ctx->txn->numretired < MR_TXN_STEPS)
+	{
+		ctx->txn->retired[ctx->txn->numretired++] = key;
+	}
+	else if (key)
+	{
+		mr_ecdh_destroy(key);
+	}
+}
+
+mr_result mr_ctx_begin(mr_ctx _ctx)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
+	FAILIF(!ctx->init.initialized, MR_E_INVALIDOP, "The session has not been initialized");
+	FAILIF(ctx->txn, MR_E_INVALIDOP, "A transaction was already started");
+
+	_C(mr_allocate(ctx, sizeof(_mr_txn), (void**)&ctx->txn));
+	mr_memzero(ctx->txn, sizeof(_mr_txn));
+	ctx->txn->ratchet = ctx->ratchet;
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_commit(mr_ctx _ctx)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
+	FAILIF(!ctx->txn, MR_E_INVALIDOP, "No transaction was started");
+
+	_mr_txn* txn = ctx->txn;
+	for (uint32_t i = 0; i < txn->numdropped; i++)
+	{
+		txn_free_chain(ctx, txn->dropped[i].chain);
+	}
+	for (uint32_t i = 0; i < txn->numretired; i++)
+	{
+		mr_ecdh_destroy(txn->retired[i]);
+	}
+	if (txn->releaseserver)
+	{
+		ctx_free_server_initialization(ctx);
+	}
+
+	txn_end(ctx);
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ctx_rollback(mr_ctx _ctx)
+{
+	_mr_ctx* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "Context must be provided");
+	FAILIF(!ctx->txn, MR_E_INVALIDOP, "No transaction was started");
+
+	_mr_txn* txn = ctx->txn;
+	for (uint32_t i = 0; i < txn->numchains; i++)
+	{
+		_mr_txn_chain* saved = txn->chains[i];
+		mr_memcpy(&saved->step->receivingchain, &saved->receivingchain, sizeof(_mr_receiving_chain_state));
+	}
+	for (uint32_t i = 0; i < txn->numsteps; i++)
+	{
+		_mr_txn_step* saved = txn->steps[i];
+		_mr_ratchet_state* step = saved->step;
+		step->ecdhkey = saved->ecdhkey;
+		mr_memcpy(step->nextrootkey, saved->nextrootkey, KEY_SIZE);
+		mr_memcpy(step->nextsendheaderkey, saved->nextsendheaderkey, KEY_SIZE);
+		mr_memcpy(step->nextreceiveheaderkey, saved->nextreceiveheaderkey, KEY_SIZE);
+		mr_memcpy(&step->sendingchain, &saved->sendingchain, sizeof(_mr_chain_state));
+		step->sendingpending = saved->sendingpending;
+		mr_memcpy(step->remotepublickey, saved->remotepublickey, ECNUM_SIZE);
+	}
+	for (uint32_t i = txn->numdropped; i > 0; i--)
+	{
+		txn->dropped[i - 1].parent->next = txn->dropped[i - 1].chain;
+	}
+	ctx->ratchet = txn->ratchet;
+
+	// keys retired from steps that were added are not needed anymore
+	for (uint32_t i = 0; i < txn->numretired; i++)
+	{
+		if (!txn_isreferenced(ctx, txn->retired[i]))
+		{
+			mr_ecdh_destroy(txn->retired[i]);
+		}
+	}
+	for (uint32_t i = 0; i < txn->numadded; i++)
+	{
+		if (txn->added[i]->ecdhkey)
+		{
+			mr_ecdh_destroy(txn->added[i]->ecdhkey);
+		}
+		mr_memzero(txn->added[i], sizeof(_mr_ratchet_state));
+		mr_free(ctx, txn->added[i]);
+	}
+
+	txn_end(ctx);
+	return MR_E_SUCCESS;
+}
@@ -0,0 +1,199 @@
+#include "pch.h"
+#include "microratchet.h"
+#include "internal.h"
+
+// A cache of ECDSA verifiers keyed by public key. Verifiers are looked up
+// in a hash table and the least recently used one is evicted when the cache
+// is full. Preparing a verifier and verifying happen outside of the lock so
+// contexts on different threads only contend for the lookup.
+
+static uint32_t verifier_hash(const _mr_verifier_cache* cache, const uint8_t* publickey)
+{
+	// public keys are x coordinates, which are as good as random
+	uint32_t h = 0;
+	for (uint32_t i = 0; i < ECNUM_SIZE; i++)
+	{
+		h = (h * 31) ^ publickey[i];
+	}
+	return h & (cache->numbuckets - 1);
+}
+
+static void verifier_unlink(_mr_verifier_cache* cache, _mr_verifier_entry* entry)
+{
+	if (entry->newer) entry->newer->older = entry->older;
+	else cache->newest = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else cache->oldest = entry->newer;
+	entry->newer = 0;
+	entry->older = 0;
+}
+
+static void verifier_link(_mr_verifier_cache* cache, _mr_verifier_entry* entry)
+{
+	entry->older = cache->newest;
+	entry->newer = 0;
+	if (cache->newest) cache->newest->newer = entry;
+	else cache->oldest = entry;
+	cache->newest = entry;
+}
+
+static _mr_verifier_entry* verifier_find(_mr_verifier_cache* cache, const uint8_t* publickey)
+{
+	_mr_verifier_entry* entry = cache->buckets[verifier_hash(cache, publickey)];
+	while (entry && memcmp(entry->publickey, publickey, ECNUM_SIZE) != 0)
+	{
+		entry = entry->hashnext;
+	}
+	return entry;
+}
+
+static void verifier_free(_mr_verifier_entry* entry)
+{
+	mr_ecdsa_verifier_destroy(entry->verifier);
+	mr_memzero(entry, sizeof(_mr_verifier_entry));
+	mr_free(0, entry);
+}
+
+// removes the oldest entry from the cache. Returns it if nothing
+// is using it anymore so it can be freed outside of the lock.
+static _mr_verifier_entry* verifier_evict(_mr_verifier_cache* cache)
+{
+	_mr_verifier_entry* entry = cache->oldest;
+	_mr_verifier_entry** pitem = &cache->buckets[verifier_hash(cache, entry->publickey)];
+	while (*pitem != entry) pitem = &(*pitem)->hashnext;
+	*pitem = entry->hashnext;
+	entry->hashnext = 0;
+	verifier_unlink(cache, entry);
+	cache->count--;
+
+	entry->evicted = true;
+	return entry->ref == 0 ? entry : 0;
+}
+
+// finds the verifier for a public key, preparing one if there is none, and
+// holds on to it until verifier_release is called.
+static mr_result verifier_acquire(_mr_verifier_cache* cache, const uint8_t* publickey, _mr_verifier_entry** pentry)
+{
+	spin_lock(&cache->lock);
+	_mr_verifier_entry* entry = verifier_find(cache, publickey);
+	if (entry)
+	{
+		entry->ref++;
+		verifier_unlink(cache, entry);
+		verifier_link(cache, entry);
+		cache->hits++;
+	}
+	else
+	{
+		cache->misses++;
+	}
+	spin_unlock(&cache->lock);
+
+	if (entry)
+	{
+		*pentry = entry;
+		return MR_E_SUCCESS;
+	}
+
+	// prepare a verifier while not holding the lock
+	_mr_verifier_entry* newentry;
+	_C(mr_allocate(0, sizeof(_mr_verifier_entry), (void**)&newentry));
+	mr_memzero(newentry, sizeof(_mr_verifier_entry));
+	mr_memcpy(newentry->publickey, publickey, ECNUM_SIZE);
+	newentry->verifier = mr_ecdsa_verifier_create(0, publickey, ECNUM_SIZE);
+	if (!newentry->verifier)
+	{
+		mr_free(0, newentry);
+		FAILMSG(MR_E_INVALIDOP, "Could not create a verifier for the public key");
+	}
+
+	_mr_verifier_entry* evicted = 0;
+	spin_lock(&cache->lock);
+	entry = verifier_find(cache, publickey);
+	if (entry)
+	{
+		// another thread got there first
+		entry->ref++;
+	}
+	else
+	{
+		entry = newentry;
+		newentry = 0;
+		uint32_t bucket = verifier_hash(cache, publickey);
+		entry->ref = 1;
+		entry->hashnext = cache->buckets[bucket];
+		cache->buckets[bucket] = entry;
+		verifier_link(cache, entry);
+		if (++cache->count > cache->capacity)
+		{
+			evicted = verifier_evict(cache);
+		}
+	}
+	spin_unlock(&cache->lock);
+
+	if (newentry) verifier_free(newentry);
+	if (evicted) verifier_free(evicted);
+
+	*pentry = entry;
+	return MR_E_SUCCESS;
+}
+
+static void verifier_release(_mr_verifier_cache* cache, _mr_verifier_entry* entry)
+{
+	spin_lock(&cache->lock);
+	bool last = --entry->ref == 0 && entry->evicted;
+	spin_unlock(&cache->lock);
+
+	if (last) verifier_free(entry);
+}
+
+mr_result verifier_cache_verify(_mr_verifier_cache* cache, const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, const uint8_t* publickey, uint32_t publickeysize, uint32_t* result)
+{
+	FAILIF(!cache || !publickey, MR_E_INVALIDARG, "Some of the required arguments were null");
+	FAILIF(publickeysize != ECNUM_SIZE, MR_E_INVALIDSIZE, "The public key must be 32 bytes");
+
+	_mr_verifier_entry* entry;
+	_C(verifier_acquire(cache, publickey, &entry));
+	mr_result r = mr_ecdsa_verifier_verify(entry->verifier, signature, signaturesize, digest, digestsize, result);
+	verifier_release(cache, entry);
+	return r;
+}
+
+mr_verifier_cache mr_verifier_cache_create(uint32_t capacity)
+{
+	if (capacity == 0)
+	{
+		return 0;
+	}
+
+	// at least as many buckets as entries
+	uint32_t numbuckets = 1;
+	while (numbuckets < capacity && numbuckets < 0x80000000) numbuckets <<= 1;
+
+	_mr_verifier_cache* cache;
+	size_t size = sizeof(_mr_verifier_cache) + numbuckets * sizeof(_mr_verifier_entry*);
+	if (mr_allocate(0, (int)size, (void**)&cache) != MR_E_SUCCESS || !cache)
+	{
+		return 0;
+	}
+
+	mr_memzero(cache, size);
+	cache->capacity = capacity;
+	cache->numbuckets = numbuckets;
+	cache->buckets = (_mr_verifier_entry**)(cache + 1);
+	return cache;
+}
+
+void mr_verifier_cache_destroy(mr_verifier_cache _cache)
+{
+	_mr_verifier_cache* cache = (_mr_verifier_cache*)_cache;
+	if (cache)
+	{
+		while (cache->oldest)
+		{
+			verifier_free(verifier_evict(cache));
+		}
+
+		mr_free(0, cache);
+	}
+}
@@ -0,0 +1,187 @@
+#if defined(__linux__) && !defined(MR_EMBEDDED)
+#define _GNU_SOURCE
+#endif
+
+#include "pch.h"
+#include "microratchet.h"
+#include "internal.h"
+
+#if defined(__linux__) && !defined(MR_EMBEDDED)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Wait handles built on a futex. A handle is an auto-reset event: notify
+// sets it and a wait consumes it. Waiting spins for a while before parking
+// in the kernel so an action enqueued just after the main loop runs out of
+// work is picked up without a round trip through the scheduler. The number
+// of spins adapts to whether spinning paid off the last time.
+
+#define WH_SPIN_MIN 16
+#define WH_SPIN_MAX 4096
+#define WH_SPIN_INITIAL 256
+
+#if defined(MR_X64) || defined(__i386__)
+#define wh_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define wh_relax() __asm__ __volatile__("yield")
+#else
+#define wh_relax()
+#endif
+
+typedef struct t_waithandle {
+	// 1 if notified, 0 otherwise
+	uint32_t state;
+
+	// the number of threads parked or about to park
+	uint32_t waiters;
+
+	// the number of times to spin before parking
+	uint32_t spin;
+} waithandle;
+
+static bool wh_consume(waithandle* wh)
+{
+	uint32_t notified = 1;
+	return __atomic_compare_exchange_n(&wh->state, &notified, 0, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static uint64_t wh_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// the user pointer is not needed by any of the callbacks below.
+static void* wh_create(void* user)
+{
+	(void)user;
+	waithandle* wh;
+	if (mr_allocate(0, sizeof(waithandle), (void**)&wh) != MR_E_SUCCESS || !wh)
+	{
+		return 0;
+	}
+
+	wh->state = 0;
+	wh->waiters = 0;
+	wh->spin = WH_SPIN_INITIAL;
+	return wh;
+}
+
+static void wh_destroy(void* user, void* handle)
+{
+	(void)user;
+	mr_free(0, handle);
+}
+
+static bool wh_wait(void* user, void* handle, uint32_t timeout)
+{
+	(void)user;
+	waithandle* wh = (waithandle*)handle;
+
+	// spin first and adjust how long to spin next time
+	uint32_t spin = __atomic_load_n(&wh->spin, __ATOMIC_RELAXED);
+	for (uint32_t i = 0; i < spin; i++)
+	{
+		if (__atomic_load_n(&wh->state, __ATOMIC_RELAXED) && wh_consume(wh))
+		{
+			if (spin < WH_SPIN_MAX)
+			{
+				__atomic_store_n(&wh->spin, spin * 2, __ATOMIC_RELAXED);
+			}
+			return true;
+		}
+		wh_relax();
+	}
+
+	if (spin > WH_SPIN_MIN)
+	{
+		__atomic_store_n(&wh->spin, spin / 2, __ATOMIC_RELAXED);
+	}
+
+	// park. The waiter count is raised before the state is checked
+	// again so a notify in between either is seen or wakes us.
+	uint64_t deadline = timeout == 0xffffffff ? 0 : wh_now() + timeout;
+	bool notified = false;
+	__atomic_add_fetch(&wh->waiters, 1, __ATOMIC_SEQ_CST);
+	for (;;)
+	{
+		if (wh_consume(wh))
+		{
+			notified = true;
+			break;
+		}
+
+		struct timespec ts;
+		struct timespec* pts = 0;
+		if (deadline)
+		{
+			uint64_t now = wh_now();
+			if (now >= deadline)
+			{
+				break;
+			}
+
+			uint64_t remaining = deadline - now;
+			ts.tv_sec = (time_t)(remaining / 1000);
+			ts.tv_nsec = (long)(remaining % 1000) * 1000000;
+			pts = &ts;
+		}
+
+		syscall(SYS_futex, &wh->state, FUTEX_WAIT_PRIVATE, 0, pts, 0, 0);
+	}
+	__atomic_sub_fetch(&wh->waiters, 1, __ATOMIC_SEQ_CST);
+
+	return notified;
+}
+
+static void wh_notify(void* user, void* handle)
+{
+	(void)user;
+	waithandle* wh = (waithandle*)handle;
+
+	if (__atomic_exchange_n(&wh->state, 1, __ATOMIC_SEQ_CST) == 0 &&
+		__atomic_load_n(&wh->waiters, __ATOMIC_SEQ_CST))
+	{
+		syscall(SYS_futex, &wh->state, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+	}
+}
+
+mr_result mr_hl_set_default_wait_handles(mr_hl_config* config)
+{
+	FAILIF(!config, MR_E_INVALIDARG, "config must be provided");
+
+	config->create_wait_handle = wh_create;
+	config->destroy_wait_handle = wh_destroy;
+	config->wait = wh_wait;
+	config->notify = wh_notify;
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_hl_loop_set_default_wait_handles(mr_hl_loop_config* config)
+{
+	FAILIF(!config, MR_E_INVALIDARG, "config must be provided");
+
+	config->create_wait_handle = wh_create;
+	config->destroy_wait_handle = wh_destroy;
+	config->wait = wh_wait;
+	config->notify = wh_notify;
+	return MR_E_SUCCESS;
+}
+
+#else
+
+mr_result mr_hl_set_default_wait_handles(mr_hl_config* config)
+{
+	return MR_E_NOTIMPL;
+}
+
+mr_result mr_hl_loop_set_default_wait_handles(mr_hl_loop_config* config)
+{
+	return MR_E_NOTIMPL;
+}
+
+#endif
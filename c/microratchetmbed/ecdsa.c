@@ -88,6 +88,12 @@ mr_result mr_ecdsa_sign(mr_ecdsa_ctx _ctx, const uint8_t* digest, uint32_t diges
 		mbedtls_ctr_drbg_random, &ctx->ctr_drbg);
 }
 
+mr_result mr_ecdsa_precompute(mr_ecdsa_ctx ctx, uint32_t count)
+{
+	// signing nonces are not precomputed with this implementation
+	return MR_E_NOTIMPL;
+}
+
 mr_result mr_ecdsa_verify(mr_ecdsa_ctx _ctx, const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, uint32_t* result)
 {
 	_mr_ecdsa_ctx* ctx = _ctx;
@@ -144,3 +150,56 @@ mr_result mr_ecdsa_verify_other(const uint8_t* signature, uint32_t signaturesize
 	FAILIF(r, MR_E_INVALIDOP, "could not verify the signature");
 	return mrr;
 }
+
+mr_result mr_ecdsa_verify_batch(const uint8_t* const* signatures, const uint8_t* const* digests, const uint8_t* const* publickeys, uint32_t count, uint32_t* results)
+{
+	FAILIF(!signatures || !digests || !publickeys || !results, MR_E_INVALIDARG, "!signatures || !digests || !publickeys || !results");
+
+	// nothing is shared with this implementation
+	for (uint32_t i = 0; i < count; i++)
+	{
+		results[i] = 0;
+		mr_ecdsa_verify_other(signatures[i], 64, digests[i], 32, publickeys[i], 32, &results[i]);
+	}
+
+	return MR_E_SUCCESS;
+}
+
+// this implementation has no way of keeping a prepared public key,
+// so a verifier only holds on to the key.
+typedef struct {
+	mr_ctx mr_ctx;
+	uint8_t publickey[32];
+} _mr_ecdsa_verifier;
+
+mr_ecdsa_verifier mr_ecdsa_verifier_create(mr_ctx mr_ctx, const uint8_t* publickey, uint32_t publickeysize)
+{
+	if (!publickey || publickeysize != 32) return 0;
+
+	_mr_ecdsa_verifier* ctx;
+	mr_result r = mr_allocate(mr_ctx, sizeof(_mr_ecdsa_verifier), (void**)&ctx);
+	if (r != MR_E_SUCCESS) return 0;
+
+	ctx->mr_ctx = mr_ctx;
+	mr_memcpy(ctx->publickey, publickey, 32);
+	return ctx;
+}
+
+mr_result mr_ecdsa_verifier_verify(mr_ecdsa_verifier _ctx, const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, uint32_t* result)
+{
+	_mr_ecdsa_verifier* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "!ctx");
+
+	return mr_ecdsa_verify_other(signature, signaturesize, digest, digestsize, ctx->publickey, 32, result);
+}
+
+void mr_ecdsa_verifier_destroy(mr_ecdsa_verifier _ctx)
+{
+	_mr_ecdsa_verifier* ctx = _ctx;
+	if (ctx)
+	{
+		mr_ctx mrctx = ctx->mr_ctx;
+		mr_memzero(ctx, sizeof(_mr_ecdsa_verifier));
+		mr_free(mrctx, ctx);
+	}
+}
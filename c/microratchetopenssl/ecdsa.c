@@ -1,12 +1,43 @@
 #include "pch.h"
 #include <microratchet.h>
 #include "ecc_common.h"
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
+
+// the most signing nonces kept precomputed
+#define ECDSA_PRECOMPUTED_MAX 16
+
+// the number of signatures a verifier checks before it builds a table of
+// multiples of its public key. Building it costs about as much as 400
+// verifications and makes each one after it close to twice as fast, so
+// it is only worth it for keys that are seen a lot. On x86-64 the table
+// takes about 150 KB.
+#define VERIFIER_TABLE_AFTER 512
 
 typedef struct {
 	mr_ctx mr_ctx;
 	ecc_key key;
+
+	// precomputed k^-1 and r = x(kG) for signing, each used only once,
+	// and the lock protecting them. Only ever kept in memory.
+	BIGNUM* kinv[ECDSA_PRECOMPUTED_MAX];
+	BIGNUM* r[ECDSA_PRECOMPUTED_MAX];
+	uint32_t precomputed;
+	ptrdiff_t lock;
 } _mr_ecdsa_ctx;
 
+static void ecdsa_clear_precomputed(_mr_ecdsa_ctx* ctx)
+{
+	spin_lock(&ctx->lock);
+	while (ctx->precomputed)
+	{
+		ctx->precomputed--;
+		BN_clear_free(ctx->kinv[ctx->precomputed]);
+		BN_clear_free(ctx->r[ctx->precomputed]);
+	}
+	spin_unlock(&ctx->lock);
+}
+
 mr_ecdsa_ctx mr_ecdsa_create(mr_ctx mr_ctx)
 {
 	_mr_ecdsa_ctx* ctx;
@@ -33,6 +64,7 @@ mr_result mr_ecdsa_setprivatekey(mr_ecdsa_ctx _ctx, const uint8_t* privatekey, u
 	FAILIF(!privatekey || !ctx, MR_E_INVALIDARG, "!privatekey || !ctx");
 
 	ecc_key* key = &ctx->key;
+	ecdsa_clear_precomputed(ctx);
 	int result = ecc_load(key, privatekey, privatekeysize);
 	if (result != 0) return result;
 	return MR_E_SUCCESS;
@@ -51,6 +83,7 @@ mr_result mr_ecdsa_generate(mr_ecdsa_ctx _ctx, uint8_t* publickey, uint32_t publ
 {
 	_mr_ecdsa_ctx* ctx = _ctx;
 
+	ecdsa_clear_precomputed(ctx);
 	return ecc_generate(&ctx->key, publickey, publickeyspaceavail);
 }
 
@@ -58,6 +91,7 @@ uint32_t mr_ecdsa_load(mr_ecdsa_ctx _ctx, const uint8_t* data, uint32_t spaceava
 {
 	_mr_ecdsa_ctx* ctx = _ctx;
 	ecc_key* key = &ctx->key;
+	ecdsa_clear_precomputed(ctx);
 	return ecc_load(key, data, spaceavail);
 }
 
@@ -67,7 +101,88 @@ mr_result mr_ecdsa_sign(mr_ecdsa_ctx _ctx, const uint8_t* digest, uint32_t diges
 	FAILIF(!ctx || !digest || !signature, MR_E_INVALIDARG, "!ctx || !digest || !signature");
 	FAILIF(signaturespaceavail < 64, MR_E_INVALIDSIZE, "signaturespaceavail < 64");
 
-	return ecc_sign(&ctx->key, digest, digestsize, signature, signaturespaceavail);
+	// take a precomputed nonce if there is one
+	BIGNUM* kinv = 0;
+	BIGNUM* r = 0;
+	spin_lock(&ctx->lock);
+	if (ctx->precomputed)
+	{
+		ctx->precomputed--;
+		kinv = ctx->kinv[ctx->precomputed];
+		r = ctx->r[ctx->precomputed];
+		ctx->kinv[ctx->precomputed] = 0;
+		ctx->r[ctx->precomputed] = 0;
+	}
+	spin_unlock(&ctx->lock);
+
+	if (!kinv)
+	{
+		return ecc_sign(&ctx->key, digest, digestsize, signature, signaturespaceavail);
+	}
+
+	ECDSA_SIG* sig = ECDSA_do_sign_ex(digest, digestsize, kinv, r, ctx->key.key);
+	BN_clear_free(kinv);
+	BN_clear_free(r);
+
+	// the rare nonce that gives s = 0 fails. Sign the usual way then.
+	if (!sig)
+	{
+		return ecc_sign(&ctx->key, digest, digestsize, signature, signaturespaceavail);
+	}
+
+	const BIGNUM* sr = ECDSA_SIG_get0_r(sig);
+	const BIGNUM* ss = ECDSA_SIG_get0_s(sig);
+	int success = sr && ss;
+
+	if (success) success = BN_bn2binpad(sr, signature, 32);
+	if (success) success = BN_bn2binpad(ss, signature + 32, 32);
+
+	ECDSA_SIG_free(sig);
+
+	FAILIF(!success, MR_E_INVALIDOP, "Failed extract signature");
+	return MR_E_SUCCESS;
+}
+
+mr_result mr_ecdsa_precompute(mr_ecdsa_ctx _ctx, uint32_t count)
+{
+	_mr_ecdsa_ctx* ctx = _ctx;
+	FAILIF(!ctx, MR_E_INVALIDARG, "!ctx");
+	FAILIF(!ctx->key.key, MR_E_INVALIDOP, "!ctx->key.key");
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		spin_lock(&ctx->lock);
+		bool full = ctx->precomputed == ECDSA_PRECOMPUTED_MAX;
+		spin_unlock(&ctx->lock);
+		if (full)
+		{
+			break;
+		}
+
+		// the scalar multiplication happens outside of the lock
+		BIGNUM* kinv = 0;
+		BIGNUM* r = 0;
+		FAILIF(!ECDSA_sign_setup(ctx->key.key, 0, &kinv, &r), MR_E_FAIL, "Could not precompute a signing nonce");
+
+		spin_lock(&ctx->lock);
+		full = ctx->precomputed == ECDSA_PRECOMPUTED_MAX;
+		if (!full)
+		{
+			ctx->kinv[ctx->precomputed] = kinv;
+			ctx->r[ctx->precomputed] = r;
+			ctx->precomputed++;
+		}
+		spin_unlock(&ctx->lock);
+
+		if (full)
+		{
+			BN_clear_free(kinv);
+			BN_clear_free(r);
+			break;
+		}
+	}
+
+	return MR_E_SUCCESS;
 }
 
 uint32_t mr_ecdsa_store_size_needed(mr_ecdsa_ctx _ctx)
@@ -90,6 +205,7 @@ void mr_ecdsa_destroy(mr_ecdsa_ctx ctx)
 	{
 		_mr_ecdsa_ctx* _ctx = (_mr_ecdsa_ctx*)ctx;
 
+		ecdsa_clear_precomputed(_ctx);
 		ecc_free(&_ctx->key);
 
 		mr_ctx mrctx = _ctx->mr_ctx;
@@ -102,3 +218,275 @@ mr_result mr_ecdsa_verify_other(const uint8_t* signature, uint32_t signaturesize
 {
 	return ecc_verify_other(signature, signaturesize, digest, digestsize, publickey, publickeysize, result);
 }
+
+// checks one signature given w = s^-1 mod n: R = (e * w)G + (r * w)Q
+// and the signature is valid if x(R) mod n == r.
+static int ecdsa_verify_with_inverse(const EC_GROUP* group, const BIGNUM* order, const BIGNUM* w, const BIGNUM* r,
+	const uint8_t* digest, const uint8_t* publickey, BN_CTX* bnctx)
+{
+	BN_CTX_start(bnctx);
+	BIGNUM* e = BN_CTX_get(bnctx);
+	BIGNUM* u1 = BN_CTX_get(bnctx);
+	BIGNUM* u2 = BN_CTX_get(bnctx);
+	BIGNUM* x = BN_CTX_get(bnctx);
+	EC_POINT* q = EC_POINT_new(group);
+	EC_POINT* p = EC_POINT_new(group);
+	int valid = 0;
+
+	int success = x && q && p;
+	if (success) success = BN_bin2bn(publickey, 32, x) != 0;
+	if (success) success = EC_POINT_set_compressed_coordinates(group, q, x, 0, bnctx);
+	if (success) success = BN_bin2bn(digest, 32, e) != 0;
+	if (success) success = BN_mod_mul(u1, e, w, order, bnctx);
+	if (success) success = BN_mod_mul(u2, r, w, order, bnctx);
+	if (success) success = EC_POINT_mul(group, p, u1, q, u2, bnctx);
+	if (success) success = !EC_POINT_is_at_infinity(group, p);
+	if (success) success = EC_POINT_get_affine_coordinates(group, p, x, 0, bnctx);
+	if (success) success = BN_nnmod(x, x, order, bnctx);
+	if (success) valid = BN_cmp(x, r) == 0;
+
+	if (q) EC_POINT_free(q);
+	if (p) EC_POINT_free(p);
+	BN_CTX_end(bnctx);
+	return valid;
+}
+
+mr_result mr_ecdsa_verify_batch(const uint8_t* const* signatures, const uint8_t* const* digests, const uint8_t* const* publickeys, uint32_t count, uint32_t* results)
+{
+	FAILIF(!signatures || !digests || !publickeys || !results, MR_E_INVALIDARG, "!signatures || !digests || !publickeys || !results");
+	if (!count) return MR_E_SUCCESS;
+
+	// r, s and the running products of the s values for each signature
+	BIGNUM** bn;
+	mr_result mrr = mr_allocate(0, (int)(count * 3 * sizeof(BIGNUM*)), (void**)&bn);
+	if (mrr) return mrr;
+	mr_memzero(bn, count * 3 * sizeof(BIGNUM*));
+	BIGNUM** rs = bn;
+	BIGNUM** ss = bn + count;
+	BIGNUM** products = bn + count * 2;
+
+	EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+	BN_CTX* bnctx = BN_CTX_new();
+	BIGNUM* inverse = BN_new();
+	BIGNUM* w = BN_new();
+	const BIGNUM* order = group ? EC_GROUP_get0_order(group) : 0;
+	int success = group && bnctx && inverse && w && order;
+
+	// signatures with r or s out of range are invalid. They take part
+	// in the shared inversion with s = 1 so the others are unaffected.
+	for (uint32_t i = 0; success && i < count; i++)
+	{
+		rs[i] = BN_bin2bn(signatures[i], 32, 0);
+		ss[i] = BN_bin2bn(signatures[i] + 32, 32, 0);
+		products[i] = BN_new();
+		success = rs[i] && ss[i] && products[i];
+		results[i] = success &&
+			!BN_is_zero(rs[i]) && BN_cmp(rs[i], order) < 0 &&
+			!BN_is_zero(ss[i]) && BN_cmp(ss[i], order) < 0;
+		if (success && !results[i]) success = BN_one(ss[i]);
+		if (success) success = i == 0
+			? BN_copy(products[i], ss[i]) != 0
+			: BN_mod_mul(products[i], products[i - 1], ss[i], order, bnctx);
+	}
+
+	// Montgomery's trick: one inversion of the product of all s values,
+	// then each inverse is peeled off going backwards.
+	if (success) success = BN_mod_inverse(inverse, products[count - 1], order, bnctx) != 0;
+	for (uint32_t i = count; success && i-- > 0;)
+	{
+		if (i == 0) success = BN_copy(w, inverse) != 0;
+		else success = BN_mod_mul(w, inverse, products[i - 1], order, bnctx);
+		if (success && i > 0) success = BN_mod_mul(inverse, inverse, ss[i], order, bnctx);
+		if (success && results[i])
+		{
+			results[i] = ecdsa_verify_with_inverse(group, order, w, rs[i], digests[i], publickeys[i], bnctx);
+		}
+	}
+
+	for (uint32_t i = 0; i < count * 3; i++)
+	{
+		if (bn[i]) BN_free(bn[i]);
+	}
+	mr_free(0, bn);
+	if (w) BN_free(w);
+	if (inverse) BN_free(inverse);
+	if (bnctx) BN_CTX_free(bnctx);
+	if (group) EC_GROUP_free(group);
+
+	FAILIF(!success, MR_E_NOMEM, "Failed to verify signatures");
+	return MR_E_SUCCESS;
+}
+
+typedef struct {
+	mr_ctx mr_ctx;
+	EC_KEY* key;
+
+	// a group with the public key as its generator and its multiples
+	// precomputed, once enough signatures were verified. The lock
+	// protects it and the count.
+	EC_GROUP* table;
+	uint32_t verified;
+	ptrdiff_t lock;
+} _mr_ecdsa_verifier;
+
+// builds a group with the public key as generator and precomputes
+// multiples of it, so u2 * Q takes point additions only.
+static EC_GROUP* verifier_build_table(const EC_KEY* key)
+{
+	const EC_GROUP* group = EC_KEY_get0_group(key);
+	EC_GROUP* table = EC_GROUP_dup(group);
+	BN_CTX* bnctx = BN_CTX_new();
+	int success = table && bnctx;
+	if (success) success = EC_GROUP_set_generator(table, EC_KEY_get0_public_key(key), EC_GROUP_get0_order(group), EC_GROUP_get0_cofactor(group));
+	if (success) success = EC_GROUP_precompute_mult(table, bnctx);
+
+	if (bnctx) BN_CTX_free(bnctx);
+	if (!success && table)
+	{
+		EC_GROUP_free(table);
+		table = 0;
+	}
+	return table;
+}
+
+// checks a signature with the table: R = (e * w)G + (r * w)Q where
+// w = s^-1 mod n, and the signature is valid if x(R) mod n == r.
+static int verifier_verify_table(const EC_KEY* key, const EC_GROUP* table, const uint8_t* signature, const uint8_t* digest, int* valid)
+{
+	const EC_GROUP* group = EC_KEY_get0_group(key);
+	const BIGNUM* order = EC_GROUP_get0_order(group);
+	BN_CTX* bnctx = BN_CTX_new();
+	if (!bnctx) return 0;
+
+	BN_CTX_start(bnctx);
+	BIGNUM* r = BN_CTX_get(bnctx);
+	BIGNUM* s = BN_CTX_get(bnctx);
+	BIGNUM* e = BN_CTX_get(bnctx);
+	BIGNUM* w = BN_CTX_get(bnctx);
+	BIGNUM* u1 = BN_CTX_get(bnctx);
+	BIGNUM* u2 = BN_CTX_get(bnctx);
+	EC_POINT* p = EC_POINT_new(group);
+	EC_POINT* q = EC_POINT_new(table);
+	*valid = 0;
+
+	int success = u2 && p && q;
+	if (success) success = BN_bin2bn(signature, 32, r) && BN_bin2bn(signature + 32, 32, s) && BN_bin2bn(digest, 32, e);
+	if (success &&
+		!BN_is_zero(r) && BN_cmp(r, order) < 0 &&
+		!BN_is_zero(s) && BN_cmp(s, order) < 0)
+	{
+		success = BN_mod_inverse(w, s, order, bnctx) != 0;
+		if (success) success = BN_mod_mul(u1, e, w, order, bnctx);
+		if (success) success = BN_mod_mul(u2, r, w, order, bnctx);
+		if (success) success = EC_POINT_mul(group, p, u1, 0, 0, bnctx);
+		if (success) success = EC_POINT_mul(table, q, u2, 0, 0, bnctx);
+		if (success) success = EC_POINT_add(group, p, p, q, bnctx);
+		if (success && !EC_POINT_is_at_infinity(group, p))
+		{
+			success = EC_POINT_get_affine_coordinates(group, p, w, 0, bnctx);
+			if (success) success = BN_nnmod(w, w, order, bnctx);
+			if (success) *valid = BN_cmp(w, r) == 0;
+		}
+	}
+
+	if (p) EC_POINT_free(p);
+	if (q) EC_POINT_free(q);
+	BN_CTX_end(bnctx);
+	BN_CTX_free(bnctx);
+	return success;
+}
+
+mr_ecdsa_verifier mr_ecdsa_verifier_create(mr_ctx mr_ctx, const uint8_t* publickey, uint32_t publickeysize)
+{
+	if (!publickey || publickeysize != 32) return 0;
+
+	_mr_ecdsa_verifier* ctx;
+	mr_result r = mr_allocate(mr_ctx, sizeof(_mr_ecdsa_verifier), (void**)&ctx);
+	if (r != MR_E_SUCCESS) return 0;
+
+	mr_memzero(ctx, sizeof(_mr_ecdsa_verifier));
+	ctx->mr_ctx = mr_ctx;
+
+	// decompress the point once and keep it in a key ready for verifying
+	ecc_point p = { 0 };
+	r = ecc_new_point(&p);
+	if (r == MR_E_SUCCESS) r = ecc_import_public(publickey, publickeysize, &p);
+	if (r == MR_E_SUCCESS)
+	{
+		ctx->key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+		if (!ctx->key || !EC_KEY_set_public_key(ctx->key, p.point)) r = MR_E_INVALIDOP;
+	}
+	if (p.point) ecc_free_point(&p);
+
+	if (r != MR_E_SUCCESS)
+	{
+		mr_ecdsa_verifier_destroy(ctx);
+		return 0;
+	}
+
+	return ctx;
+}
+
+mr_result mr_ecdsa_verifier_verify(mr_ecdsa_verifier _ctx, const uint8_t* signature, uint32_t signaturesize, const uint8_t* digest, uint32_t digestsize, uint32_t* result)
+{
+	_mr_ecdsa_verifier* ctx = _ctx;
+	FAILIF(!ctx || !digest || !signature, MR_E_INVALIDARG, "!ctx || !digest || !signature");
+	FAILIF(signaturesize != 64, MR_E_INVALIDSIZE, "signaturesize != 64");
+	FAILIF(digestsize != 32, MR_E_INVALIDSIZE, "digestsize != 32");
+
+	// the table is built outside of the lock by whoever gets to the count
+	spin_lock(&ctx->lock);
+	EC_GROUP* table = ctx->table;
+	bool build = !table && ++ctx->verified == VERIFIER_TABLE_AFTER;
+	spin_unlock(&ctx->lock);
+	if (build)
+	{
+		table = verifier_build_table(ctx->key);
+		spin_lock(&ctx->lock);
+		ctx->table = table;
+		spin_unlock(&ctx->lock);
+	}
+
+	if (table)
+	{
+		int valid = 0;
+		FAILIF(!verifier_verify_table(ctx->key, table, signature, digest, &valid), MR_E_INVALIDOP, "Failed to verify");
+		if (result) *result = valid;
+		return MR_E_SUCCESS;
+	}
+
+	BIGNUM* r = BN_bin2bn(signature, 32, 0);
+	BIGNUM* s = BN_bin2bn(signature + 32, 32, 0);
+	ECDSA_SIG* sig = ECDSA_SIG_new();
+	int success = r && s && sig;
+
+	if (success) success = ECDSA_SIG_set0(sig, r, s);
+	if (success)
+	{
+		r = s = 0;
+		success = ECDSA_do_verify(digest, digestsize, sig, ctx->key);
+		if (result && success >= 0) *result = success;
+		success = success >= 0;
+	}
+
+	if (r) BN_free(r);
+	if (s) BN_free(s);
+	if (sig) ECDSA_SIG_free(sig);
+
+	FAILIF(!success, MR_E_INVALIDOP, "Failed to verify");
+	return MR_E_SUCCESS;
+}
+
+void mr_ecdsa_verifier_destroy(mr_ecdsa_verifier _ctx)
+{
+	_mr_ecdsa_verifier* ctx = _ctx;
+	if (ctx)
+	{
+		if (ctx->key) EC_KEY_free(ctx->key);
+		if (ctx->table) EC_GROUP_free(ctx->table);
+
+		mr_ctx mrctx = ctx->mr_ctx;
+		mr_memzero(ctx, sizeof(_mr_ecdsa_verifier));
+		mr_free(mrctx, ctx);
+	}
+}
@@ -1,7 +1,12 @@
 #include "pch.h"
 #include <microratchet.h>
+#include <internal.h>
 #include "support.h"
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <array>
 
 template<size_t T>
 static uint8_t emptybuffer[T] = {};
@@ -205,6 +210,643 @@ TEST(Context, MultiMessagesServerClientNoReply) {
 	ASSERT_BUFFEREQ(msg3, sizeof(msg3), payload, sizeof(msg3));
 }
 
+TEST(Context, Cookie) {
+	TEST_PREAMBLE;
+	uint8_t cookiekey[32] = { 1, 2, 3 };
+	uint8_t newcookiekey[32] = { 4, 5, 6 };
+	((_mr_ctx*)server)->config.cookie_key = cookiekey;
+
+	constexpr uint32_t size = MR_MAX_INITIALIZATION_MESSAGE_SIZE + MR_COOKIE_SIZE;
+	uint8_t msg[size] = {};
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(client, msg, size, false));
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+
+	// the server keeps nothing until the client comes back
+	EXPECT_EQ(nullptr, ((_mr_ctx*)server)->init.server);
+	EXPECT_EQ(nullptr, ((_mr_ctx*)server)->ratchet);
+
+	// and the cookie is still good after the key changed
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(client, msg, size, size, nullptr, 0));
+	((_mr_ctx*)server)->config.cookie_key = newcookiekey;
+	((_mr_ctx*)server)->config.previous_cookie_key = cookiekey;
+	uint8_t first[size];
+	memcpy(first, msg, size);
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, msg, size, size, nullptr, 0));
+
+	uint8_t data[64] = {};
+	uint8_t* payload = nullptr;
+	uint32_t payloadsize = 0;
+	data[0] = 5;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, data, 16, sizeof(data)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, data, sizeof(data), sizeof(data), &payload, &payloadsize));
+	EXPECT_EQ(5, payload[0]);
+
+	// tampered cookies and cookies made with keys no longer in use are not recognized
+	mr_config othercfg{ false };
+	othercfg.cookie_key = newcookiekey;
+	othercfg.previous_cookie_key = cookiekey;
+	auto other = mr_ctx_create(&othercfg);
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_set_identity(other, serveridentity, false));
+	memcpy(msg, first, size);
+	msg[size - 20] ^= 1;
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive(other, msg, size, size, nullptr, 0));
+	((_mr_ctx*)other)->config.previous_cookie_key = nullptr;
+	memcpy(msg, first, size);
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive(other, msg, size, size, nullptr, 0));
+	EXPECT_EQ(nullptr, ((_mr_ctx*)other)->init.server);
+	mr_ctx_destroy(other);
+}
+
+TEST(Context, CookieBound) {
+	TEST_PREAMBLE;
+	uint8_t cookiekey[32] = { 1, 2, 3 };
+	const uint8_t peer[] = { 10, 0, 0, 1 };
+	const uint8_t otherpeer[] = { 10, 0, 0, 2 };
+	uint32_t now = 1000;
+	auto cfg = &((_mr_ctx*)server)->config;
+	cfg->cookie_key = cookiekey;
+	cfg->cookie_peer = peer;
+	cfg->cookie_peer_size = sizeof(peer);
+	cfg->cookie_clock = [](void* user) { return *(uint32_t*)user; };
+	cfg->cookie_clock_user = &now;
+
+	constexpr uint32_t size = MR_MAX_INITIALIZATION_MESSAGE_SIZE + MR_COOKIE_SIZE;
+	uint8_t msg[size] = {};
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(client, msg, size, false));
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(client, msg, size, size, nullptr, 0));
+	uint8_t first[size];
+	memcpy(first, msg, size);
+
+	// the cookie is not accepted from another peer
+	cfg->cookie_peer = otherpeer;
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+	EXPECT_EQ(nullptr, ((_mr_ctx*)server)->init.server);
+
+	// or once it is too old
+	cfg->cookie_peer = peer;
+	now += 31;
+	memcpy(msg, first, size);
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+	EXPECT_EQ(nullptr, ((_mr_ctx*)server)->init.server);
+	cfg->cookie_lifetime = 60;
+	memcpy(msg, first, size);
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, msg, size, size, nullptr, 0));
+
+	uint8_t data[64] = {};
+	uint8_t* payload = nullptr;
+	uint32_t payloadsize = 0;
+	data[0] = 5;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, data, 16, sizeof(data)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, data, sizeof(data), sizeof(data), &payload, &payloadsize));
+	EXPECT_EQ(5, payload[0]);
+}
+
+TEST(Context, VerifierCache) {
+	TEST_PREAMBLE;
+
+	auto handshake = [&]()
+	{
+		constexpr uint32_t size = MR_MAX_INITIALIZATION_MESSAGE_SIZE;
+		uint8_t msg[size] = {};
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(client, msg, size, true));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(client, msg, size, size, nullptr, 0));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, msg, size, size, nullptr, 0));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, msg, size, size, nullptr, 0));
+	};
+
+	// with room for both keys the second handshake finds them. With
+	// room for one they keep pushing each other out.
+	for (uint32_t capacity = 1; capacity <= 2; capacity++)
+	{
+		auto cache = (_mr_verifier_cache*)mr_verifier_cache_create(capacity);
+		ASSERT_NE(nullptr, cache);
+		((_mr_ctx*)client)->config.verifier_cache = cache;
+		((_mr_ctx*)server)->config.verifier_cache = cache;
+
+		handshake();
+		handshake();
+		EXPECT_EQ(capacity == 2 ? 2u : 0u, cache->hits);
+		EXPECT_EQ(capacity == 2 ? 2u : 4u, cache->misses);
+		EXPECT_EQ(capacity, cache->count);
+
+		((_mr_ctx*)client)->config.verifier_cache = nullptr;
+		((_mr_ctx*)server)->config.verifier_cache = nullptr;
+		mr_verifier_cache_destroy(cache);
+	}
+}
+
+TEST(Context, ReceiveVerified) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	// several messages, some with new ECDH parameters, all
+	// checked before any of them is received
+	constexpr int nummessages = 6;
+	uint8_t msgs[nummessages][32];
+	uint8_t buffs[nummessages][128] = {};
+	uint8_t keys[nummessages][32] = {};
+	mr_result verified[nummessages];
+	for (int i = 0; i < nummessages; i++)
+	{
+		mr_rng_generate(rng, msgs[i], sizeof(msgs[i]));
+		memcpy(buffs[i], msgs[i], sizeof(msgs[i]));
+		uint32_t size = i % 2 ? 64 : sizeof(buffs[i]);
+		EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, buffs[i], sizeof(msgs[i]), size));
+	}
+
+	for (int i = 0; i < nummessages; i++)
+	{
+		uint32_t size = i % 2 ? 64 : sizeof(buffs[i]);
+		verified[i] = mr_ctx_receive_verify(server, buffs[i], size, keys[i], sizeof(keys[i]));
+	}
+	EXPECT_EQ(MR_E_SUCCESS, verified[0]);
+
+	for (int i = 0; i < nummessages; i++)
+	{
+		uint8_t* payload = 0;
+		uint32_t payloadsize = 0;
+		uint32_t size = i % 2 ? 64 : sizeof(buffs[i]);
+		EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive_verified(server, buffs[i], size, size, keys[i], sizeof(keys[i]), &payload, &payloadsize));
+		ASSERT_BUFFEREQ(msgs[i], sizeof(msgs[i]), payload, sizeof(msgs[i]));
+	}
+
+	// a corrupted message is not recognized
+	uint8_t buff[64] = {};
+	uint8_t key[32];
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, buff, 16, sizeof(buff)));
+	uint8_t good[64];
+	memcpy(good, buff, sizeof(buff));
+	buff[40] ^= 1;
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive_verify(server, buff, sizeof(buff), key, sizeof(key)));
+
+	// nor is it received with the header key of a message that was fine
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive_verify(server, good, sizeof(good), key, sizeof(key)));
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive_verified(server, buff, sizeof(buff), sizeof(buff), key, sizeof(key), &payload, &payloadsize));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive_verified(server, good, sizeof(good), sizeof(good), key, sizeof(key), &payload, &payloadsize));
+}
+
+TEST(Context, SendToAndGather) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	RANDOMDATA(msg1, 32);
+	RANDOMDATA(msg2, 40);
+	uint8_t original1[sizeof(msg1)];
+	uint8_t original2[sizeof(msg2)];
+	memcpy(original1, msg1, sizeof(msg1));
+	memcpy(original2, msg2, sizeof(msg2));
+
+	uint8_t buff[128] = {};
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+
+	// the payload is left as is and ends up in the message
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send_to(client, msg1, sizeof(msg1), buff, sizeof(buff)));
+	ASSERT_BUFFEREQ(original1, sizeof(original1), msg1, sizeof(msg1));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, buff, sizeof(buff), sizeof(buff), &payload, &payloadsize));
+	ASSERT_BUFFEREQ(msg1, sizeof(msg1), payload, sizeof(msg1));
+	for (uint32_t i = sizeof(msg1); i < payloadsize; i++)
+	{
+		EXPECT_EQ(0, payload[i]);
+	}
+
+	// fragments are joined in order, including ones that cross
+	// the block boundaries of the cipher
+	mr_iovec fragments[] = { { msg2, 5 }, { msg2 + 5, 0 }, { msg2 + 5, 17 }, { msg2 + 22, 18 } };
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send_gather(server, fragments, 4, buff, 64));
+	ASSERT_BUFFEREQ(original2, sizeof(original2), msg2, sizeof(msg2));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, buff, 64, 64, &payload, &payloadsize));
+	ASSERT_BUFFEREQ(msg2, sizeof(msg2), payload, sizeof(msg2));
+
+	// too little space
+	EXPECT_EQ(MR_E_INVALIDSIZE, mr_ctx_send_to(client, msg1, sizeof(msg1), buff, sizeof(msg1) + 8));
+}
+
+TEST(Context, SendMulti) {
+	TEST_PREAMBLE;
+
+	// one server with sessions to several clients
+	constexpr uint32_t numsessions = 5;
+	mr_ctx servers[numsessions];
+	mr_ctx clients[numsessions];
+	for (uint32_t i = 0; i < numsessions; i++)
+	{
+		mr_config scfg{ false };
+		mr_config ccfg{ true };
+		servers[i] = mr_ctx_create(&scfg);
+		clients[i] = mr_ctx_create(&ccfg);
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_set_identity(servers[i], serveridentity, false));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_set_identity(clients[i], clientidentity, false));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(clients[i], buffer, buffersize, false));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(servers[i], buffer, buffersize, buffersize, nullptr, 0));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(clients[i], buffer, buffersize, buffersize, nullptr, 0));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(servers[i], buffer, buffersize, buffersize, nullptr, 0));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(clients[i], buffer, buffersize, buffersize, nullptr, 0));
+	}
+	run_on_exit _b{[&] {
+		for (uint32_t i = 0; i < numsessions; i++)
+		{
+			mr_ctx_destroy(servers[i]);
+			mr_ctx_destroy(clients[i]);
+		}
+	}};
+
+	RANDOMDATA(msg, 100);
+	uint8_t messages[numsessions][160];
+	uint8_t* outputs[numsessions];
+	mr_result results[numsessions];
+	for (uint32_t i = 0; i < numsessions; i++) outputs[i] = messages[i];
+
+	auto parallel = [](void* user, parallel_work_fn work, void* arg, uint32_t count)
+	{
+		std::vector<std::thread> threads;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			threads.emplace_back(work, arg, i);
+		}
+		for (auto& t : threads) t.join();
+	};
+
+	for (int round = 0; round < 2; round++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send_multi(servers, numsessions, msg, sizeof(msg), outputs, sizeof(messages[0]),
+			results, round ? (parallel_fn)parallel : nullptr, nullptr));
+		for (uint32_t i = 0; i < numsessions; i++)
+		{
+			EXPECT_EQ(MR_E_SUCCESS, results[i]);
+			uint8_t* payload = 0;
+			uint32_t payloadsize = 0;
+			EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(clients[i], messages[i], sizeof(messages[i]), sizeof(messages[i]), &payload, &payloadsize));
+			ASSERT_BUFFEREQ(msg, sizeof(msg), payload, sizeof(msg));
+		}
+	}
+
+	// a session that fails does not stop the others
+	mr_config cfg{ false };
+	auto uninitialized = mr_ctx_create(&cfg);
+	mr_ctx mixed[2] = { servers[0], uninitialized };
+	EXPECT_EQ(MR_E_INVALIDOP, mr_ctx_send_multi(mixed, 2, msg, sizeof(msg), outputs, sizeof(messages[0]), results, nullptr, nullptr));
+	EXPECT_EQ(MR_E_SUCCESS, results[0]);
+	EXPECT_EQ(MR_E_INVALIDOP, results[1]);
+	mr_ctx_destroy(uninitialized);
+}
+
+TEST(Context, Peek) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	mr_peek_info info;
+	uint8_t msgs[3][32] = {};
+	for (int i = 0; i < 3; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msgs[i], 16, sizeof(msgs[i])));
+	}
+
+	// the last one is three ahead and peeking leaves it as is
+	uint8_t copy[32];
+	memcpy(copy, msgs[2], sizeof(copy));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_peek(server, msgs[2], 32, &info));
+	EXPECT_FALSE(info.initialization);
+	EXPECT_FALSE(info.has_ecdh);
+	EXPECT_FALSE(info.ecdh_ratchet);
+	EXPECT_FALSE(info.lost);
+	EXPECT_EQ(3, info.gap);
+	uint32_t generation = info.generation;
+	ASSERT_BUFFEREQ(copy, sizeof(copy), msgs[2], sizeof(copy));
+
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[2], 32, 32, &payload, &payloadsize));
+
+	// the first one is behind but can still be received. Once
+	// received its key is gone.
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_peek(server, msgs[0], 32, &info));
+	EXPECT_FALSE(info.lost);
+	EXPECT_EQ(generation - 2, info.generation);
+	EXPECT_EQ(-2, info.gap);
+	memcpy(copy, msgs[0], sizeof(copy));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[0], 32, 32, &payload, &payloadsize));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_peek(server, copy, 32, &info));
+	EXPECT_TRUE(info.lost);
+	EXPECT_TRUE(info.replay);
+
+	// new ECDH parameters start a new chain
+	uint8_t ecdh[64] = {};
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, ecdh, 16, sizeof(ecdh)));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_peek(server, ecdh, sizeof(ecdh), &info));
+	EXPECT_TRUE(info.has_ecdh);
+	EXPECT_TRUE(info.ecdh_ratchet);
+	EXPECT_EQ(1, info.gap);
+
+	// not recognized
+	uint8_t garbage[32] = { 1 };
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_peek(server, garbage, sizeof(garbage), &info));
+}
+
+TEST(Context, Replay) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	uint8_t msgs[3][32] = {};
+	uint8_t copies[3][32];
+	for (int i = 0; i < 3; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msgs[i], 16, sizeof(msgs[i])));
+		memcpy(copies[i], msgs[i], sizeof(copies[i]));
+	}
+
+	// out of order is fine but every message is only received once
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[2], 32, 32, &payload, &payloadsize));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[0], 32, 32, &payload, &payloadsize));
+	memcpy(msgs[2], copies[2], sizeof(copies[2]));
+	EXPECT_EQ(MR_E_REPLAY, mr_ctx_receive(server, msgs[2], 32, 32, &payload, &payloadsize));
+	memcpy(msgs[0], copies[0], sizeof(copies[0]));
+	EXPECT_EQ(MR_E_REPLAY, mr_ctx_receive(server, msgs[0], 32, 32, &payload, &payloadsize));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[1], 32, 32, &payload, &payloadsize));
+	memcpy(msgs[1], copies[1], sizeof(copies[1]));
+	EXPECT_EQ(MR_E_REPLAY, mr_ctx_receive(server, msgs[1], 32, 32, &payload, &payloadsize));
+
+	// the window is kept across storing and loading the state
+	uint8_t storage[2048];
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_state_store(server, storage, sizeof(storage)));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_state_load(server, storage, sizeof(storage), nullptr));
+	memcpy(msgs[1], copies[1], sizeof(copies[1]));
+	EXPECT_EQ(MR_E_REPLAY, mr_ctx_receive(server, msgs[1], 32, 32, &payload, &payloadsize));
+
+	// a message that falls out of the window is rejected
+	uint8_t old[32] = {};
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, old, 16, sizeof(old)));
+	uint8_t buff[32];
+	for (int i = 0; i < MR_REPLAY_WINDOW; i++)
+	{
+		memset(buff, 0, sizeof(buff));
+		EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(client, buff, 16, sizeof(buff)));
+	}
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, buff, 32, 32, &payload, &payloadsize));
+	EXPECT_EQ(MR_E_REPLAY, mr_ctx_receive(server, old, 32, 32, &payload, &payloadsize));
+}
+
+TEST(Context, CatchUp) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+	((_mr_ctx*)server)->config.kdf_budget = 50;
+
+	constexpr int count = 300;
+	std::vector<std::array<uint8_t, 32>> msgs(count);
+	for (auto& msg : msgs)
+	{
+		msg.fill(0);
+		msg[0] = 7;
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msg.data(), 16, 32));
+	}
+
+	// too far ahead. The chain moves closer and the message is left as is.
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	std::array<uint8_t, 32> copy = msgs[count - 1];
+	EXPECT_EQ(MR_E_PENDING, mr_ctx_receive(server, msgs[count - 1].data(), 32, 32, &payload, &payloadsize));
+	EXPECT_TRUE(copy == msgs[count - 1]);
+
+	uint32_t outstanding = 0;
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_catchup(server, 0, &outstanding));
+	EXPECT_EQ(count - 51U, outstanding);
+	uint32_t after = 0;
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_catchup(server, 100, &after));
+	EXPECT_EQ(outstanding - 100, after);
+
+	int tries = 0;
+	mr_result result;
+	while ((result = mr_ctx_receive(server, msgs[count - 1].data(), 32, 32, &payload, &payloadsize)) == MR_E_PENDING)
+	{
+		tries++;
+	}
+	EXPECT_EQ(MR_E_SUCCESS, result);
+	EXPECT_EQ((int)(after - 1) / 50, tries);
+	EXPECT_EQ(7, payload[0]);
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_catchup(server, 0, &outstanding));
+	EXPECT_EQ(0U, outstanding);
+
+	// skipped messages in the window can still be received
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[count - 20].data(), 32, 32, &payload, &payloadsize));
+	EXPECT_EQ(7, payload[0]);
+
+	// beyond the maximum gap a message is rejected outright
+	((_mr_ctx*)server)->config.max_gap = 100;
+	for (auto& msg : msgs)
+	{
+		msg.fill(0);
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msg.data(), 16, 32));
+	}
+	EXPECT_EQ(MR_E_INVALIDOP, mr_ctx_receive(server, msgs[count - 1].data(), 32, 32, &payload, &payloadsize));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_catchup(server, 0, &outstanding));
+	EXPECT_EQ(0U, outstanding);
+}
+
+TEST(Context, LazySendingChain) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	const uint8_t zeroes[KEY_SIZE] = {};
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	_mr_ratchet_state* last = 0;
+	for (int round = 0; round < 2; round++)
+	{
+		// receiving new ECDH parameters leaves the sending chain for later
+		uint8_t msg[64] = {};
+		msg[0] = 3;
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msg, 16, sizeof(msg)));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msg, sizeof(msg), sizeof(msg), &payload, &payloadsize));
+		ratchet_getlast(server, &last);
+		ASSERT_TRUE(last);
+		EXPECT_TRUE(last->sendingpending);
+		EXPECT_EQ(0, memcmp(zeroes, last->sendingchain.chainkey, KEY_SIZE));
+
+		if (round == 0)
+		{
+			// and survives storing and loading the state
+			uint8_t storage[4096];
+			EXPECT_EQ(MR_E_SUCCESS, mr_ctx_state_store(server, storage, sizeof(storage)));
+			EXPECT_EQ(MR_E_SUCCESS, mr_ctx_state_load(server, storage, sizeof(storage), nullptr));
+			ratchet_getlast(server, &last);
+			EXPECT_TRUE(last->sendingpending);
+		}
+		else
+		{
+			EXPECT_EQ(MR_E_SUCCESS, mr_ctx_precompute(server));
+			EXPECT_FALSE(last->sendingpending);
+			EXPECT_NE(0, memcmp(zeroes, last->sendingchain.chainkey, KEY_SIZE));
+		}
+
+		// either way the other side can read what is sent next
+		uint8_t reply[64] = {};
+		reply[0] = 4;
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(server, reply, 16, sizeof(reply)));
+		EXPECT_FALSE(last->sendingpending);
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, reply, sizeof(reply), sizeof(reply), &payload, &payloadsize));
+		EXPECT_EQ(4, payload[0]);
+	}
+}
+
+TEST(Context, Transaction) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	// a few round trips so the server keeps as many ratchet steps
+	// as it can and the next one drops the oldest.
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		uint8_t msg[64] = {};
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msg, 16, sizeof(msg)));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msg, sizeof(msg), sizeof(msg), &payload, &payloadsize));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(server, msg, 16, sizeof(msg)));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, msg, sizeof(msg), sizeof(msg), &payload, &payloadsize));
+	}
+
+	uint8_t msgs[2][64] = {};
+	uint8_t copies[2][64];
+	for (int i = 0; i < 2; i++)
+	{
+		msgs[i][0] = (uint8_t)(i + 1);
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msgs[i], 16, sizeof(msgs[i])));
+		memcpy(copies[i], msgs[i], sizeof(copies[i]));
+	}
+
+	// rolling back leaves the state exactly as it was
+	uint8_t before[4096] = {};
+	uint8_t after[4096] = {};
+	uint32_t size = mr_ctx_state_size_needed(server);
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_state_store(server, before, sizeof(before)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_begin(server));
+	EXPECT_EQ(MR_E_INVALIDOP, mr_ctx_begin(server));
+	for (auto& msg : msgs)
+	{
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msg, sizeof(msg), sizeof(msg), &payload, &payloadsize));
+	}
+	uint8_t reply[64] = {};
+	EXPECT_EQ(MR_E_INVALIDOP, mr_ctx_send(server, reply, 16, sizeof(reply)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_rollback(server));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_state_store(server, after, sizeof(after)));
+	EXPECT_EQ(size, mr_ctx_state_size_needed(server));
+	EXPECT_EQ(0, memcmp(before, after, size));
+
+	// so the same messages can be received again and kept
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_begin(server));
+	for (int i = 0; i < 2; i++)
+	{
+		memcpy(msgs[i], copies[i], sizeof(msgs[i]));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msgs[i], sizeof(msgs[i]), sizeof(msgs[i]), &payload, &payloadsize));
+		EXPECT_EQ(i + 1, payload[0]);
+	}
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_commit(server));
+	EXPECT_EQ(MR_E_INVALIDOP, mr_ctx_rollback(server));
+
+	reply[0] = 9;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(server, reply, 16, sizeof(reply)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, reply, sizeof(reply), sizeof(reply), &payload, &payloadsize));
+	EXPECT_EQ(9, payload[0]);
+}
+
+TEST(Context, TransactionFirstMessage) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	uint8_t msg[64] = {};
+	uint8_t copy[64];
+	msg[0] = 5;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(client, msg, 16, sizeof(msg)));
+	memcpy(copy, msg, sizeof(copy));
+
+	// the first message would free the server initialization state. Rolling
+	// back has to keep it and the state as it was.
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	uint8_t before[4096] = {};
+	uint8_t after[4096] = {};
+	uint32_t size = mr_ctx_state_size_needed(server);
+	ASSERT_NE(nullptr, ((_mr_ctx*)server)->init.server);
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_state_store(server, before, sizeof(before)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_begin(server));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msg, sizeof(msg), sizeof(msg), &payload, &payloadsize));
+	EXPECT_NE(nullptr, ((_mr_ctx*)server)->init.server);
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_rollback(server));
+	EXPECT_NE(nullptr, ((_mr_ctx*)server)->init.server);
+	ASSERT_EQ(size, mr_ctx_state_size_needed(server));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_state_store(server, after, sizeof(after)));
+	EXPECT_EQ(0, memcmp(before, after, size));
+
+	// receiving it again and committing frees it
+	memcpy(msg, copy, sizeof(msg));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_begin(server));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(server, msg, sizeof(msg), sizeof(msg), &payload, &payloadsize));
+	EXPECT_EQ(5, payload[0]);
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_commit(server));
+	EXPECT_EQ(nullptr, ((_mr_ctx*)server)->init.server);
+
+	uint8_t reply[64] = {};
+	reply[0] = 6;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send(server, reply, 16, sizeof(reply)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, reply, sizeof(reply), sizeof(reply), &payload, &payloadsize));
+	EXPECT_EQ(6, payload[0]);
+}
+
+TEST(Context, Stream) {
+	TEST_PREAMBLE_CLIENT_SERVER;
+
+	constexpr uint32_t streamsize = 100000;
+	std::vector<uint8_t> data(streamsize);
+	mr_rng_generate(rng, data.data(), streamsize);
+
+	// encrypt in pieces of varying size
+	uint8_t header[MR_STREAM_HEADER_SIZE];
+	std::vector<uint8_t> encrypted(streamsize);
+	uint8_t mac[MR_STREAM_MAC_SIZE];
+	mr_stream_ctx stream = 0;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send_begin(client, &stream, header, sizeof(header)));
+	for (uint32_t offset = 0, piece = 1; offset < streamsize; offset += piece, piece = piece * 3 + 1)
+	{
+		piece = std::min(piece, streamsize - offset);
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send_update(stream, data.data() + offset, piece, encrypted.data() + offset, piece));
+	}
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send_final(stream, mac, sizeof(mac)));
+	EXPECT_NE(0, memcmp(data.data(), encrypted.data(), streamsize));
+
+	// decrypt in place in pieces of another size
+	std::vector<uint8_t> decrypted = encrypted;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive_begin(server, &stream, header, sizeof(header)));
+	for (uint32_t offset = 0; offset < streamsize; offset += 4096)
+	{
+		uint32_t piece = std::min(4096u, streamsize - offset);
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive_update(stream, decrypted.data() + offset, piece, decrypted.data() + offset, piece));
+	}
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive_final(stream, mac, sizeof(mac)));
+	EXPECT_TRUE(data == decrypted);
+
+	// the header can not be replayed
+	EXPECT_EQ(MR_E_NOTFOUND, mr_ctx_receive_begin(server, &stream, header, sizeof(header)));
+
+	// a modified stream is rejected
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send_begin(client, &stream, header, sizeof(header)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send_update(stream, data.data(), streamsize, encrypted.data(), streamsize));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_send_final(stream, mac, sizeof(mac)));
+	encrypted[streamsize / 2] ^= 1;
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive_begin(server, &stream, header, sizeof(header)));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive_update(stream, encrypted.data(), streamsize, decrypted.data(), streamsize));
+	EXPECT_EQ(MR_E_VERIFYFAIL, mr_ctx_receive_final(stream, mac, sizeof(mac)));
+
+	// the stream does not disturb ordinary messages
+	RANDOMDATA(msg, 32);
+	uint8_t buff[64] = {};
+	uint8_t* payload = 0;
+	uint32_t payloadsize = 0;
+	memcpy(buff, msg, sizeof(msg));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_send(server, buff, sizeof(msg), sizeof(buff)));
+	EXPECT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, buff, sizeof(buff), sizeof(buff), &payload, &payloadsize));
+	ASSERT_BUFFEREQ(msg, sizeof(msg), payload, sizeof(msg));
+}
+
 TEST(Context, MultiMessages) {
 	TEST_PREAMBLE_CLIENT_SERVER;
 
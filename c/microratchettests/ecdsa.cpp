@@ -93,6 +93,166 @@ TEST(Ecdsa, VerifyOther) {
 	mr_ctx_destroy(mr_ctx);
 }
 
+TEST(Ecdsa, SignPrecomputed) {
+	uint8_t pubkey[32];
+	uint8_t signature[64];
+	uint8_t previous[64]{};
+	const uint8_t digest[32] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	};
+
+	auto mr_ctx = mr_ctx_create(&_cfg);
+	auto ecdsa = mr_ecdsa_create(mr_ctx);
+	int result = mr_ecdsa_generate(ecdsa, pubkey, SIZEOF(pubkey));
+	EXPECT_EQ(MR_E_SUCCESS, result);
+
+	result = mr_ecdsa_precompute(ecdsa, 4);
+	EXPECT_TRUE(result == MR_E_SUCCESS || result == MR_E_NOTIMPL);
+
+	// the precomputed nonces are used up and then signing goes on
+	// as usual. No nonce may be used twice.
+	for (int i = 0; i < 6; i++)
+	{
+		result = mr_ecdsa_sign(ecdsa, digest, SIZEOF(digest), signature, SIZEOF(signature));
+		EXPECT_EQ(MR_E_SUCCESS, result);
+		EXPECT_NE(0, memcmp(signature, previous, 32));
+		memcpy(previous, signature, sizeof(signature));
+
+		uint32_t res = 0;
+		result = mr_ecdsa_verify_other(signature, SIZEOF(signature), digest, SIZEOF(digest), pubkey, SIZEOF(pubkey), &res);
+		EXPECT_EQ(MR_E_SUCCESS, result);
+		EXPECT_EQ(1u, res);
+	}
+
+	// asking for more than can be kept is fine
+	result = mr_ecdsa_precompute(ecdsa, 100);
+	EXPECT_TRUE(result == MR_E_SUCCESS || result == MR_E_NOTIMPL);
+
+	mr_ecdsa_destroy(ecdsa);
+	mr_ctx_destroy(mr_ctx);
+}
+
+TEST(Ecdsa, Verifier) {
+	uint8_t pubkey[32];
+	uint8_t signature[64];
+	const uint8_t digest[32] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	};
+
+	auto mr_ctx = mr_ctx_create(&_cfg);
+	auto ecdsa = mr_ecdsa_create(mr_ctx);
+	EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_generate(ecdsa, pubkey, SIZEOF(pubkey)));
+	auto verifier = mr_ecdsa_verifier_create(mr_ctx, pubkey, SIZEOF(pubkey));
+	ASSERT_NE(nullptr, verifier);
+
+	for (int i = 0; i < 3; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_sign(ecdsa, digest, SIZEOF(digest), signature, SIZEOF(signature)));
+		uint32_t res = 0;
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verifier_verify(verifier, signature, SIZEOF(signature), digest, SIZEOF(digest), &res));
+		EXPECT_EQ(1u, res);
+
+		signature[i] ^= 1;
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verifier_verify(verifier, signature, SIZEOF(signature), digest, SIZEOF(digest), &res));
+		EXPECT_EQ(0u, res);
+	}
+
+	mr_ecdsa_verifier_destroy(verifier);
+	mr_ecdsa_destroy(ecdsa);
+	mr_ctx_destroy(mr_ctx);
+}
+
+TEST(Ecdsa, VerifierManySignatures) {
+	uint8_t pubkey[32];
+	uint8_t signatures[4][64];
+	uint8_t digests[4][32];
+
+	auto mr_ctx = mr_ctx_create(&_cfg);
+	auto ecdsa = mr_ecdsa_create(mr_ctx);
+	EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_generate(ecdsa, pubkey, SIZEOF(pubkey)));
+	for (int i = 0; i < 4; i++)
+	{
+		memset(digests[i], i + 1, sizeof(digests[i]));
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_sign(ecdsa, digests[i], SIZEOF(digests[i]), signatures[i], SIZEOF(signatures[i])));
+	}
+	auto verifier = mr_ecdsa_verifier_create(mr_ctx, pubkey, SIZEOF(pubkey));
+	ASSERT_NE(nullptr, verifier);
+
+	// verifiers may change how they verify after a while. The results may not.
+	uint8_t zeroes[64] = {};
+	for (int i = 0; i < 1200; i++)
+	{
+		uint32_t res = 2;
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verifier_verify(verifier, signatures[i % 4], 64, digests[i % 4], 32, &res));
+		EXPECT_EQ(1u, res);
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verifier_verify(verifier, signatures[i % 4], 64, digests[(i + 1) % 4], 32, &res));
+		EXPECT_EQ(0u, res);
+	}
+	uint32_t res = 2;
+	EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verifier_verify(verifier, zeroes, 64, digests[0], 32, &res));
+	EXPECT_EQ(0u, res);
+
+	mr_ecdsa_verifier_destroy(verifier);
+	mr_ecdsa_destroy(ecdsa);
+	mr_ctx_destroy(mr_ctx);
+}
+
+TEST(Ecdsa, VerifyBatch) {
+	constexpr int count = 5;
+	uint8_t pubkeys[2][32];
+	uint8_t signatures[count][64];
+	uint8_t digests[count][32];
+	const uint8_t* psignatures[count];
+	const uint8_t* pdigests[count];
+	const uint8_t* ppubkeys[count];
+	uint32_t results[count];
+
+	auto mr_ctx = mr_ctx_create(&_cfg);
+	mr_ecdsa_ctx ecdsa[2] = { mr_ecdsa_create(mr_ctx), mr_ecdsa_create(mr_ctx) };
+	auto rng = mr_rng_create(mr_ctx);
+	for (int i = 0; i < 2; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_generate(ecdsa[i], pubkeys[i], SIZEOF(pubkeys[i])));
+	}
+	for (int i = 0; i < count; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_rng_generate(rng, digests[i], SIZEOF(digests[i])));
+		EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_sign(ecdsa[i % 2], digests[i], SIZEOF(digests[i]), signatures[i], SIZEOF(signatures[i])));
+		psignatures[i] = signatures[i];
+		pdigests[i] = digests[i];
+		ppubkeys[i] = pubkeys[i % 2];
+	}
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verify_batch(psignatures, pdigests, ppubkeys, count, results));
+	for (int i = 0; i < count; i++)
+	{
+		EXPECT_EQ(1u, results[i]);
+	}
+
+	// bad entries do not affect the others
+	signatures[1][40] ^= 1;
+	digests[2][0] ^= 1;
+	ppubkeys[3] = pubkeys[0];
+	memset(signatures[4] + 32, 0, 32);
+	EXPECT_EQ(MR_E_SUCCESS, mr_ecdsa_verify_batch(psignatures, pdigests, ppubkeys, count, results));
+	EXPECT_EQ(1u, results[0]);
+	EXPECT_EQ(0u, results[1]);
+	EXPECT_EQ(0u, results[2]);
+	EXPECT_EQ(0u, results[3]);
+	EXPECT_EQ(0u, results[4]);
+
+	mr_rng_destroy(rng);
+	mr_ecdsa_destroy(ecdsa[0]);
+	mr_ecdsa_destroy(ecdsa[1]);
+	mr_ctx_destroy(mr_ctx);
+}
+
 void test_verify_ecdsa(const uint8_t* pubkey, uint32_t sizeofpubkey,
 	const uint8_t* digest, uint32_t sizeofdigest,
 	const uint8_t* signature, uint32_t sizeofsignature)
@@ -6,10 +6,13 @@
 
 #include <condition_variable>
 #include <mutex>
-#include <queue>
+#include <deque>
 #include <functional>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
 using namespace std::chrono_literals;
 
 template<size_t T>
@@ -66,6 +69,13 @@ struct buffer
 		o.length = 0;
 	}
 
+	buffer& operator=(buffer&& o)
+	{
+		std::swap(data, o.data);
+		std::swap(length, o.length);
+		return *this;
+	}
+
 	~buffer()
 	{
 		if (data)
@@ -120,6 +130,7 @@ public:
 private:
 	void* create_wait_handle()
 	{
+		wait_handles_created++;
 		auto mtx = new notifier();
 		return mtx;
 	}
@@ -147,17 +158,43 @@ private:
 		if (other)
 		{
 			TRACEMSGCTX(ctx, "++++transmit");
+			transmits++;
+			if (amount > largest_transmit)
+			{
+				largest_transmit = amount;
+			}
+			if (drop_transmits > 0)
+			{
+				// lost in flight
+				drop_transmits--;
+				return amount;
+			}
+
 			uint8_t* newdata = new uint8_t[amount];
 			memcpy(newdata, data, amount);
 			std::thread tmp([=]()
 				{
 					std::this_thread::sleep_for(std::chrono::milliseconds(data_flight_time));
+					if (other->receive_buffer)
+					{
+						// hand over the buffer instead of copying it
+						mr_hl_receive_buffer(other->ctx, newdata, amount, amount, _release_buffer, other, 5000);
+						return;
+					}
+					if (other->receive_data)
+					{
+						mr_hl_receive_data(other->ctx, newdata, amount, 5000);
+						delete[] newdata;
+						return;
+					}
 					{
 						std::lock_guard<std::mutex> mtx(other->mutex);
-						other->queue.emplace(newdata, amount);
+						other->queue.emplace_back(newdata, amount);
 						TRACEMSGCTX(other->ctx, "++++receive");
 					}
-					mr_hl_receive(other->ctx, amount, 5000);
+					// when receiving in batches the receiver reports the actual
+					// size so it can be given the largest buffer needed
+					mr_hl_receive(other->ctx, other->batched ? MR_MAX_INITIALIZATION_MESSAGE_SIZE : amount, 5000);
 					delete[] newdata;
 				});
 			tmp.detach();
@@ -169,13 +206,46 @@ private:
 		}
 	}
 
+	uint32_t transmit_batch(const mr_iovec* messages, uint32_t count)
+	{
+		transmit_batch_calls++;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (transmit(messages[i].data, messages[i].size) != messages[i].size)
+			{
+				return i;
+			}
+		}
+		return count;
+	}
+
+	uint32_t receive_batch(mr_iovec* messages, uint32_t count)
+	{
+		receive_batch_calls++;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t amount = receive(messages[i].data, messages[i].size);
+			if (amount > messages[i].size)
+			{
+				return i;
+			}
+			messages[i].size = amount;
+		}
+		return count;
+	}
+
 	uint32_t receive(uint8_t* data, uint32_t amount)
 	{
 		if (other)
 		{
 			std::lock_guard<std::mutex> mtx(mutex);
-			buffer buff = std::move(queue.front());
-			queue.pop();
+			// transmissions race each other so take the oldest
+			// message of the size expected if there is one
+			auto it = queue.begin();
+			while (it != queue.end() && it->length != amount) ++it;
+			if (it == queue.end()) it = queue.begin();
+			buffer buff = std::move(*it);
+			queue.erase(it);
 			if (buff.length <= amount)
 			{
 				memcpy(data, buff.data, buff.length);
@@ -221,7 +291,7 @@ public:
 
 	mr_hl_config config(uint32_t message_quantization = 32, uint32_t ecdh_frequency = 4)
 	{
-		mr_hl_config cfg;
+		mr_hl_config cfg{};
 
 		cfg.user = this;
 
@@ -237,6 +307,31 @@ public:
 		cfg.message_quantization = message_quantization;
 		cfg.ecdh_frequency = ecdh_frequency;
 
+		if (batched)
+		{
+			cfg.transmit_batch = HighLevel::_transmit_batch;
+			cfg.receive_batch = HighLevel::_receive_batch;
+		}
+
+		cfg.now = HighLevel::_now;
+		cfg.coalesce_threshold = coalesce_threshold;
+		cfg.coalesce_delay = coalesce_delay;
+		cfg.initialize_retry = initialize_retry;
+		cfg.keepalive_interval = keepalive_interval;
+
+		cfg.pipeline_depth = pipeline_depth;
+		cfg.mtu = mtu;
+		cfg.reassembly_slots = reassembly_slots;
+		if (parallel)
+		{
+			cfg.parallel = HighLevel::_parallel;
+		}
+
+		if (default_wait_handles)
+		{
+			EXPECT_EQ(MR_E_SUCCESS, mr_hl_set_default_wait_handles(&cfg));
+		}
+
 		return cfg;
 	}
 
@@ -249,6 +344,22 @@ public:
 				mr_hl_mainloop(ctx, &cfg);
 			});
 		_sleep(1);
+
+		if (pipeline_depth)
+		{
+			// the transmit loop needs the main loop to be running
+			while (!reinterpret_cast<_mr_ctx*>(ctx)->highlevel) _sleep(1);
+			transmit_thread = std::thread([=]()
+				{
+					EXPECT_EQ(MR_E_SUCCESS, mr_hl_transmitloop(ctx));
+				});
+		}
+	}
+
+	void attach(mr_hl_loop loop)
+	{
+		auto cfg = this->config();
+		ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, ctx, &cfg));
 	}
 
 	void wait()
@@ -257,6 +368,10 @@ public:
 		{
 			thread.join();
 		}
+		if (transmit_thread.joinable())
+		{
+			transmit_thread.join();
+		}
 	}
 
 public:
@@ -273,6 +388,22 @@ private:
 	static void _notify(void* user, void* wh) { ((HighLevel*)user)->notify(wh); }
 	static uint32_t _transmit(void* user, const uint8_t* data, uint32_t amount) { return ((HighLevel*)user)->transmit(data, amount); }
 	static uint32_t _receive(void* user, uint8_t* data, uint32_t amount) { return ((HighLevel*)user)->receive(data, amount); }
+	static uint32_t _transmit_batch(void* user, const mr_iovec* messages, uint32_t count) { return ((HighLevel*)user)->transmit_batch(messages, count); }
+	static uint32_t _receive_batch(void* user, mr_iovec* messages, uint32_t count) { return ((HighLevel*)user)->receive_batch(messages, count); }
+	static void _parallel(void* user, parallel_work_fn work, void* arg, uint32_t count)
+	{
+		((HighLevel*)user)->parallel_calls++;
+		std::vector<std::thread> workers;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			workers.emplace_back(work, arg, i);
+		}
+		for (auto& w : workers)
+		{
+			w.join();
+		}
+	}
+	static uint32_t _now(void*) { return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
 	static void _data_callback(void* user, const uint8_t* data, uint32_t amount) { ((HighLevel*)user)->data_callback(data, amount); }
 	static bool _checkkey_callback(void* user, const uint8_t* pubkey, uint32_t len) { return ((HighLevel*)user)->checkkey_callback(pubkey, len); }
 
@@ -280,11 +411,39 @@ private:
 	HighLevel(const HighLevel&) = delete;
 	HighLevel(const HighLevel&&) = delete;
 
+public:
+	std::atomic<uint32_t> wait_handles_created{ 0 };
+	std::atomic<uint32_t> transmit_batch_calls{ 0 };
+	std::atomic<uint32_t> receive_batch_calls{ 0 };
+	std::atomic<uint32_t> transmits{ 0 };
+	bool batched = false;
+	uint32_t coalesce_threshold = 0;
+	uint32_t coalesce_delay = 0;
+	uint32_t initialize_retry = 0;
+	uint32_t keepalive_interval = 0;
+	bool default_wait_handles = false;
+	uint32_t pipeline_depth = 0;
+	bool receive_data = false;
+	bool receive_buffer = false;
+	uint32_t mtu = 0;
+	uint32_t reassembly_slots = 0;
+	std::atomic<uint32_t> largest_transmit{ 0 };
+	std::atomic<uint32_t> buffers_released{ 0 };
+	bool parallel = false;
+	std::atomic<uint32_t> parallel_calls{ 0 };
+	std::atomic<uint32_t> drop_transmits{ 0 };
+	std::atomic<uint32_t> high_watermarks{ 0 };
+	std::atomic<uint32_t> low_watermarks{ 0 };
+
+	static void _queue_watermark(void* user, bool high) { (high ? ((HighLevel*)user)->high_watermarks : ((HighLevel*)user)->low_watermarks)++; }
+	static void _release_buffer(void* user, uint8_t* data) { delete[] data; ((HighLevel*)user)->buffers_released++; }
+
 private:
 	std::mutex mutex;
 	HighLevel* other;
-	std::queue<buffer> queue;
+	std::deque<buffer> queue;
 	std::thread thread;
+	std::thread transmit_thread;
 	mr_ctx ctx;
 	uint32_t data_flight_time;
 
@@ -399,6 +558,43 @@ TEST(HighLevel, SendReceive)
 	b.wait();
 }
 
+TEST(HighLevel, SendReceiveZeroes)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	mr_hl_initialize(client, 1000000);
+
+	// without keepalives a payload of zeroes is data like any other
+	static constexpr size_t msgsize = 32;
+	uint8_t message[msgsize] = {};
+	std::atomic<bool> received{ false };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_GE(a, msgsize);
+			EXPECT_BUFFEREQ(d, msgsize, message, msgsize);
+			received = true;
+		});
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, message, sizeof(message), 1000));
+	for (int i = 0; i < 100 && !received; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_TRUE(received);
+
+	std::this_thread::sleep_for(100ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
 TEST(HighLevel, SendReceive2)
 {
 	TEST_PREAMBLE;
@@ -509,4 +705,996 @@ TEST(HighLevel, SendReceiveSlow)
 	b.wait();
 }
 
-#endif
\ No newline at end of file
+TEST(HighLevel, SendReceiveManyRecyclesWaitHandles)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	mr_hl_initialize(client, 1000000);
+
+	bool client_initialized;
+	mr_ctx_is_initialized(client, &client_initialized);
+	EXPECT_TRUE(client_initialized);
+
+	static constexpr size_t msgsize = 100;
+	static constexpr int nummessages = 50;
+	uint8_t message[msgsize];
+	auto rng = mr_rng_create(client);
+	mr_rng_generate(rng, message, sizeof(message));
+	mr_rng_destroy(rng);
+
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_GE(a, msgsize);
+			EXPECT_BUFFEREQ(d, msgsize, message, msgsize);
+			received++;
+		});
+
+	uint32_t wait_handles_before = a.wait_handles_created;
+	for (int i = 0; i < nummessages; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, message, sizeof(message), 1000));
+	}
+
+	for (int i = 0; i < 500 && received < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received);
+
+	// blocking sends reuse their wait handles
+	EXPECT_LE(a.wait_handles_created - wait_handles_before, 1u);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, SendReceiveBatched)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.batched = true;
+	b.batched = true;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	mr_hl_initialize(client, 1000000);
+
+	bool client_initialized;
+	mr_ctx_is_initialized(client, &client_initialized);
+	EXPECT_TRUE(client_initialized);
+
+	static constexpr size_t msgsize = 100;
+	static constexpr int nummessages = 50;
+	uint8_t message[msgsize];
+	auto rng = mr_rng_create(client);
+	mr_rng_generate(rng, message, sizeof(message));
+	mr_rng_destroy(rng);
+
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_GE(a, msgsize);
+			EXPECT_BUFFEREQ(d, msgsize, message, msgsize);
+			received++;
+		});
+
+	for (int i = 0; i < nummessages; i++)
+	{
+		EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+	}
+
+	for (int i = 0; i < 500 && received < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received);
+	EXPECT_GT(a.transmit_batch_calls, 0u);
+	EXPECT_LE(a.transmit_batch_calls, (uint32_t)nummessages);
+	EXPECT_GT(b.receive_batch_calls, 0u);
+	EXPECT_LE(b.receive_batch_calls, (uint32_t)nummessages);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, SendReceiveCoalesced)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.coalesce_threshold = b.coalesce_threshold = 200;
+	a.coalesce_delay = b.coalesce_delay = 20;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	mr_hl_initialize(client, 1000000);
+
+	bool client_initialized;
+	mr_ctx_is_initialized(client, &client_initialized);
+	EXPECT_TRUE(client_initialized);
+
+	// payload i is i + 1 bytes of the value i
+	static constexpr int nummessages = 40;
+	std::atomic<int> received[nummessages]{};
+	std::atomic<int> received_total{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			ASSERT_GT(a, 0u);
+			ASSERT_LE(a, (uint32_t)nummessages);
+			for (uint32_t i = 0; i < a; i++)
+			{
+				EXPECT_EQ(a - 1, d[i]);
+			}
+			received[a - 1]++;
+			received_total++;
+		});
+
+	uint32_t transmits_before = a.transmits;
+	for (int i = 0; i < nummessages; i++)
+	{
+		uint8_t message[nummessages];
+		memset(message, i, sizeof(message));
+		EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, i + 1, 0));
+	}
+
+	for (int i = 0; i < 500 && received_total < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received_total);
+	for (int i = 0; i < nummessages; i++)
+	{
+		EXPECT_EQ(1, received[i]);
+	}
+
+	// 40 payloads totalling 820 bytes fit in a handful of messages
+	EXPECT_LE(a.transmits - transmits_before, 8u);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, SendReceivePipelined)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.pipeline_depth = b.pipeline_depth = 4;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+
+	static constexpr int nummessages = 50;
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_EQ(7, d[0]);
+			received++;
+		});
+
+	// a blocking send completes once the message is transmitted
+	uint8_t message[32]{ 7 };
+	uint32_t transmits_before = a.transmits;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, message, sizeof(message), 1000));
+	EXPECT_EQ(transmits_before + 1, a.transmits);
+
+	for (int i = 1; i < nummessages; i++)
+	{
+		EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+	}
+
+	for (int i = 0; i < 500 && received < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, SendReceiveParallelVerify)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	b.receive_data = true;
+	b.parallel = true;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+
+	// hold up the first message so the rest queue up behind it
+	static constexpr int nummessages = 60;
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_EQ(7, d[0]);
+			if (received++ == 0)
+			{
+				std::this_thread::sleep_for(200ms);
+			}
+		});
+
+	uint8_t message[32]{ 7 };
+	for (int i = 0; i < nummessages; i++)
+	{
+		EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+	}
+
+	for (int i = 0; i < 500 && received < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received);
+	EXPECT_GT(b.parallel_calls, 0u);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, SendReceiveBuffer)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	b.receive_buffer = true;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+
+	static constexpr int nummessages = 20;
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_EQ(9, d[0]);
+			received++;
+		});
+
+	uint8_t message[32]{ 9 };
+	uint32_t transmits_before = a.transmits;
+	for (int i = 0; i < nummessages; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, message, sizeof(message), 1000));
+	}
+
+	for (int i = 0; i < 500 && received < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received);
+
+	// every buffer handed over is given back, including those that
+	// had to be copied during initialization
+	for (int i = 0; i < 100 && b.buffers_released < a.transmits; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ((uint32_t)a.transmits, (uint32_t)b.buffers_released);
+	EXPECT_GE((uint32_t)a.transmits - transmits_before, (uint32_t)nummessages);
+
+	// the buffer is given back when it can not be queued
+	uint8_t* rejected = new uint8_t[16];
+	EXPECT_EQ(MR_E_INVALIDARG, mr_hl_receive_buffer(server, rejected, 16, 8, HighLevel::_release_buffer, &b, 0));
+	EXPECT_EQ((uint32_t)a.transmits + 1, (uint32_t)b.buffers_released);
+
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, SendReceiveFragmented)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.mtu = b.mtu = 100;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+	a.largest_transmit = 0;
+
+	// larger payloads are split up into fragments
+	// and put back together in one piece
+	std::vector<std::vector<uint8_t>> received;
+	std::mutex mtx;
+	b.data_callback_function([&](auto d, auto a)
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			received.emplace_back(d, d + a);
+		});
+
+	std::vector<uint8_t> small(10, 1);
+	std::vector<uint8_t> large(1000);
+	for (size_t i = 0; i < large.size(); i++) large[i] = (uint8_t)i;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, small.data(), (uint32_t)small.size(), 1000));
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, large.data(), (uint32_t)large.size(), 1000));
+
+	for (int i = 0; i < 200; i++)
+	{
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			if (received.size() == 2) break;
+		}
+		std::this_thread::sleep_for(10ms);
+	}
+
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		ASSERT_EQ(2u, received.size());
+		EXPECT_TRUE(received[0] == small || received[1] == small);
+		EXPECT_TRUE(received[0] == large || received[1] == large);
+	}
+	EXPECT_LE((uint32_t)a.largest_transmit, 96u);
+
+	mr_hl_stats stats;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_get_stats(client, &stats));
+	EXPECT_EQ(2u, stats.messages_sent);
+	EXPECT_EQ(1010u, stats.payload_bytes_sent);
+	EXPECT_GE(stats.messages_transmitted, 1u + 1000u / 74u);
+	EXPECT_GT(stats.bytes_transmitted, stats.payload_bytes_sent);
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_get_stats(server, &stats));
+	EXPECT_EQ(2u, stats.messages_received);
+	EXPECT_EQ(1010u, stats.payload_bytes_received);
+
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, FragmentLost)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.mtu = b.mtu = 100;
+	b.reassembly_slots = 1;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+
+	std::atomic<uint32_t> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_EQ(500u, a);
+			EXPECT_EQ(2, d[0]);
+			received++;
+		});
+
+	// the first fragment of the first message is lost. The
+	// second message still arrives and pushes out the first.
+	uint8_t first[500]{ 1 };
+	uint8_t second[500]{ 2 };
+	a.drop_transmits = 1;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, first, sizeof(first), 1000));
+	std::this_thread::sleep_for(200ms);
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, second, sizeof(second), 1000));
+
+	for (int i = 0; i < 200 && received < 1; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(1u, received);
+
+	mr_hl_stats stats;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_get_stats(server, &stats));
+	EXPECT_EQ(1u, stats.messages_dropped);
+
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, CatchUp)
+{
+	TEST_PREAMBLE;
+	((_mr_ctx*)server)->config.kdf_budget = 20;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+
+	std::atomic<uint32_t> received{ 0 };
+	b.data_callback_function([&](auto d, auto a)
+		{
+			EXPECT_EQ(2, d[0]);
+			received++;
+		});
+
+	// the message after a long run of lost ones is parked
+	// until the chain has caught up with it.
+	uint8_t lost[32]{ 1 };
+	uint8_t arrives[32]{ 2 };
+	a.drop_transmits = 100;
+	for (int i = 0; i < 100; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, lost, sizeof(lost), 1000));
+	}
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, arrives, sizeof(arrives), 1000));
+
+	for (int i = 0; i < 200 && received < 1; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(1u, received);
+
+	mr_hl_stats stats;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_get_stats(server, &stats));
+	EXPECT_EQ(0u, stats.messages_parked);
+	EXPECT_EQ(0u, stats.catchup_outstanding);
+
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, InitializationRetried)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.initialize_retry = 50;
+	a.drop_transmits = 2;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 5000));
+
+	bool client_initialized;
+	mr_ctx_is_initialized(client, &client_initialized);
+	EXPECT_TRUE(client_initialized);
+	EXPECT_GE(a.transmits, 3u);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+TEST(HighLevel, KeepaliveWhenIdle)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.keepalive_interval = 50;
+	b.keepalive_interval = 1000;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	mr_hl_initialize(client, 1000000);
+
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a) { received++; });
+
+	// keepalives go out while idle but are not seen as data
+	uint32_t transmits_before = a.transmits;
+	std::this_thread::sleep_for(400ms);
+	EXPECT_GE(a.transmits - transmits_before, 3u);
+	EXPECT_EQ(0, received);
+
+	// and data still gets through
+	uint8_t message[] = { 1, 2, 3 };
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, message, sizeof(message), 1000));
+	for (int i = 0; i < 100 && received == 0; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(1, received);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+static mr_hl_loop_config loop_config()
+{
+	mr_hl_loop_config loopcfg{};
+	loopcfg.create_wait_handle = [](void*) -> void* { return new notifier(); };
+	loopcfg.destroy_wait_handle = [](void*, void* wh) { delete reinterpret_cast<notifier*>(wh); };
+	loopcfg.wait = [](void*, void* wh, uint32_t timeout) { return reinterpret_cast<notifier*>(wh)->wait(timeout); };
+	loopcfg.notify = [](void*, void* wh) { reinterpret_cast<notifier*>(wh)->notify(); };
+	return loopcfg;
+}
+
+TEST(HighLevel, LoopMultiplexesContexts)
+{
+	static constexpr int numpairs = 4;
+	static constexpr int numthreads = 2;
+	static constexpr int nummessages = 10;
+	static constexpr size_t msgsize = 32;
+
+	auto loopcfg = loop_config();
+	auto loop = mr_hl_loop_create(&loopcfg);
+	ASSERT_NE(nullptr, loop);
+
+	std::thread threads[numthreads];
+	for (auto& t : threads)
+	{
+		t = std::thread([loop]() { EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_run(loop)); });
+	}
+
+	mr_config clientcfg{ true };
+	mr_config servercfg{ false };
+	mr_ctx contexts[numpairs * 2];
+	mr_ecdsa_ctx identities[numpairs * 2];
+	std::unique_ptr<HighLevel> highlevels[numpairs * 2];
+	std::atomic<int> received[numpairs]{};
+	uint8_t message[msgsize];
+	for (int i = 0; i < numpairs * 2; i++)
+	{
+		contexts[i] = mr_ctx_create(i % 2 ? &servercfg : &clientcfg);
+		identities[i] = mr_ecdsa_create(contexts[i]);
+		uint8_t pubkey[32];
+		ASSERT_EQ(MR_E_SUCCESS, mr_ecdsa_generate(identities[i], pubkey, sizeof(pubkey)));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_set_identity(contexts[i], identities[i], false));
+		highlevels[i].reset(new HighLevel(contexts[i]));
+	}
+
+	auto rng = mr_rng_create(contexts[0]);
+	mr_rng_generate(rng, message, sizeof(message));
+	mr_rng_destroy(rng);
+
+	for (int i = 0; i < numpairs; i++)
+	{
+		HighLevel::connect(*highlevels[i * 2], *highlevels[i * 2 + 1]);
+		highlevels[i * 2 + 1]->data_callback_function([&, i](auto d, auto a)
+			{
+				EXPECT_GE(a, msgsize);
+				EXPECT_BUFFEREQ(d, msgsize, message, msgsize);
+				received[i]++;
+			});
+		highlevels[i * 2]->attach(loop);
+		highlevels[i * 2 + 1]->attach(loop);
+	}
+
+	for (int i = 0; i < numpairs; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(contexts[i * 2], 10000));
+	}
+
+	for (int i = 0; i < numpairs; i++)
+	{
+		for (int j = 0; j < nummessages; j++)
+		{
+			EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(contexts[i * 2], message, sizeof(message), 1000));
+		}
+	}
+
+	for (int i = 0; i < numpairs; i++)
+	{
+		for (int j = 0; j < 500 && received[i] < nummessages; j++)
+		{
+			std::this_thread::sleep_for(10ms);
+		}
+		EXPECT_EQ(nummessages, received[i]);
+	}
+
+	std::this_thread::sleep_for(300ms);
+	for (int i = 0; i < numpairs * 2; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_deactivate(contexts[i], 1000));
+	}
+
+	mr_hl_loop_stop(loop);
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	mr_hl_loop_destroy(loop);
+
+	for (int i = 0; i < numpairs * 2; i++)
+	{
+		mr_ctx_destroy(contexts[i]);
+		mr_ecdsa_destroy(identities[i]);
+	}
+}
+
+TEST(HighLevel, LoopHoldsBackHandshakes)
+{
+	TEST_PREAMBLE;
+
+	static uint32_t now = 1000;
+	auto loopcfg = loop_config();
+	loopcfg.now = [](void*) { return now; };
+	loopcfg.handshake_queue = 1;
+	loopcfg.handshake_rate = 1;
+	loopcfg.handshake_burst = 2;
+	auto loop = mr_hl_loop_create(&loopcfg);
+	ASSERT_NE(nullptr, loop);
+
+	std::atomic<uint32_t> transmits{ 0 };
+	mr_hl_config cfg{};
+	cfg.user = &transmits;
+	cfg.create_wait_handle = loopcfg.create_wait_handle;
+	cfg.destroy_wait_handle = loopcfg.destroy_wait_handle;
+	cfg.wait = loopcfg.wait;
+	cfg.notify = loopcfg.notify;
+	cfg.transmit = [](void* user, const uint8_t*, uint32_t amount) { (*(std::atomic<uint32_t>*)user)++; return amount; };
+	cfg.checkkey_callback = [](void*, const uint8_t*, uint32_t) { return true; };
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, server, &cfg));
+
+	uint8_t request[256];
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(client, request, sizeof(request), true));
+	auto receive = [&](int count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_receive_data(server, request, sizeof(request), 0));
+		}
+		uint32_t timeout;
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_poll(loop, &timeout));
+	};
+
+	// one fits in the queue, the others are dropped
+	receive(3);
+	mr_hl_stats stats;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_get_stats(server, &stats));
+	EXPECT_EQ(1u, transmits);
+	EXPECT_EQ(0u, stats.handshakes_queued);
+	EXPECT_EQ(2u, stats.handshakes_shed);
+
+	// the burst allows one more, then the rate runs out until time passes
+	receive(1);
+	receive(1);
+	EXPECT_EQ(2u, transmits);
+	now += 1000;
+	receive(1);
+	EXPECT_EQ(3u, transmits);
+
+	mr_hl_loop_stats loopstats;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_get_stats(loop, &loopstats));
+	EXPECT_EQ(0u, loopstats.handshakes_queued);
+	EXPECT_EQ(3u, loopstats.handshakes_shed);
+
+	mr_hl_loop_destroy(loop);
+}
+
+TEST(HighLevel, LoopVerifiesHandshakesTogether)
+{
+	static constexpr int numpairs = 3;
+
+	auto loopcfg = loop_config();
+	loopcfg.handshake_queue = numpairs;
+	auto loop = mr_hl_loop_create(&loopcfg);
+	ASSERT_NE(nullptr, loop);
+
+	std::atomic<uint32_t> transmits{ 0 };
+	mr_hl_config cfg{};
+	cfg.user = &transmits;
+	cfg.create_wait_handle = loopcfg.create_wait_handle;
+	cfg.destroy_wait_handle = loopcfg.destroy_wait_handle;
+	cfg.wait = loopcfg.wait;
+	cfg.notify = loopcfg.notify;
+	cfg.transmit = [](void* user, const uint8_t*, uint32_t amount) { (*(std::atomic<uint32_t>*)user)++; return amount; };
+	cfg.checkkey_callback = [](void*, const uint8_t*, uint32_t) { return true; };
+
+	mr_config clientcfg{ true };
+	mr_config servercfg{ false };
+	mr_ctx contexts[numpairs * 2];
+	mr_ecdsa_ctx identities[numpairs * 2];
+	for (int i = 0; i < numpairs * 2; i++)
+	{
+		contexts[i] = mr_ctx_create(i % 2 ? &servercfg : &clientcfg);
+		identities[i] = mr_ecdsa_create(contexts[i]);
+		uint8_t pubkey[32];
+		ASSERT_EQ(MR_E_SUCCESS, mr_ecdsa_generate(identities[i], pubkey, sizeof(pubkey)));
+		ASSERT_EQ(MR_E_SUCCESS, mr_ctx_set_identity(contexts[i], identities[i], true));
+	}
+
+	// the requests are all held back and then processed in one go
+	for (int i = 0; i < numpairs; i++)
+	{
+		uint8_t request[256];
+		ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, contexts[i * 2 + 1], &cfg));
+		ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(contexts[i * 2], request, sizeof(request), true));
+		EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_receive_data(contexts[i * 2 + 1], request, sizeof(request), 0));
+	}
+
+	uint32_t timeout;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_poll(loop, &timeout));
+	EXPECT_EQ((uint32_t)numpairs, transmits);
+	for (int i = 0; i < numpairs; i++)
+	{
+		mr_hl_stats stats;
+		ASSERT_EQ(MR_E_SUCCESS, mr_hl_get_stats(contexts[i * 2 + 1], &stats));
+		EXPECT_EQ(1u, stats.messages_arrived);
+	}
+
+	mr_hl_loop_destroy(loop);
+	for (int i = 0; i < numpairs * 2; i++)
+	{
+		mr_ctx_destroy(contexts[i]);
+	}
+}
+
+TEST(HighLevel, QueueFullFails)
+{
+	TEST_PREAMBLE;
+
+	// the loop is never run so actions stay queued until polled
+	auto loopcfg = loop_config();
+	auto loop = mr_hl_loop_create(&loopcfg);
+	HighLevel a(client);
+	auto cfg = a.config();
+	cfg.queue_capacity = 4;
+	cfg.queue_policy = MR_HL_QUEUE_FAIL;
+	cfg.queue_watermark = HighLevel::_queue_watermark;
+	cfg.queue_high_watermark = 3;
+	cfg.queue_low_watermark = 1;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, client, &cfg));
+
+	uint8_t message[16]{};
+	for (int i = 0; i < 4; i++)
+	{
+		EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+		EXPECT_EQ(i >= 2 ? 1u : 0u, a.high_watermarks);
+	}
+	EXPECT_EQ(MR_E_QUEUEFULL, mr_hl_send(client, message, sizeof(message), 0));
+	EXPECT_EQ(MR_E_QUEUEFULL, mr_hl_receive(client, 100, 0));
+
+	// control actions are always admitted
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_deactivate(client, 0));
+
+	uint32_t timeout;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_poll(loop, &timeout));
+	EXPECT_EQ(1u, a.high_watermarks);
+	EXPECT_EQ(1u, a.low_watermarks);
+
+	mr_hl_loop_destroy(loop);
+}
+
+TEST(HighLevel, QueueTimedOutActionsReclaimed)
+{
+	TEST_PREAMBLE;
+
+	auto loopcfg = loop_config();
+	auto loop = mr_hl_loop_create(&loopcfg);
+	HighLevel a(client);
+	auto cfg = a.config();
+	cfg.queue_capacity = 1;
+	cfg.queue_policy = MR_HL_QUEUE_FAIL;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, client, &cfg));
+
+	uint8_t message[16]{};
+	EXPECT_EQ(MR_E_TIMEOUT, mr_hl_send(client, message, sizeof(message), 10));
+	EXPECT_EQ(MR_E_TIMEOUT, mr_hl_send(client, message, sizeof(message), 10));
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+
+	mr_hl_loop_destroy(loop);
+}
+
+TEST(HighLevel, QueueFullDropsOldest)
+{
+	TEST_PREAMBLE;
+
+	auto loopcfg = loop_config();
+	auto loop = mr_hl_loop_create(&loopcfg);
+	HighLevel a(client);
+	auto cfg = a.config();
+	cfg.queue_capacity = 2;
+	cfg.queue_policy = MR_HL_QUEUE_DROP;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, client, &cfg));
+
+	uint8_t message[16]{};
+	mr_result oldest = MR_E_SUCCESS;
+	std::thread t([&]() { oldest = mr_hl_send(client, message, sizeof(message), 5000); });
+	std::this_thread::sleep_for(100ms);
+
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+	t.join();
+	EXPECT_EQ(MR_E_QUEUEFULL, oldest);
+
+	// with no messages to drop receives fail
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_deactivate(client, 0));
+	uint32_t timeout;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_poll(loop, &timeout));
+	mr_hl_loop_destroy(loop);
+
+	auto loop2 = mr_hl_loop_create(&loopcfg);
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop2, client, &cfg));
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_receive(client, 100, 0));
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_receive(client, 100, 0));
+	EXPECT_EQ(MR_E_QUEUEFULL, mr_hl_receive(client, 100, 0));
+	mr_hl_loop_destroy(loop2);
+}
+
+TEST(HighLevel, QueueFullBlocks)
+{
+	TEST_PREAMBLE;
+
+	auto loopcfg = loop_config();
+	auto loop = mr_hl_loop_create(&loopcfg);
+	HighLevel a(client);
+	auto cfg = a.config();
+	cfg.queue_capacity = 1;
+	cfg.queue_policy = MR_HL_QUEUE_BLOCK;
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, client, &cfg));
+
+	uint8_t message[16]{};
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+	EXPECT_EQ(MR_E_TIMEOUT, mr_hl_send(client, message, sizeof(message), 50));
+
+	// the producer is let through once the queue is serviced
+	std::atomic<bool> done{ false };
+	mr_result blocked = MR_E_SUCCESS;
+	std::thread t([&]() { blocked = mr_hl_send(client, message, sizeof(message), 0); done = true; });
+	std::this_thread::sleep_for(100ms);
+	EXPECT_FALSE(done);
+
+	uint32_t timeout;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_poll(loop, &timeout));
+	t.join();
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, blocked);
+
+	mr_hl_loop_destroy(loop);
+}
+
+TEST(HighLevel, QueueFullBlocksWithinTimeout)
+{
+	TEST_PREAMBLE;
+
+	auto loopcfg = loop_config();
+	loopcfg.now = [](void*) { return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); };
+	auto loop = mr_hl_loop_create(&loopcfg);
+	HighLevel a(client);
+	auto cfg = a.config();
+	cfg.queue_capacity = 1;
+	cfg.queue_policy = MR_HL_QUEUE_BLOCK;
+
+	// a sender woken up for space holds off until the poll is over
+	// so the poll does not get to its message as well
+	static std::atomic<bool> polled;
+	polled = false;
+	cfg.wait = [](void*, void* wh, uint32_t timeout)
+	{
+		bool woken = reinterpret_cast<notifier*>(wh)->wait(timeout);
+		while (woken && !polled) std::this_thread::yield();
+		return woken;
+	};
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_loop_attach(loop, client, &cfg));
+
+	uint8_t message[16]{};
+	EXPECT_EQ(MR_E_ACTION_ENQUEUED, mr_hl_send(client, message, sizeof(message), 0));
+
+	// the time spent waiting for space is not waited again for completion
+	mr_result blocked = MR_E_SUCCESS;
+	auto started = std::chrono::steady_clock::now();
+	std::thread t([&]() { blocked = mr_hl_send(client, message, sizeof(message), 400); });
+	std::this_thread::sleep_for(300ms);
+	uint32_t timeout;
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_loop_poll(loop, &timeout));
+	polled = true;
+	t.join();
+	EXPECT_EQ(MR_E_TIMEOUT, blocked);
+	EXPECT_LT(std::chrono::steady_clock::now() - started, 650ms);
+
+	mr_hl_loop_destroy(loop);
+}
+
+#ifdef __linux__
+
+TEST(HighLevel, DefaultWaitHandles)
+{
+	mr_hl_config cfg{};
+	ASSERT_EQ(MR_E_SUCCESS, mr_hl_set_default_wait_handles(&cfg));
+
+	void* wh = cfg.create_wait_handle(nullptr);
+	ASSERT_NE(nullptr, wh);
+
+	// not notified
+	EXPECT_FALSE(cfg.wait(nullptr, wh, 10));
+
+	// notifications are consumed by a wait and do not accumulate
+	cfg.notify(nullptr, wh);
+	cfg.notify(nullptr, wh);
+	EXPECT_TRUE(cfg.wait(nullptr, wh, 10));
+	EXPECT_FALSE(cfg.wait(nullptr, wh, 10));
+
+	// wakes up a thread that is asleep
+	std::atomic<bool> woken{ false };
+	std::thread t([&]() { woken = cfg.wait(nullptr, wh, 0xffffffff); });
+	std::this_thread::sleep_for(50ms);
+	cfg.notify(nullptr, wh);
+	t.join();
+	EXPECT_TRUE(woken);
+
+	cfg.destroy_wait_handle(nullptr, wh);
+}
+
+TEST(HighLevel, SendReceiveDefaultWaitHandles)
+{
+	TEST_PREAMBLE;
+
+	HighLevel a(client);
+	HighLevel b(server);
+	a.default_wait_handles = b.default_wait_handles = true;
+	HighLevel::connect(a, b);
+	a.run();
+	b.run();
+
+	EXPECT_EQ(MR_E_SUCCESS, mr_hl_initialize(client, 10000));
+
+	static constexpr int nummessages = 100;
+	std::atomic<int> received{ 0 };
+	b.data_callback_function([&](auto d, auto a) { received++; });
+
+	uint8_t message[32]{ 1 };
+	for (int i = 0; i < nummessages; i++)
+	{
+		EXPECT_EQ(MR_E_SUCCESS, mr_hl_send(client, message, sizeof(message), 1000));
+	}
+
+	for (int i = 0; i < 500 && received < nummessages; i++)
+	{
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(nummessages, received);
+
+	std::this_thread::sleep_for(300ms);
+	mr_hl_deactivate(client, 1000);
+	mr_hl_deactivate(server, 1000);
+	a.wait();
+	b.wait();
+}
+
+#endif
+
+#endif
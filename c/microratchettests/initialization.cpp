@@ -178,4 +178,29 @@ TEST(Initialization, FullReinitialization) {
 
 	EXPECT_NOT_EMPTY(buffer);
 	EXPECT_NOT_OVERFLOWED(buffer);
-}
\ No newline at end of file
+}
+TEST(Initialization, ForgedSignatureRejected) {
+	TEST_PREAMBLE;
+	constexpr uint32_t macsize = 12;
+	constexpr uint32_t signaturesize = 64;
+
+	// flip a bit of the signature under the encryption and put
+	// a good MAC on the request again, as anyone with the
+	// application key can.
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(client, buffer, buffersize, false));
+	buffer[buffersize - macsize - signaturesize] ^= 1;
+	auto mac = mr_poly_create(server);
+	ASSERT_NE(nullptr, mac);
+	ASSERT_EQ(MR_E_SUCCESS, mr_poly_init(mac, servercfg.applicationKey, sizeof(servercfg.applicationKey), buffer, 16));
+	ASSERT_EQ(MR_E_SUCCESS, mr_poly_process(mac, buffer, buffersize - macsize));
+	ASSERT_EQ(MR_E_SUCCESS, mr_poly_compute(mac, buffer + buffersize - macsize, macsize));
+	mr_poly_destroy(mac);
+	EXPECT_EQ(MR_E_INVALIDOP, mr_ctx_receive(server, buffer, buffersize, buffersize, nullptr, 0));
+
+	// a request signed properly is still accepted
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_initiate_initialization(client, buffer, buffersize, true));
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, buffer, buffersize, buffersize, nullptr, 0));
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(client, buffer, buffersize, buffersize, nullptr, 0));
+	ASSERT_EQ(MR_E_SENDBACK, mr_ctx_receive(server, buffer, buffersize, buffersize, nullptr, 0));
+	ASSERT_EQ(MR_E_SUCCESS, mr_ctx_receive(client, buffer, buffersize, buffersize, nullptr, 0));
+}
@@ -95,9 +95,15 @@ static void compare_states(mr_ctx _a, mr_ctx _b)
 			EXPECT_BUFFEREQS(ra->nextreceiveheaderkey, rb->nextreceiveheaderkey);
 			EXPECT_BUFFEREQS(ra->nextrootkey, rb->nextrootkey);
 			EXPECT_BUFFEREQS(ra->nextsendheaderkey, rb->nextsendheaderkey);
+			EXPECT_EQ(ra->sendingpending, rb->sendingpending);
+			EXPECT_BUFFEREQS(ra->remotepublickey, rb->remotepublickey);
 			EXPECT_BUFFEREQS(ra->receiveheaderkey, rb->receiveheaderkey);
 			EXPECT_BUFFEREQS(ra->receivingchain.chainkey, rb->receivingchain.chainkey);
 			EXPECT_BUFFEREQS(ra->receivingchain.oldchainkey, rb->receivingchain.oldchainkey);
+			EXPECT_EQ(0, memcmp(ra->receivingchain.replay, rb->receivingchain.replay, sizeof(ra->receivingchain.replay)));
+#if MR_CHAIN_CHECKPOINTS > 0
+			EXPECT_EQ(0, memcmp(ra->receivingchain.checkpoints, rb->receivingchain.checkpoints, sizeof(ra->receivingchain.checkpoints)));
+#endif
 			EXPECT_BUFFEREQS(ra->sendheaderkey, rb->sendheaderkey);
 			EXPECT_BUFFEREQS(ra->sendingchain.chainkey, rb->sendingchain.chainkey);
 			EXPECT_BUFFEREQS(ra->sendingchain.oldchainkey, rb->sendingchain.oldchainkey);
@@ -110,7 +116,7 @@ static void compare_states(mr_ctx _a, mr_ctx _b)
 void store_and_load(_mr_ctx* ctx)
 {
 	uint32_t amountread;
-	uint8_t storage[2048] = { 0 };
+	uint8_t storage[4096] = { 0 };
 	uint32_t spaceNeeded = mr_ctx_state_size_needed(ctx);
 	EXPECT_GT(spaceNeeded, (uint32_t)0);
 	EXPECT_LE(spaceNeeded, sizeof(storage));
@@ -385,6 +391,14 @@ TEST(Storage, Ratchet1) {
 		FILLRANDOM(step->receivingchain.chainkey);
 		step->receivingchain.oldgeneration = 6;
 		FILLRANDOM(step->receivingchain.oldchainkey);
+		mr_rng_generate(ctx->rng_ctx, (uint8_t*)step->receivingchain.replay, sizeof(step->receivingchain.replay));
+#if MR_CHAIN_CHECKPOINTS > 0
+		for (auto& c : step->receivingchain.checkpoints)
+		{
+			c.generation = i * 100 + 1;
+			FILLRANDOM(c.chainkey);
+		}
+#endif
 		FILLRANDOM(step->sendheaderkey);
 		step->sendingchain.generation = 7;
 		FILLRANDOM(step->sendingchain.chainkey);
@@ -500,6 +514,8 @@ TEST(Storage, Ratchet5) {
 		FILLRANDOM(step->receivingchain.chainkey);
 		step->receivingchain.oldgeneration = 6;
 		FILLRANDOM(step->receivingchain.oldchainkey);
+		step->sendingpending = true;
+		FILLRANDOM(step->remotepublickey);
 	}
 
 	store_and_load(mrctx);
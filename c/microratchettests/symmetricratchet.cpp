@@ -4,6 +4,7 @@
 #include "support.h"
 
 #include <array>
+#include <vector>
 
 static mr_config _cfg{ true };
 
@@ -116,9 +117,9 @@ TEST(SymmetricRatchet, BasicReceive) {
 	uint8_t ck[32];
 	mr_rng_generate(rng, ck, sizeof(ck));
 
-	_mr_chain_state chain{};
+	_mr_receiving_chain_state chain{};
 
-	auto r = chain_initialize(ctx, &chain, ck, sizeof(ck));
+	auto r = chain_initialize_receiving(&chain, ck, sizeof(ck));
 	ASSERT_EQ(r, MR_E_SUCCESS);
 
 	uint8_t key[MSG_KEY_SIZE]{};
@@ -145,9 +146,9 @@ TEST(SymmetricRatchet, MultiReceive) {
 	uint8_t ck[32];
 	mr_rng_generate(rng, ck, sizeof(ck));
 
-	_mr_chain_state chain{};
+	_mr_receiving_chain_state chain{};
 
-	auto r = chain_initialize(ctx, &chain, ck, sizeof(ck));
+	auto r = chain_initialize_receiving(&chain, ck, sizeof(ck));
 	ASSERT_EQ(r, MR_E_SUCCESS);
 
 	uint8_t key1[MSG_KEY_SIZE]{};
@@ -179,9 +180,9 @@ TEST(SymmetricRatchet, SkipReceive) {
 	uint8_t ck[32];
 	mr_rng_generate(rng, ck, sizeof(ck));
 
-	_mr_chain_state chain{};
+	_mr_receiving_chain_state chain{};
 
-	auto r = chain_initialize(ctx, &chain, ck, sizeof(ck));
+	auto r = chain_initialize_receiving(&chain, ck, sizeof(ck));
 	ASSERT_EQ(r, MR_E_SUCCESS);
 
 	uint8_t key1[MSG_KEY_SIZE]{};
@@ -210,9 +211,9 @@ TEST(SymmetricRatchet, OooReceive) {
 	uint8_t ck[32];
 	mr_rng_generate(rng, ck, sizeof(ck));
 
-	_mr_chain_state chain{};
+	_mr_receiving_chain_state chain{};
 
-	auto r = chain_initialize(ctx, &chain, ck, sizeof(ck));
+	auto r = chain_initialize_receiving(&chain, ck, sizeof(ck));
 	ASSERT_EQ(r, MR_E_SUCCESS);
 
 	uint8_t key1[MSG_KEY_SIZE]{};
@@ -241,6 +242,122 @@ TEST(SymmetricRatchet, OooReceive) {
 	mr_ctx_destroy(ctx);
 }
 
+#if MR_CHAIN_CHECKPOINTS > 0
+static uint32_t checkpoints_in_use(const _mr_receiving_chain_state& chain, uint32_t* newest)
+{
+	uint8_t zeroes32[KEY_SIZE]{};
+	uint32_t count = 0;
+	for (auto& c : chain.checkpoints)
+	{
+		if (memcmp(c.chainkey, zeroes32, KEY_SIZE))
+		{
+			count++;
+			if (newest && c.generation > *newest) *newest = c.generation;
+		}
+	}
+	return count;
+}
+
+TEST(SymmetricRatchet, Checkpoints) {
+	mr_ctx ctx = mr_ctx_create(&_cfg);
+	mr_rng_ctx rng = mr_rng_create(ctx);
+
+	uint8_t ck[32];
+	mr_rng_generate(rng, ck, sizeof(ck));
+
+	_mr_chain_state chaina{};
+	_mr_receiving_chain_state chainb{};
+	ASSERT_EQ(MR_E_SUCCESS, chain_initialize(ctx, &chaina, ck, sizeof(ck)));
+	ASSERT_EQ(MR_E_SUCCESS, chain_initialize_receiving(&chainb, ck, sizeof(ck)));
+
+	constexpr uint32_t last = MR_REPLAY_WINDOW + 72;
+	std::vector<std::array<uint8_t, MSG_KEY_SIZE>> keys(last + 1);
+	for (uint32_t i = 1; i <= last; i++)
+	{
+		uint32_t gen;
+		ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforsending(ctx, &chaina, keys[i].data(), MSG_KEY_SIZE, &gen));
+		ASSERT_EQ(i, gen);
+	}
+
+	// skipping leaves checkpoints behind in the window
+	uint8_t key[MSG_KEY_SIZE];
+	ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforreceiving(ctx, &chainb, 1, key, sizeof(key)));
+	ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforreceiving(ctx, &chainb, last, key, sizeof(key)));
+	EXPECT_BUFFEREQ(keys[last].data(), MSG_KEY_SIZE, key, sizeof(key));
+	EXPECT_EQ(1U, chainb.oldgeneration);
+	uint32_t newest = 0;
+	EXPECT_GT(checkpoints_in_use(chainb, &newest), 0U);
+	EXPECT_EQ(0U, newest % MR_CHECKPOINT_INTERVAL);
+	EXPECT_LT(last - newest, (uint32_t)MR_REPLAY_WINDOW);
+
+	// a late message is received from the closest checkpoint, which moves along
+	ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforreceiving(ctx, &chainb, newest + 1, key, sizeof(key)));
+	EXPECT_BUFFEREQ(keys[newest + 1].data(), MSG_KEY_SIZE, key, sizeof(key));
+	uint32_t moved = 0;
+	checkpoints_in_use(chainb, &moved);
+	EXPECT_EQ(newest + 1, moved);
+
+	// once everything in the window is received the checkpoints are gone
+	for (uint32_t i = last - MR_REPLAY_WINDOW + 1; i < last; i++)
+	{
+		if (i == newest + 1) continue;
+		ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforreceiving(ctx, &chainb, i, key, sizeof(key)));
+		EXPECT_BUFFEREQ(keys[i].data(), MSG_KEY_SIZE, key, sizeof(key));
+	}
+	EXPECT_EQ(0U, checkpoints_in_use(chainb, nullptr));
+	EXPECT_EQ(MR_E_REPLAY, chain_ratchetforreceiving(ctx, &chainb, last - MR_REPLAY_WINDOW, key, sizeof(key)));
+	EXPECT_EQ(MR_E_REPLAY, chain_ratchetforreceiving(ctx, &chainb, newest + 1, key, sizeof(key)));
+
+	mr_rng_destroy(rng);
+	mr_ctx_destroy(ctx);
+}
+
+TEST(SymmetricRatchet, CheckpointsErasedAfterCatchingUp) {
+	mr_config cfg{ true };
+	cfg.kdf_budget = 20;
+	mr_ctx ctx = mr_ctx_create(&cfg);
+	mr_rng_ctx rng = mr_rng_create(ctx);
+
+	uint8_t ck[32];
+	mr_rng_generate(rng, ck, sizeof(ck));
+
+	_mr_chain_state chaina{};
+	_mr_receiving_chain_state chainb{};
+	ASSERT_EQ(MR_E_SUCCESS, chain_initialize(ctx, &chaina, ck, sizeof(ck)));
+	ASSERT_EQ(MR_E_SUCCESS, chain_initialize_receiving(&chainb, ck, sizeof(ck)));
+
+	constexpr uint32_t last = 100;
+	std::vector<std::array<uint8_t, MSG_KEY_SIZE>> keys(last + 1);
+	for (uint32_t i = 1; i <= last; i++)
+	{
+		uint32_t gen;
+		ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforsending(ctx, &chaina, keys[i].data(), MSG_KEY_SIZE, &gen));
+	}
+
+	// catching up in steps leaves checkpoints that are not on an interval
+	uint8_t key[MSG_KEY_SIZE];
+	ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforreceiving(ctx, &chainb, 1, key, sizeof(key)));
+	mr_result r;
+	while ((r = chain_ratchetforreceiving(ctx, &chainb, last, key, sizeof(key))) == MR_E_PENDING);
+	ASSERT_EQ(MR_E_SUCCESS, r);
+	EXPECT_GT(checkpoints_in_use(chainb, nullptr), 0U);
+
+	// every key kept for late messages is erased once they are all in
+	for (uint32_t i = 2; i < last; i++)
+	{
+		ASSERT_EQ(MR_E_SUCCESS, chain_ratchetforreceiving(ctx, &chainb, i, key, sizeof(key)));
+		EXPECT_BUFFEREQ(keys[i].data(), MSG_KEY_SIZE, key, sizeof(key));
+	}
+
+	uint8_t zeroes32[KEY_SIZE]{};
+	EXPECT_EQ(0U, checkpoints_in_use(chainb, nullptr));
+	EXPECT_BUFFEREQ(zeroes32, sizeof(zeroes32), chainb.oldchainkey, sizeof(chainb.oldchainkey));
+
+	mr_rng_destroy(rng);
+	mr_ctx_destroy(ctx);
+}
+#endif
+
 TEST(SymmetricRatchet, BasicSymmetry) {
 	mr_ctx ctx = mr_ctx_create(&_cfg);
 	mr_rng_ctx rng = mr_rng_create(ctx);
@@ -249,11 +366,11 @@ TEST(SymmetricRatchet, BasicSymmetry) {
 	mr_rng_generate(rng, ck, sizeof(ck));
 
 	_mr_chain_state chaina{};
-	_mr_chain_state chainb{};
+	_mr_receiving_chain_state chainb{};
 	
 	auto r = chain_initialize(ctx, &chaina, ck, sizeof(ck));
 	ASSERT_EQ(MR_E_SUCCESS, r);
-	r = chain_initialize(ctx, &chainb, ck, sizeof(ck));
+	r = chain_initialize_receiving(&chainb, ck, sizeof(ck));
 	ASSERT_EQ(MR_E_SUCCESS, r);
 
 	uint8_t keya[MSG_KEY_SIZE]{};
@@ -280,11 +397,11 @@ TEST(SymmetricRatchet, MultiSymmetry) {
 	mr_rng_generate(rng, ck, sizeof(ck));
 
 	_mr_chain_state chaina{};
-	_mr_chain_state chainb{};
+	_mr_receiving_chain_state chainb{};
 
 	auto r = chain_initialize(ctx, &chaina, ck, sizeof(ck));
 	ASSERT_EQ(MR_E_SUCCESS, r);
-	r = chain_initialize(ctx, &chainb, ck, sizeof(ck));
+	r = chain_initialize_receiving(&chainb, ck, sizeof(ck));
 	ASSERT_EQ(MR_E_SUCCESS, r);
 
 	uint32_t gen1;
@@ -323,11 +440,11 @@ void deepsymmetrytest(uint32_t depth)
 	mr_rng_generate(rng, ck, sizeof(ck));
 
 	_mr_chain_state chaina{};
-	_mr_chain_state chainb{};
+	_mr_receiving_chain_state chainb{};
 
 	auto r = chain_initialize(ctx, &chaina, ck, sizeof(ck));
 	ASSERT_EQ(MR_E_SUCCESS, r);
-	r = chain_initialize(ctx, &chainb, ck, sizeof(ck));
+	r = chain_initialize_receiving(&chainb, ck, sizeof(ck));
 	ASSERT_EQ(MR_E_SUCCESS, r);
 
 	uint32_t gen = 0;
@@ -363,9 +480,9 @@ void receivetest(uint32_t depth)
 	uint8_t ck[32];
 	mr_rng_generate(rng, ck, sizeof(ck));
 
-	_mr_chain_state chain{};
+	_mr_receiving_chain_state chain{};
 
-	auto r = chain_initialize(ctx, &chain, ck, sizeof(ck));
+	auto r = chain_initialize_receiving(&chain, ck, sizeof(ck));
 	ASSERT_EQ(r, MR_E_SUCCESS);
 
 	uint8_t key[MSG_KEY_SIZE]{};
@@ -395,9 +512,9 @@ void testratchet(const uint8_t chainkey[], size_t chainkeysize,
 	const uint8_t expectedkey[], size_t expectedkeysize)
 {
 	auto ctx = mr_ctx_create(&_cfg);
-	_mr_chain_state chain{};
+	_mr_receiving_chain_state chain{};
 	
-	auto r = chain_initialize(ctx, &chain, chainkey, (uint32_t)chainkeysize);
+	auto r = chain_initialize_receiving(&chain, chainkey, (uint32_t)chainkeysize);
 	ASSERT_EQ(r, MR_E_SUCCESS);
 
 	uint8_t key[MSG_KEY_SIZE]{};
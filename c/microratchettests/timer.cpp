@@ -0,0 +1,138 @@
+#include "pch.h"
+#include <microratchet.h>
+#include <internal.h>
+#include "support.h"
+
+static int count(_mr_timer* expired)
+{
+	int n = 0;
+	for (; expired; expired = expired->next) n++;
+	return n;
+}
+
+TEST(Timer, FiresWhenDue) {
+	_mr_timer_wheel wheel;
+	_mr_timer timer{};
+	timer_wheel_init(&wheel, 1000);
+
+	timer_schedule(&wheel, &timer, 1010);
+	EXPECT_EQ(10U, timer_wheel_next(&wheel, 1000));
+	EXPECT_EQ(nullptr, timer_wheel_advance(&wheel, 1009));
+	EXPECT_EQ(&timer, timer_wheel_advance(&wheel, 1010));
+	EXPECT_EQ(nullptr, timer_wheel_advance(&wheel, 1020));
+	EXPECT_EQ(0xffffffffU, timer_wheel_next(&wheel, 1020));
+}
+
+TEST(Timer, FiresLate) {
+	_mr_timer_wheel wheel;
+	_mr_timer timer{};
+	timer_wheel_init(&wheel, 0);
+
+	timer_schedule(&wheel, &timer, 5);
+	EXPECT_EQ(&timer, timer_wheel_advance(&wheel, 100000));
+}
+
+TEST(Timer, FiresExpired) {
+	_mr_timer_wheel wheel;
+	_mr_timer timer{};
+	timer_wheel_init(&wheel, 100);
+
+	timer_schedule(&wheel, &timer, 50);
+	EXPECT_EQ(0U, timer_wheel_next(&wheel, 100));
+	EXPECT_EQ(&timer, timer_wheel_advance(&wheel, 100));
+}
+
+TEST(Timer, Cancel) {
+	_mr_timer_wheel wheel;
+	_mr_timer a{}, b{};
+	timer_wheel_init(&wheel, 0);
+
+	timer_schedule(&wheel, &a, 10);
+	timer_schedule(&wheel, &b, 10);
+	timer_cancel(&wheel, &a);
+	timer_cancel(&wheel, &a);
+	EXPECT_EQ(&b, timer_wheel_advance(&wheel, 10));
+	EXPECT_EQ(0U, wheel.count);
+}
+
+TEST(Timer, Reschedule) {
+	_mr_timer_wheel wheel;
+	_mr_timer timer{};
+	timer_wheel_init(&wheel, 0);
+
+	timer_schedule(&wheel, &timer, 10);
+	timer_schedule(&wheel, &timer, 5000);
+	EXPECT_EQ(1U, wheel.count);
+	EXPECT_EQ(nullptr, timer_wheel_advance(&wheel, 4999));
+	EXPECT_EQ(&timer, timer_wheel_advance(&wheel, 5000));
+}
+
+TEST(Timer, CascadesAcrossLevels) {
+	_mr_timer_wheel wheel;
+	_mr_timer timers[5]{};
+	uint32_t expires[5] = { 70, 4100, 300000, 20000000, 1000000000 };
+	timer_wheel_init(&wheel, 3);
+
+	for (int i = 0; i < 5; i++)
+	{
+		timer_schedule(&wheel, &timers[i], expires[i]);
+	}
+
+	// step through time in uneven increments and make sure each
+	// timer fires in the step that covers its expiry time.
+	uint32_t now = 3;
+	int fired = 0;
+	while (fired < 5)
+	{
+		uint32_t next = timer_wheel_next(&wheel, now);
+		ASSERT_NE(0xffffffffU, next);
+		ASSERT_GT(next, 0U);
+		uint32_t step = next * 3 / 2 + 1;
+		_mr_timer* expired = timer_wheel_advance(&wheel, now + step);
+		for (_mr_timer* t = expired; t; t = t->next)
+		{
+			EXPECT_EQ(&timers[fired], t);
+			EXPECT_LE((int32_t)(t->expires - now), (int32_t)step);
+			EXPECT_GT((int32_t)(t->expires - now), 0);
+		}
+		fired += count(expired);
+		now += step;
+	}
+
+	EXPECT_EQ(0U, wheel.count);
+}
+
+TEST(Timer, SleepsUntilFarTimers) {
+	_mr_timer_wheel wheel;
+	_mr_timer timer{};
+	timer_wheel_init(&wheel, 0);
+
+	// waking up only when the timer moves down a level
+	timer_schedule(&wheel, &timer, 300000);
+	uint32_t now = 0;
+	int wakeups = 0;
+	_mr_timer* expired = nullptr;
+	while (!expired)
+	{
+		uint32_t next = timer_wheel_next(&wheel, now);
+		ASSERT_NE(0xffffffffU, next);
+		ASSERT_GT(next, 0U);
+		now += next;
+		expired = timer_wheel_advance(&wheel, now);
+		wakeups++;
+	}
+
+	EXPECT_EQ(&timer, expired);
+	EXPECT_EQ(300000U, now);
+	EXPECT_LE(wakeups, TIMER_WHEEL_LEVELS);
+}
+
+TEST(Timer, WrapsAround) {
+	_mr_timer_wheel wheel;
+	_mr_timer timer{};
+	timer_wheel_init(&wheel, 0xfffffff0);
+
+	timer_schedule(&wheel, &timer, 0x20);
+	EXPECT_EQ(nullptr, timer_wheel_advance(&wheel, 0x1f));
+	EXPECT_EQ(&timer, timer_wheel_advance(&wheel, 0x20));
+}